@@ -4,8 +4,16 @@
       "target_name": "niagrad",
       "type": "executable",
       "sources": [ "./tools/niagrad/src/niagrad.c",
+                   "./tools/niagrad/src/control.c",
+                   "./tools/niagrad/src/event.c",
+                   "./tools/niagrad/src/json.c",
+                   "./tools/niagrad/src/listen.c",
+                   "./tools/niagrad/src/log.c",
+                   "./tools/niagrad/src/metrics.c",
+                   "./tools/niagrad/src/proc.c",
                    "./tools/niagrad/src/str.c" ],
       "include_dirs": [ "./tools/niagrad/src/" ],
+      "ldflags": [ "-pthread" ],
     }
   ]
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 var http = require('http');
+var fs = require('fs');
 var pid = process.pid
 
 var server = http.createServer(helloWorld)
@@ -35,6 +36,16 @@ server.on("close", server_close)
 server.on("error", server_error)
 process.on("SIGUSR2", sigusr2)
 
-server.listen({ fd: 3 })
+/* Tell niagrad we are accepting, so it can retire the server we replace. */
+function server_listening() {
+    var i = process.argv.indexOf('--notify')
+    if (i != -1) {
+        var fd = parseInt(process.argv[i + 1])
+        fs.writeSync(fd, 'ready\n')
+        fs.closeSync(fd)
+    }
+}
+
+server.listen({ fd: 3 }, server_listening)
 
 console.log('[' + pid + ']', 'Started')
@@ -2,6 +2,7 @@ var express = require("express")
   , http = require("http")
   , https = require("https")
   , fs = require("fs")
+  , net = require("net")
   , buffer = require("buffer")
 
 exports = module.exports = createServers
@@ -32,7 +33,7 @@ function Server(type, name, fd) {
     this.name = name
     this.fd = fd
 
-    this.start = function(app, f) {
+    this.start = function(app, f, listening) {
         var that = this;
         console.log('[' + pid + ', ' + this.name + ']', 'Starting')
         if (this.type === "secure") {
@@ -46,16 +47,79 @@ function Server(type, name, fd) {
         this.server.on("close", function() { return close(that) })
         this.server.on("error", function() { return error(that) })
         process.on("SIGUSR2", function() { return sigusr2(that) })
-        return this.server.listen( { fd: this.fd }, f)
+        return this.server.listen( { fd: this.fd }, function() {
+            listening()
+            if (f) f.apply(this, arguments)
+        })
     }
 }
 
-function start(servers, test, app, f) {
-    servers.forEach(function(server) {
-        if (!test || test(server)) {
-            server.start(app, f)
+/* Tell niagrad this server is accepting, once every socket started so far
+   is listening. niagrad only retires the server being replaced after this. */
+function listening(niagra) {
+    niagra.listening++
+    if (niagra.notify === null || niagra.listening < niagra.started) {
+        return
+    }
+    if (niagra.control) {
+        niagra.control.end("ready\n")
+    } else {
+        try {
+            fs.writeSync(niagra.notify, "ready\n")
+            fs.closeSync(niagra.notify)
+        } catch (e) {
+            console.log('[' + pid + ']', 'Unable to notify niagrad of readiness: ' + e.message)
+        }
+    }
+    niagra.notify = null
+}
+
+/* A standby has loaded the app but does not listen until niagrad sends
+   "start <slot>". Then it takes that slot's shard of each reuseport socket. */
+function standby(niagra, test, app, f) {
+    niagra.deferred.push(function() { start(niagra, test, app, f) })
+    if (niagra.control) {
+        return
+    }
+
+    niagra.control = new net.Socket({ fd: niagra.notify, readable: true, writable: true })
+    process.nextTick(function() { niagra.control.write("ready\n") })
+
+    var input = ""
+    niagra.control.on("data", function(data) {
+        input += data
+        var m = /start (\d+)\n/.exec(input)
+        if (m) {
+            niagra.control.removeAllListeners("data")
+            promote(niagra, parseInt(m[1]))
+        }
+    })
+}
+
+function promote(niagra, slot) {
+    console.log('[' + pid + ']', 'Standby promoted to slot ' + slot)
+    niagra.standby = false
+    niagra.servers.forEach(function(server) {
+        var shards = niagra.shards[server.name]
+        if (shards) {
+            server.fd = shards[slot]
+            shards.forEach(function(fd, i) {
+                if (i != slot) fs.closeSync(fd)
+            })
         }
     })
+    niagra.deferred.forEach(function(f) { f() })
+}
+
+function start(niagra, test, app, f) {
+    if (niagra.standby) {
+        return standby(niagra, test, app, f)
+    }
+    var servers = niagra.servers.filter(function(server) { return !test || test(server) })
+    niagra.started += servers.length
+    servers.forEach(function(server) {
+        server.start(app, f, function() { return listening(niagra) })
+    })
 }
 
 function parseArguments(niagra) {
@@ -83,6 +147,27 @@ function parseArguments(niagra) {
             break
         }
 
+        case "--notify": {
+            niagra.notify = parseInt(process.argv[++i])
+            break
+        }
+
+        case "--standby": {
+            niagra.standby = true
+            break
+        }
+
+        case "--shard": {
+            i++
+            var parts = process.argv[i].split(',')
+            if (parts.length != 3) {
+                throw new Error('malformed --shard argument passed \'' + process.argv[i] + '\'')
+            }
+            var shards = niagra.shards[parts[0]] = niagra.shards[parts[0]] || []
+            shards[parseInt(parts[1])] = parseInt(parts[2])
+            break
+        }
+
         case "--file": {
             i++
             var parts = process.argv[i].split(',')
@@ -159,6 +244,13 @@ function createServers() {
         secureKey: null,
         secureCert: null,
         config: {},
+        notify: null,
+        started: 0,
+        listening: 0,
+        standby: false,
+        shards: {},
+        deferred: [],
+        control: null,
     }
 
     parseArguments(niagra)
@@ -169,18 +261,18 @@ function createServers() {
 
     niagra.secure = {
         start: function(app, f) {
-            start(niagra.servers, function(server) { return server.type == "secure" }, app, f)
+            start(niagra, function(server) { return server.type == "secure" }, app, f)
         }
     }
 
     niagra.insecure = {
         start: function(app, f) {
-            start(niagra.servers, function(server) { return server.type == "insecure" }, app, f)
+            start(niagra, function(server) { return server.type == "insecure" }, app, f)
         }
     }
 
     niagra.start = function(app, f) {
-        start(niagra.servers, false, app, f)
+        start(niagra, false, app, f)
     }
 
     return niagra
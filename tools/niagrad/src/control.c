@@ -0,0 +1,544 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "event.h"
+#include "control.h"
+
+#define MAX_REQUEST 4096
+#define CONTROL_BACKLOG 16
+/* The most clients served at once on each listening socket. Beyond that
+   connections wait in the backlog. */
+#define MAX_CLIENTS 32
+/* How long a client has to send its request and read the reply, in
+   milliseconds. */
+#define CLIENT_TIMEOUT 10000
+/* How long accepting stops when niagrad is out of fds, in milliseconds. */
+#define ACCEPT_RETRY 1000
+
+struct listener {
+    struct event_source ev;
+    const char *end; /* marks the end of a request */
+    control_handler handler;
+    int num_clients;
+    bool paused; /* not watched for connections */
+    struct timer retry_timer;
+};
+
+struct client {
+    struct event_source ev;
+    struct listener *listener;
+    struct timer timer;
+    char request[MAX_REQUEST];
+    size_t request_len;
+    char *reply;
+    size_t reply_len;
+    size_t reply_pos;
+    int *fds; /* passed with the reply */
+    int num_fds;
+};
+
+static char control_path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+static int control_socket = -1;
+/* The client whose request is being handled. */
+static struct client *handling;
+
+static void control_accept(struct event_source *source, uint32_t events);
+static void listener_pause(struct listener *listener);
+static void listener_resume(struct listener *listener);
+static void listener_retry(struct timer *t);
+static void client_timeout(struct timer *t);
+static void client_event(struct event_source *source, uint32_t events);
+static void client_read(struct client *client);
+static bool client_write(struct client *client);
+static ssize_t client_send_fds(struct client *client);
+static void client_close_fds(struct client *client);
+static void client_close(struct client *client);
+
+static int
+make_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof addr->sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/**
+ * Listen for control requests on a unix socket at 'path', replacing any
+ * stale socket there. Only the owner may connect.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_listen(const char *path, control_handler handler)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int s;
+
+    if (make_address(&addr, path) == -1) {
+        return -1;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s == -1) {
+        return -1;
+    }
+
+    (void) unlink(path);
+
+    mask = umask(077);
+    if (bind(s, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        (void) umask(mask);
+        (void) close(s);
+        return -1;
+    }
+    (void) umask(mask);
+
+    if (listen(s, CONTROL_BACKLOG) == -1) {
+        (void) close(s);
+        return -1;
+    }
+
+    if (control_serve(s, "\n", handler) == -1) {
+        (void) close(s);
+        return -1;
+    }
+
+    strcpy(control_path, path);
+    control_socket = s;
+
+    return 0;
+}
+
+/**
+ * Serve control requests on 's', a control socket already listening at
+ * 'path', such as one inherited across exec.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_adopt(int s, const char *path, control_handler handler)
+{
+    if (strlen(path) >= sizeof control_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1 || fcntl(s, F_SETFL, O_NONBLOCK) == -1 ||
+        control_serve(s, "\n", handler) == -1) {
+        return -1;
+    }
+
+    strcpy(control_path, path);
+    control_socket = s;
+
+    return 0;
+}
+
+/**
+ * Return the listening control socket, or -1 if there is none.
+ */
+int
+control_fd(void)
+{
+    return control_socket;
+}
+
+/**
+ * Serve requests on the listening socket 's', which must be non-blocking.
+ * A request ends with the string 'end', which is not passed to 'handler'.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_serve(int s, const char *end, control_handler handler)
+{
+    struct listener *listener;
+
+    listener = calloc(1, sizeof *listener);
+    if (listener == NULL) {
+        return -1;
+    }
+
+    listener->ev.fd = s;
+    listener->ev.handler = control_accept;
+    listener->ev.data = listener;
+    listener->end = end;
+    listener->handler = handler;
+    listener->retry_timer.handler = listener_retry;
+    listener->retry_timer.data = listener;
+
+    if (event_add(&listener->ev, EPOLLIN) == -1) {
+        free(listener);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Return the pid and uid of the client whose request is being handled, in
+ * 'pid' and 'uid'. Only valid from a control_handler.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_peer(pid_t *pid, uid_t *uid)
+{
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (handling == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (getsockopt(handling->ev.fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        return -1;
+    }
+
+    *pid = cred.pid;
+    *uid = cred.uid;
+
+    return 0;
+}
+
+/**
+ * Pass the 'n' fds in 'fds' to the client whose request is being handled,
+ * as SCM_RIGHTS with the start of the reply. They are duplicated, so they
+ * may be closed before the reply has gone out. Only valid once from a
+ * control_handler.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_attach_fds(const int *fds, int n)
+{
+    int i;
+
+    if (handling == NULL || handling->fds != NULL || n <= 0 || n > CONTROL_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    handling->fds = calloc(n, sizeof *handling->fds);
+    if (handling->fds == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        handling->fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if (handling->fds[i] == -1) {
+            client_close_fds(handling);
+            return -1;
+        }
+        handling->num_fds = i + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Remove the control socket from the file system.
+ */
+void
+control_unlink(void)
+{
+    if (control_path[0] != '\0') {
+        (void) unlink(control_path);
+    }
+}
+
+static void
+control_accept(struct event_source *source, uint32_t events)
+{
+    struct listener *listener = source->data;
+    struct client *client;
+    int s;
+
+    while (listener->num_clients < MAX_CLIENTS) {
+        s = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s == -1) {
+            /* The connection stays queued and the socket readable, so
+               rather than spin, stop accepting until fds may be free. */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                listener_pause(listener);
+                timer_start(&listener->retry_timer, ACCEPT_RETRY);
+            }
+            return;
+        }
+
+        client = calloc(1, sizeof *client);
+        if (client == NULL) {
+            (void) close(s);
+            continue;
+        }
+
+        client->ev.fd = s;
+        client->ev.handler = client_event;
+        client->ev.data = client;
+        client->listener = listener;
+        client->timer.handler = client_timeout;
+        client->timer.data = client;
+
+        if (event_add(&client->ev, EPOLLIN) == -1) {
+            (void) close(s);
+            free(client);
+            continue;
+        }
+
+        listener->num_clients++;
+        timer_start(&client->timer, CLIENT_TIMEOUT);
+    }
+
+    listener_pause(listener);
+}
+
+/* Stop watching for connections, which wait in the backlog meanwhile. */
+static void
+listener_pause(struct listener *listener)
+{
+    if (!listener->paused && event_modify(&listener->ev, 0) == 0) {
+        listener->paused = true;
+    }
+}
+
+/* Watch for connections again, unless at the limit or backing off. */
+static void
+listener_resume(struct listener *listener)
+{
+    if (listener->paused && listener->num_clients < MAX_CLIENTS && !timer_armed(&listener->retry_timer) &&
+        event_modify(&listener->ev, EPOLLIN) == 0) {
+        listener->paused = false;
+    }
+}
+
+static void
+listener_retry(struct timer *t)
+{
+    listener_resume(t->data);
+}
+
+/* A client which neither finishes its request nor reads the reply in time
+   is dropped, so idle connections cannot use up niagrad's fds. */
+static void
+client_timeout(struct timer *t)
+{
+    client_close(t->data);
+}
+
+static void
+client_event(struct event_source *source, uint32_t events)
+{
+    struct client *client = source->data;
+
+    if (client->reply == NULL) {
+        client_read(client);
+    } else {
+        (void) client_write(client);
+    }
+}
+
+/* Read until the request line is complete, then handle it. */
+static void
+client_read(struct client *client)
+{
+    FILE *reply;
+    char *end;
+    ssize_t n;
+
+    n = read(client->ev.fd, client->request + client->request_len,
+             sizeof client->request - client->request_len - 1);
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (n <= 0) {
+        client_close(client);
+        return;
+    }
+
+    client->request_len += n;
+    client->request[client->request_len] = '\0';
+
+    end = strstr(client->request, client->listener->end);
+    if (end == NULL) {
+        if (client->request_len == sizeof client->request - 1) {
+            client_close(client);
+        }
+        return;
+    }
+    *end = '\0';
+
+    reply = open_memstream(&client->reply, &client->reply_len);
+    if (reply == NULL) {
+        client_close(client);
+        return;
+    }
+
+    handling = client;
+    client->listener->handler(client->request, reply);
+    handling = NULL;
+
+    if (fclose(reply) != 0 || client->reply == NULL) {
+        client_close(client);
+        return;
+    }
+
+    /* Most replies fit in the socket buffer, so try straight away, and
+       only wait for room if some of it is left. */
+    if (!client_write(client) && event_modify(&client->ev, EPOLLOUT) == -1) {
+        client_close(client);
+    }
+}
+
+/* Write as much of the reply as the socket takes. Return true if the
+   client has been closed, because the reply is complete or on error, and
+   false if the rest must wait for the socket to be writable. */
+static bool
+client_write(struct client *client)
+{
+    ssize_t n;
+
+    while (client->reply_pos < client->reply_len) {
+        if (client->num_fds > 0) {
+            n = client_send_fds(client);
+        } else {
+            n = write(client->ev.fd, client->reply + client->reply_pos, client->reply_len - client->reply_pos);
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return false;
+            }
+            break;
+        }
+        client->reply_pos += n;
+    }
+
+    client_close(client);
+
+    return true;
+}
+
+/* Write the rest of the reply with the attached fds, which are closed
+   once they have been sent. */
+static ssize_t
+client_send_fds(struct client *client)
+{
+    union {
+        char buf[CMSG_SPACE(CONTROL_MAX_FDS * sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = client->reply + client->reply_pos;
+    iov.iov_len = client->reply_len - client->reply_pos;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(client->num_fds * sizeof (int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(client->num_fds * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), client->fds, client->num_fds * sizeof (int));
+
+    n = sendmsg(client->ev.fd, &msg, 0);
+    if (n != -1) {
+        client_close_fds(client);
+    }
+
+    return n;
+}
+
+static void
+client_close_fds(struct client *client)
+{
+    while (client->num_fds > 0) {
+        (void) close(client->fds[--client->num_fds]);
+    }
+    free(client->fds);
+    client->fds = NULL;
+}
+
+static void
+client_close(struct client *client)
+{
+    struct listener *listener = client->listener;
+
+    timer_stop(&client->timer);
+    (void) event_del(&client->ev);
+    (void) close(client->ev.fd);
+    client_close_fds(client);
+    free(client->reply);
+    free(client);
+
+    listener->num_clients--;
+    listener_resume(listener);
+}
+
+/**
+ * Send 'request' to the control socket at 'path' and copy the reply to
+ * 'out'.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+control_request(const char *path, const char *request, FILE *out)
+{
+    struct sockaddr_un addr;
+    char buf[4096];
+    ssize_t n;
+    int s;
+
+    if (make_address(&addr, path) == -1) {
+        return -1;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1) {
+        return -1;
+    }
+
+    if (connect(s, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+        write(s, request, strlen(request)) == -1 || write(s, "\n", 1) == -1) {
+        (void) close(s);
+        return -1;
+    }
+
+    while ((n = read(s, buf, sizeof buf)) > 0) {
+        (void) fwrite(buf, 1, n, out);
+    }
+
+    (void) close(s);
+
+    return n == -1 ? -1 : 0;
+}
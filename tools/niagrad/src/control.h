@@ -0,0 +1,33 @@
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * A local control socket. A client connects, sends a single request line
+ * and reads the reply until the connection is closed. Requests are served
+ * from the event loop (see event.h). The same request/reply handling can
+ * serve other listening sockets, with another end of request marker.
+ */
+
+/* The most fds a reply can pass, SCM_MAX_FD in Linux. */
+#define CONTROL_MAX_FDS 253
+
+/**
+ * Called with a request line, without its newline. The reply is written
+ * to 'reply'.
+ */
+typedef void (*control_handler)(char *request, FILE *reply);
+
+int control_listen(const char *path, control_handler handler);
+int control_adopt(int s, const char *path, control_handler handler);
+int control_serve(int s, const char *end, control_handler handler);
+int control_fd(void);
+int control_peer(pid_t *pid, uid_t *uid);
+int control_attach_fds(const int *fds, int n);
+void control_unlink(void);
+
+int control_request(const char *path, const char *request, FILE *out);
+
+#endif /* CONTROL_H_ */
@@ -0,0 +1,230 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+
+#define MAX_EVENTS 64
+
+static int epoll_fd = -1;
+static struct event_source timer_source = { .fd = -1 };
+
+/* Armed timers, sorted by deadline. */
+static struct timer *timers;
+
+/* The batch of events being dispatched by event_run(). */
+static struct epoll_event *pending;
+static int num_pending;
+
+static void timer_fired(struct event_source *source, uint32_t events);
+static void timer_rearm(void);
+
+/**
+ * Create the epoll instance and the timerfd used for all timers.
+ *
+ * Return 0 on success and -1 on error, with errno set.
+ */
+int
+event_init(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        return -1;
+    }
+
+    timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_source.fd == -1) {
+        return -1;
+    }
+    timer_source.handler = timer_fired;
+
+    return event_add(&timer_source, EPOLLIN);
+}
+
+/**
+ * Start watching 'source->fd' for 'events'. The source must stay valid
+ * until it is removed with event_del().
+ */
+int
+event_add(struct event_source *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = source;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+int
+event_modify(struct event_source *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = source;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+/**
+ * Stop watching 'source'. This must be called before the source's fd
+ * is closed, since events already collected by the current event_run()
+ * iteration for it are discarded here.
+ */
+int
+event_del(struct event_source *source)
+{
+    int i;
+
+    for (i = 0; i < num_pending; i++) {
+        if (pending[i].data.ptr == source) {
+            pending[i].data.ptr = NULL;
+        }
+    }
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/**
+ * Return the current monotonic time in milliseconds.
+ */
+uint64_t
+event_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * (Re)start timer 't' to fire once, 'ms' milliseconds from now.
+ */
+void
+timer_start(struct timer *t, uint64_t ms)
+{
+    struct timer **p;
+
+    timer_stop(t);
+
+    t->deadline = event_now() + ms;
+    t->armed = true;
+
+    for (p = &timers; *p != NULL && (*p)->deadline <= t->deadline; p = &(*p)->next) {
+    }
+    t->next = *p;
+    *p = t;
+
+    if (timers == t) {
+        timer_rearm();
+    }
+}
+
+/**
+ * Stop timer 't'. It is not an error to stop a timer that is not armed.
+ */
+void
+timer_stop(struct timer *t)
+{
+    struct timer **p;
+
+    if (!t->armed) {
+        return;
+    }
+
+    for (p = &timers; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+
+    t->armed = false;
+    t->next = NULL;
+}
+
+/* Point the timerfd at the earliest deadline. A stale expiry for a timer
+   that has since been stopped is harmless; timer_fired() only runs timers
+   whose deadline has passed. */
+static void
+timer_rearm(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+
+    if (timers != NULL) {
+        its.it_value.tv_sec = timers->deadline / 1000;
+        its.it_value.tv_nsec = (timers->deadline % 1000) * 1000000;
+    }
+
+    (void) timerfd_settime(timer_source.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+timer_fired(struct event_source *source, uint32_t events)
+{
+    uint64_t expirations, now;
+    struct timer *t;
+
+    (void) read(source->fd, &expirations, sizeof expirations);
+
+    now = event_now();
+
+    while (timers != NULL && timers->deadline <= now) {
+        t = timers;
+        timers = t->next;
+        t->next = NULL;
+        t->armed = false;
+        t->handler(t);
+    }
+
+    timer_rearm();
+}
+
+/**
+ * Wait for and dispatch one batch of events.
+ *
+ * Return 0 on success and -1 on error, with errno set. Being
+ * interrupted is not an error.
+ */
+int
+event_run(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct event_source *source;
+    int i, n;
+
+    n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+    if (n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    pending = events;
+    num_pending = n;
+
+    for (i = 0; i < n; i++) {
+        /* NULL if a handler earlier in this batch removed the source. */
+        source = events[i].data.ptr;
+        if (source != NULL) {
+            source->handler(source, events[i].events);
+        }
+    }
+
+    pending = NULL;
+    num_pending = 0;
+
+    return 0;
+}
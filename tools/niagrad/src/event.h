@@ -0,0 +1,54 @@
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A minimal single-threaded event loop: file descriptors are watched with
+ * epoll and one-shot timers are multiplexed onto a single timerfd. All
+ * handlers run from event_run() on the calling thread.
+ */
+
+struct event_source;
+struct timer;
+
+typedef void (*event_handler)(struct event_source *, uint32_t events);
+typedef void (*timer_handler)(struct timer *);
+
+struct event_source {
+    int fd;
+    event_handler handler;
+    void *data;
+};
+
+struct timer {
+    uint64_t deadline; /* monotonic milliseconds */
+    timer_handler handler;
+    void *data;
+    bool armed;
+    struct timer *next;
+};
+
+int event_init(void);
+
+int event_add(struct event_source *, uint32_t events);
+int event_modify(struct event_source *, uint32_t events);
+int event_del(struct event_source *);
+
+void timer_start(struct timer *, uint64_t ms);
+void timer_stop(struct timer *);
+
+int event_run(void);
+
+uint64_t event_now(void);
+
+/**
+ * Return true if the timer 't' has been started and has not yet
+ * fired or been stopped.
+ */
+static inline bool timer_armed(const struct timer *t) {
+    return t->armed;
+}
+
+#endif /* EVENT_H_ */
@@ -0,0 +1,243 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+
+static void json_member(struct json *j, const char *key);
+static void json_quoted(struct json *j, const char *s);
+static void json_open(struct json *j, const char *key, char c);
+static void json_close(struct json *j, char c);
+static const char *json_skip_string(const char *s);
+static const char *json_skip_space(const char *s);
+
+void
+json_init(struct json *j, FILE *f)
+{
+    j->f = f;
+    j->depth = 0;
+    j->has_members[0] = false;
+}
+
+/* Start a new member: separate it from the previous one, indent it and
+   write its key. */
+static void
+json_member(struct json *j, const char *key)
+{
+    int i;
+
+    if (j->depth > 0) {
+        fputs(j->has_members[j->depth] ? ",\n" : "\n", j->f);
+        for (i = 0; i < j->depth; i++) {
+            fputc('\t', j->f);
+        }
+    }
+    j->has_members[j->depth] = true;
+
+    if (key != NULL) {
+        json_quoted(j, key);
+        fputs(": ", j->f);
+    }
+}
+
+static void
+json_quoted(struct json *j, const char *s)
+{
+    fputc('"', j->f);
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+        case '"':
+            fputs("\\\"", j->f);
+            break;
+        case '\\':
+            fputs("\\\\", j->f);
+            break;
+        case '\n':
+            fputs("\\n", j->f);
+            break;
+        case '\t':
+            fputs("\\t", j->f);
+            break;
+        default:
+            if ((unsigned char) *s < 0x20) {
+                fprintf(j->f, "\\u%04x", (unsigned char) *s);
+            } else {
+                fputc(*s, j->f);
+            }
+        }
+    }
+    fputc('"', j->f);
+}
+
+static void
+json_open(struct json *j, const char *key, char c)
+{
+    json_member(j, key);
+    fputc(c, j->f);
+    if (j->depth < JSON_MAX_DEPTH - 1) {
+        j->depth++;
+    }
+    j->has_members[j->depth] = false;
+}
+
+static void
+json_close(struct json *j, char c)
+{
+    int i;
+    bool had_members = j->has_members[j->depth];
+
+    if (j->depth > 0) {
+        j->depth--;
+    }
+
+    if (had_members) {
+        fputc('\n', j->f);
+        for (i = 0; i < j->depth; i++) {
+            fputc('\t', j->f);
+        }
+    }
+    fputc(c, j->f);
+
+    if (j->depth == 0) {
+        fputc('\n', j->f);
+    }
+}
+
+void
+json_object_begin(struct json *j, const char *key)
+{
+    json_open(j, key, '{');
+}
+
+void
+json_object_end(struct json *j)
+{
+    json_close(j, '}');
+}
+
+void
+json_array_begin(struct json *j, const char *key)
+{
+    json_open(j, key, '[');
+}
+
+void
+json_array_end(struct json *j)
+{
+    json_close(j, ']');
+}
+
+void
+json_string(struct json *j, const char *key, const char *value)
+{
+    json_member(j, key);
+    json_quoted(j, value);
+}
+
+void
+json_int(struct json *j, const char *key, long long value)
+{
+    json_member(j, key);
+    fprintf(j->f, "%lld", value);
+}
+
+void
+json_double(struct json *j, const char *key, double value)
+{
+    json_member(j, key);
+    fprintf(j->f, "%.2f", value);
+}
+
+void
+json_bool(struct json *j, const char *key, bool value)
+{
+    json_member(j, key);
+    fputs(value ? "true" : "false", j->f);
+}
+
+void
+json_null(struct json *j, const char *key)
+{
+    json_member(j, key);
+    fputs("null", j->f);
+}
+
+/* Skip the string starting at the quote 's'. Return what follows its
+   closing quote, or NULL if it is not terminated. */
+static const char *
+json_skip_string(const char *s)
+{
+    for (s++; *s != '\0'; s++) {
+        if (*s == '\\') {
+            if (*++s == '\0') {
+                return NULL;
+            }
+        } else if (*s == '"') {
+            return s + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static const char *
+json_skip_space(const char *s)
+{
+    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') {
+        s++;
+    }
+
+    return s;
+}
+
+/* Strings are skipped whole, so a key or brace inside a nested value or an
+   error message is never mistaken for a member of the top-level object. */
+int
+json_find_bool(const char *text, const char *key, bool *value)
+{
+    size_t key_len = strlen(key);
+    const char *s = json_skip_space(text), *end;
+    bool at_key = true;
+    int depth = 1;
+
+    if (*s++ != '{') {
+        return -1;
+    }
+
+    while (depth > 0 && *(s = json_skip_space(s)) != '\0') {
+        if (*s == '"') {
+            end = json_skip_string(s);
+            if (end == NULL) {
+                return -1;
+            }
+            if (depth == 1 && at_key && (size_t) (end - s) == key_len + 2 && strncmp(s + 1, key, key_len) == 0) {
+                s = json_skip_space(end);
+                if (*s != ':') {
+                    return -1;
+                }
+                s = json_skip_space(s + 1);
+                if (strncmp(s, "true", 4) == 0 || strncmp(s, "false", 5) == 0) {
+                    *value = (*s == 't');
+                    return 0;
+                }
+                return -1;
+            }
+            at_key = false;
+            s = end;
+            continue;
+        }
+
+        if (*s == '{' || *s == '[') {
+            depth++;
+        } else if (*s == '}' || *s == ']') {
+            depth--;
+        } else if (*s == ',' && depth == 1) {
+            at_key = true;
+        }
+        s++;
+    }
+
+    return -1;
+}
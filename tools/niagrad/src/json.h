@@ -0,0 +1,39 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+/*
+ * A minimal streaming JSON writer. Values are written to 'f' as they are
+ * added, indented with tabs. 'key' names the value inside an object and
+ * must be NULL inside an array or at the top level. json_find_bool() reads
+ * back a single member of a reply.
+ */
+
+#define JSON_MAX_DEPTH 16
+
+struct json {
+    FILE *f;
+    int depth;
+    bool has_members[JSON_MAX_DEPTH];
+};
+
+void json_init(struct json *, FILE *f);
+
+void json_object_begin(struct json *, const char *key);
+void json_object_end(struct json *);
+void json_array_begin(struct json *, const char *key);
+void json_array_end(struct json *);
+
+void json_string(struct json *, const char *key, const char *value);
+void json_int(struct json *, const char *key, long long value);
+void json_double(struct json *, const char *key, double value);
+void json_bool(struct json *, const char *key, bool value);
+void json_null(struct json *, const char *key);
+
+/**
+ * Look up 'key' among the members of the top-level object in 'text'.
+ * Return 0 and set 'value' if it is a boolean, or -1 if the text is not an
+ * object or has no such boolean member.
+ */
+int json_find_bool(const char *text, const char *key, bool *value);
+
+#endif /* JSON_H_ */
@@ -0,0 +1,343 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "listen.h"
+#include "str.h"
+
+#define PROC_NET_NETSTAT "/proc/net/netstat"
+#define MAX_NETSTAT_LINE 4096
+#define MAX_NETSTAT_FIELDS 256
+#define DIAG_BUFFER_SIZE 1024
+#define DIAG_DUMP_BUFFER_SIZE 32768
+
+static int tcp_queue(int s, struct listen_queue *queue);
+static int unix_queue(int s, struct listen_queue *queue);
+static int tcp_connections(const struct sockaddr_storage *addr, void (*found)(unsigned long inode));
+static int unix_connections(const struct sockaddr_un *addr, void (*found)(unsigned long inode));
+static int diag_dump(const void *request, size_t len, unsigned long (*inode_of)(struct nlmsghdr *nlh, const void *arg),
+                     const void *arg, void (*found)(unsigned long inode));
+static unsigned long tcp_inode(struct nlmsghdr *nlh, const void *arg);
+static unsigned long unix_inode(struct nlmsghdr *nlh, const void *arg);
+
+/**
+ * Read the accept queue of the listening socket 's'. Return 0 on success
+ * and -1 on error, with errno set.
+ */
+int
+listen_queue(int s, struct listen_queue *queue)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+
+    if (getsockname(s, (struct sockaddr *) &addr, &len) == -1) {
+        return -1;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        return unix_queue(s, queue);
+    }
+
+    return tcp_queue(s, queue);
+}
+
+/* For a listener TCP_INFO reports the queue length as tcpi_unacked and
+   the backlog as tcpi_sacked. */
+static int
+tcp_queue(int s, struct listen_queue *queue)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return -1;
+    }
+
+    queue->length = info.tcpi_unacked;
+    queue->limit = info.tcpi_sacked;
+
+    return 0;
+}
+
+/* Unix sockets have no TCP_INFO; ask sock_diag for the socket by inode. */
+static int
+unix_queue(int s, struct listen_queue *queue)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct unix_diag_req req;
+    } request;
+    char buf[DIAG_BUFFER_SIZE];
+    struct unix_diag_msg *msg;
+    struct unix_diag_rqlen *rqlen;
+    struct nlmsghdr *nlh;
+    struct rtattr *attr;
+    struct stat st;
+    int nl, len, attr_len, r = -1;
+
+    if (fstat(s, &st) == -1) {
+        return -1;
+    }
+
+    nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (nl == -1) {
+        return -1;
+    }
+
+    memset(&request, 0, sizeof request);
+    request.nlh.nlmsg_len = sizeof request;
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST;
+    request.req.sdiag_family = AF_UNIX;
+    request.req.udiag_states = -1;
+    request.req.udiag_ino = st.st_ino;
+    request.req.udiag_show = UDIAG_SHOW_RQLEN;
+    request.req.udiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    request.req.udiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    if (send(nl, &request, sizeof request, 0) != sizeof request) {
+        (void) close(nl);
+        return -1;
+    }
+
+    len = recv(nl, buf, sizeof buf, 0);
+    (void) close(nl);
+
+    nlh = (struct nlmsghdr *) buf;
+    if (len <= 0 || !NLMSG_OK(nlh, (unsigned) len) || nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY) {
+        return -1;
+    }
+
+    msg = NLMSG_DATA(nlh);
+    attr = (struct rtattr *) (msg + 1);
+    attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof *msg);
+
+    for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+        if (attr->rta_type == UNIX_DIAG_RQLEN) {
+            rqlen = RTA_DATA(attr);
+            queue->length = rqlen->udiag_rqueue;
+            queue->limit = rqlen->udiag_wqueue;
+            r = 0;
+        }
+    }
+
+    return r;
+}
+
+/**
+ * Call 'found' with the inode of every connection accepted on the listening
+ * socket 's': TCP sockets on its port other than listeners, or connected
+ * unix sockets bound to its path. Return 0 on success and -1 on error.
+ */
+int
+listen_connections(int s, void (*found)(unsigned long inode))
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+
+    memset(&addr, 0, sizeof addr);
+    if (getsockname(s, (struct sockaddr *) &addr, &len) == -1) {
+        return -1;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        return unix_connections((const struct sockaddr_un *) &addr, found);
+    }
+
+    return tcp_connections(&addr, found);
+}
+
+/* The kernel filters by port, running the bytecode 'sport >= port && sport
+   <= port' on each socket, so only the app's own connections are sent. */
+static int
+tcp_connections(const struct sockaddr_storage *addr, void (*found)(unsigned long inode))
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+        struct rtattr attr;
+        struct inet_diag_bc_op ops[4];
+    } request;
+    uint16_t port;
+
+    if (addr->ss_family == AF_INET) {
+        port = ntohs(((const struct sockaddr_in *) addr)->sin_port);
+    } else {
+        port = ntohs(((const struct sockaddr_in6 *) addr)->sin6_port);
+    }
+
+    memset(&request, 0, sizeof request);
+    request.nlh.nlmsg_len = sizeof request;
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.req.sdiag_family = addr->ss_family;
+    request.req.sdiag_protocol = IPPROTO_TCP;
+    request.req.idiag_states = ~(1U << TCP_LISTEN);
+    request.attr.rta_len = RTA_LENGTH(sizeof request.ops);
+    request.attr.rta_type = INET_DIAG_REQ_BYTECODE;
+    /* A port comparison takes two ops, the port being in the second. A
+       'no' jump past the end rejects the socket. */
+    request.ops[0] = (struct inet_diag_bc_op) { INET_DIAG_BC_S_GE, 8, 20 };
+    request.ops[1] = (struct inet_diag_bc_op) { 0, 0, port };
+    request.ops[2] = (struct inet_diag_bc_op) { INET_DIAG_BC_S_LE, 8, 12 };
+    request.ops[3] = (struct inet_diag_bc_op) { 0, 0, port };
+
+    return diag_dump(&request, sizeof request, tcp_inode, NULL, found);
+}
+
+static unsigned long
+tcp_inode(struct nlmsghdr *nlh, const void *arg)
+{
+    struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+
+    return msg->idiag_inode;
+}
+
+/* sock_diag cannot filter unix sockets by path, so the connected ones are
+   dumped with their names. An accepted socket shares its listener's. */
+static int
+unix_connections(const struct sockaddr_un *addr, void (*found)(unsigned long inode))
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct unix_diag_req req;
+    } request;
+
+    if (addr->sun_path[0] == '\0') {
+        return 0;
+    }
+
+    memset(&request, 0, sizeof request);
+    request.nlh.nlmsg_len = sizeof request;
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.req.sdiag_family = AF_UNIX;
+    request.req.udiag_states = 1U << TCP_ESTABLISHED;
+    request.req.udiag_show = UDIAG_SHOW_NAME;
+
+    return diag_dump(&request, sizeof request, unix_inode, addr->sun_path, found);
+}
+
+/* The inode of a stream socket bound to the path 'arg', or 0. */
+static unsigned long
+unix_inode(struct nlmsghdr *nlh, const void *arg)
+{
+    struct unix_diag_msg *msg = NLMSG_DATA(nlh);
+    struct rtattr *attr = (struct rtattr *) (msg + 1);
+    int attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof *msg);
+    size_t len = strlen(arg);
+
+    if (msg->udiag_type != SOCK_STREAM) {
+        return 0;
+    }
+
+    for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+        if (attr->rta_type == UNIX_DIAG_NAME && RTA_PAYLOAD(attr) >= len && memcmp(RTA_DATA(attr), arg, len) == 0 &&
+            (RTA_PAYLOAD(attr) == len || ((char *) RTA_DATA(attr))[len] == '\0')) {
+            return msg->udiag_ino;
+        }
+    }
+
+    return 0;
+}
+
+/* Send a sock_diag dump request and call 'found' with each inode that
+   'inode_of' finds in the reply. */
+static int
+diag_dump(const void *request, size_t len, unsigned long (*inode_of)(struct nlmsghdr *nlh, const void *arg),
+          const void *arg, void (*found)(unsigned long inode))
+{
+    static char buf[DIAG_DUMP_BUFFER_SIZE];
+    unsigned long inode;
+    struct nlmsghdr *nlh;
+    int nl, n, r = -1;
+    bool done = false;
+
+    nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (nl == -1) {
+        return -1;
+    }
+
+    if (send(nl, request, len, 0) != (ssize_t) len) {
+        (void) close(nl);
+        return -1;
+    }
+
+    while (!done && (n = recv(nl, buf, sizeof buf, 0)) > 0) {
+        for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, (unsigned) n); nlh = NLMSG_NEXT(nlh, n)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                r = 0;
+                done = true;
+                break;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                done = true;
+                break;
+            }
+            if (nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY && (inode = inode_of(nlh, arg)) != 0) {
+                found(inode);
+            }
+        }
+    }
+
+    (void) close(nl);
+
+    return r;
+}
+
+/**
+ * Read the host's ListenOverflows and ListenDrops counters. Return 0 on
+ * success and -1 on error.
+ */
+int
+listen_drops(unsigned long long *overflows, unsigned long long *drops)
+{
+    char names[MAX_NETSTAT_LINE], values[MAX_NETSTAT_LINE];
+    char *name_fields[MAX_NETSTAT_FIELDS], *value_fields[MAX_NETSTAT_FIELDS];
+    int i, n, found = 0;
+    FILE *f;
+
+    f = fopen(PROC_NET_NETSTAT, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    /* Pairs of lines: "TcpExt: Name ..." then "TcpExt: value ...". */
+    while (str_readline(f, names, sizeof names) > 0 && str_readline(f, values, sizeof values) > 0) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        n = str_split(names, ' ', name_fields, MAX_NETSTAT_FIELDS);
+        if (str_split(values, ' ', value_fields, MAX_NETSTAT_FIELDS) != n || n > MAX_NETSTAT_FIELDS) {
+            break;
+        }
+        for (i = 1; i < n; i++) {
+            if (strcmp(name_fields[i], "ListenOverflows") == 0) {
+                *overflows = strtoull(value_fields[i], NULL, 10);
+                found++;
+            } else if (strcmp(name_fields[i], "ListenDrops") == 0) {
+                *drops = strtoull(value_fields[i], NULL, 10);
+                found++;
+            }
+        }
+        break;
+    }
+
+    (void) fclose(f);
+
+    return found == 2 ? 0 : -1;
+}
@@ -0,0 +1,17 @@
+#ifndef LISTEN_H_
+#define LISTEN_H_
+
+/*
+ * Accept queue monitoring of listening sockets.
+ */
+
+struct listen_queue {
+    int length; /* connections waiting to be accepted */
+    int limit; /* the backlog in effect */
+};
+
+int listen_queue(int s, struct listen_queue *queue);
+int listen_connections(int s, void (*found)(unsigned long inode));
+int listen_drops(unsigned long long *overflows, unsigned long long *drops);
+
+#endif /* LISTEN_H_ */
@@ -0,0 +1,292 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE 1024
+#define LOG_MAX_MESSAGE 500
+/* The writer also checks the ring this often, in milliseconds, in case a
+   wake up went missing. */
+#define LOG_WAIT_INTERVAL 1000
+/* How long log_flush() waits for the writer, in milliseconds. */
+#define LOG_FLUSH_TIMEOUT 1000
+
+struct log_record {
+    uint64_t time; /* monotonic microseconds */
+    int priority;
+    char message[LOG_MAX_MESSAGE];
+};
+
+/* Records from tail up to head are queued. Only the logging thread moves
+   head and only the writer moves tail, so no lock is needed. flushed is
+   where the writer last caught up and flushed the sink. */
+static struct log_record ring[LOG_RING_SIZE];
+static _Atomic uint64_t head;
+static _Atomic uint64_t tail;
+static _Atomic uint64_t flushed;
+static _Atomic unsigned long long dropped;
+static unsigned long long dropped_reported;
+
+static enum log_sink sink = LOG_SINK_SYSLOG;
+static FILE *sink_file;
+static int wake_fd = -1;
+static pthread_t writer;
+static bool writer_running;
+
+static void *writer_main(void *arg);
+static void write_queued(void);
+static void write_record(const struct log_record *record);
+static void write_dropped(void);
+static const char *level_name(int priority);
+static uint64_t now_us(void);
+
+/**
+ * Queue a record with syslog 'priority' and a printf 'format', which may
+ * use %m. Never blocks; if the ring is full the record is dropped.
+ */
+void
+log_msg(int priority, const char *format, ...)
+{
+    uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    struct log_record *record;
+    int saved_errno = errno;
+    va_list ap;
+
+    if (h - atomic_load(&tail) == LOG_RING_SIZE) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+
+    record = &ring[h % LOG_RING_SIZE];
+    record->time = now_us();
+    record->priority = priority;
+
+    errno = saved_errno;
+    va_start(ap, format);
+    (void) vsnprintf(record->message, sizeof record->message, format, ap);
+    va_end(ap);
+
+    atomic_store(&head, h + 1);
+
+    /* The writer only sleeps once it has emptied the ring. */
+    if (writer_running && atomic_load(&tail) == h) {
+        (void) eventfd_write(wake_fd, 1);
+    }
+
+    errno = saved_errno;
+}
+
+/**
+ * Start writing records, including those queued so far, to 'sink' from a
+ * background thread. 'path' is the file of LOG_SINK_FILE. The syslog sink
+ * uses the settings of openlog().
+ *
+ * Return 0 on success and -1 on error, with errno set, in which case
+ * records are still queued for log_flush().
+ */
+int
+log_start(enum log_sink s, const char *path)
+{
+    int fd;
+
+    if (s == LOG_SINK_FILE) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1 || (sink_file = fdopen(fd, "a")) == NULL) {
+            if (fd != -1) {
+                (void) close(fd);
+            }
+            return -1;
+        }
+    } else if (s == LOG_SINK_STDERR) {
+        sink_file = stderr;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        return -1;
+    }
+
+    sink = s;
+
+    errno = pthread_create(&writer, NULL, writer_main, NULL);
+    if (errno != 0) {
+        (void) close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    writer_running = true;
+
+    return 0;
+}
+
+/**
+ * Wait a little for the queued records to be written, as before exiting.
+ * Without a writer they are written from the calling thread.
+ */
+void
+log_flush(void)
+{
+    uint64_t h = atomic_load(&head);
+    int waited;
+
+    if (!writer_running) {
+        write_queued();
+        return;
+    }
+
+    (void) eventfd_write(wake_fd, 1);
+
+    for (waited = 0; atomic_load(&flushed) < h && waited < LOG_FLUSH_TIMEOUT; waited++) {
+        (void) poll(NULL, 0, 1);
+    }
+}
+
+/**
+ * Return the number of records written to the sink.
+ */
+unsigned long long
+log_written(void)
+{
+    return atomic_load(&tail);
+}
+
+/**
+ * Return the number of records dropped because the ring was full.
+ */
+unsigned long long
+log_dropped(void)
+{
+    return atomic_load(&dropped);
+}
+
+static void *
+writer_main(void *arg)
+{
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+    eventfd_t value;
+
+    for (;;) {
+        write_queued();
+        (void) poll(&pfd, 1, LOG_WAIT_INTERVAL);
+        (void) eventfd_read(wake_fd, &value);
+    }
+
+    return NULL;
+}
+
+/* Write records until the ring is empty, then flush the sink. */
+static void
+write_queued(void)
+{
+    uint64_t t;
+
+    for (;;) {
+        t = atomic_load(&tail);
+        if (t == atomic_load(&head)) {
+            break;
+        }
+        write_record(&ring[t % LOG_RING_SIZE]);
+        atomic_store(&tail, t + 1);
+    }
+
+    write_dropped();
+
+    if (sink_file != NULL) {
+        (void) fflush(sink_file);
+    }
+    atomic_store(&flushed, t);
+}
+
+/* Syslog gets the message alone, as it keeps its own time. Other sinks
+   get a line of key=value fields. */
+static void
+write_record(const struct log_record *record)
+{
+    const char *c;
+
+    if (sink == LOG_SINK_SYSLOG) {
+        syslog(record->priority, "%s", record->message);
+        return;
+    }
+
+    fprintf(sink_file, "time=%llu.%06llu level=%s msg=\"", (unsigned long long) (record->time / 1000000),
+            (unsigned long long) (record->time % 1000000), level_name(record->priority));
+    for (c = record->message; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', sink_file);
+            fputc(*c, sink_file);
+        } else if (*c == '\n') {
+            fputs("\\n", sink_file);
+        } else {
+            fputc(*c, sink_file);
+        }
+    }
+    fputs("\"\n", sink_file);
+}
+
+/* Report records dropped since the last report, once the ring has room. */
+static void
+write_dropped(void)
+{
+    struct log_record record;
+    unsigned long long n = atomic_load(&dropped);
+
+    if (n == dropped_reported) {
+        return;
+    }
+
+    record.time = now_us();
+    record.priority = LOG_ERR;
+    (void) snprintf(record.message, sizeof record.message, "log ring full, dropped %llu records",
+                    n - dropped_reported);
+    write_record(&record);
+    dropped_reported = n;
+}
+
+static const char *
+level_name(int priority)
+{
+    switch (LOG_PRI(priority)) {
+    case LOG_EMERG:
+    case LOG_ALERT:
+    case LOG_CRIT:
+        return "crit";
+    case LOG_ERR:
+        return "error";
+    case LOG_WARNING:
+        return "warning";
+    case LOG_NOTICE:
+    case LOG_INFO:
+        return "info";
+    default:
+        return "debug";
+    }
+}
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
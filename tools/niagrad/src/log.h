@@ -0,0 +1,21 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+/*
+ * A logger which never blocks the event loop. Records are queued in a ring
+ * buffer and written out to the sink by a background thread. If the ring
+ * is full, because the sink is slow or stuck, records are dropped and
+ * counted instead. Only one thread may log.
+ */
+
+enum log_sink { LOG_SINK_SYSLOG, LOG_SINK_STDERR, LOG_SINK_FILE };
+
+void log_msg(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+int log_start(enum log_sink sink, const char *path);
+void log_flush(void);
+
+unsigned long long log_written(void);
+unsigned long long log_dropped(void);
+
+#endif /* LOG_H_ */
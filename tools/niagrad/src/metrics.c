@@ -0,0 +1,74 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+/**
+ * Count 'value' in the first bucket whose bound it does not exceed.
+ */
+void
+histogram_observe(struct histogram *h, double value)
+{
+    int i;
+
+    for (i = 0; i < h->num_bounds && value > h->bounds[i]; i++) {
+    }
+
+    h->counts[i]++;
+    h->count++;
+    h->sum += value;
+}
+
+/**
+ * Write the HELP and TYPE lines which start a metric family.
+ */
+void
+metrics_family(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf(f, "# HELP %s %s\n", name, help);
+    fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+/**
+ * Write one sample. 'labels' is the text between the braces, e.g.
+ * 'slot="3"', or NULL.
+ */
+void
+metrics_value(FILE *f, const char *name, const char *labels, double value)
+{
+    if (labels != NULL) {
+        fprintf(f, "%s{%s} %.15g\n", name, labels, value);
+    } else {
+        fprintf(f, "%s %.15g\n", name, value);
+    }
+}
+
+/**
+ * Write the buckets, sum and count of a histogram family's sample. 'labels'
+ * are added to each line, or NULL.
+ */
+void
+metrics_histogram(FILE *f, const char *name, const char *labels, const struct histogram *h)
+{
+    unsigned long long cumulative = 0;
+    const char *sep = (labels != NULL ? "," : "");
+    int i;
+
+    if (labels == NULL) {
+        labels = "";
+    }
+
+    for (i = 0; i < h->num_bounds; i++) {
+        cumulative += h->counts[i];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, h->bounds[i], cumulative);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, h->count);
+    if (*labels != '\0') {
+        fprintf(f, "%s_sum{%s} %.15g\n", name, labels, h->sum);
+        fprintf(f, "%s_count{%s} %llu\n", name, labels, h->count);
+    } else {
+        fprintf(f, "%s_sum %.15g\n", name, h->sum);
+        fprintf(f, "%s_count %llu\n", name, h->count);
+    }
+}
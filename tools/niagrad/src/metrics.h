@@ -0,0 +1,29 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/*
+ * Writing metrics in the Prometheus text exposition format, and the
+ * histograms niagrad keeps for it.
+ */
+
+#define HISTOGRAM_MAX_BUCKETS 16
+
+/**
+ * A cumulative histogram. 'bounds' are the upper bounds of the buckets in
+ * increasing order; a final +Inf bucket is implied.
+ */
+struct histogram {
+    const double *bounds;
+    int num_bounds;
+    unsigned long long counts[HISTOGRAM_MAX_BUCKETS + 1];
+    unsigned long long count;
+    double sum;
+};
+
+void histogram_observe(struct histogram *, double value);
+
+void metrics_family(FILE *f, const char *name, const char *type, const char *help);
+void metrics_value(FILE *f, const char *name, const char *labels, double value);
+void metrics_histogram(FILE *f, const char *name, const char *labels, const struct histogram *);
+
+#endif /* METRICS_H_ */
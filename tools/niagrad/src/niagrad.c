@@ -1,9 +1,18 @@
 /* Copyright: Apkudo LLC 2014: See LICENSE file. */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -13,16 +22,39 @@
 #include <string.h>
 #include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syslog.h>
 
+#include "control.h"
+#include "event.h"
+#include "json.h"
+#include "listen.h"
+#include "log.h"
+#include "metrics.h"
+#include "proc.h"
 #include "str.h"
 
-#define STATE_DIR "/tmp"
+/* Where control sockets live. Without root, a per-user directory is used. */
+#define RUNTIME_DIR "/var/run/niagra"
+#define RUNTIME_DIR_ENV "NIAGRA_RUNTIME_DIR"
+#define USER_RUNTIME_DIR "/tmp/niagra-%ld"
+#define REGISTRY_SUFFIX ".instance"
+#define SHELL "/bin/bash"
+/* A command containing any of these is run through the shell. */
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[]{}#~!\t\n"
 #define SYSLOG_IDENT "niagra"
 #define FD_PREFIX " --fd "
 #define FD_PREFIX_SIZE (sizeof FD_PREFIX)
@@ -30,10 +62,17 @@
 #define ENV_PREFIX_SIZE (sizeof ENV_PREFIX)
 #define FILE_PREFIX " --file "
 #define FILE_PREFIX_SIZE (sizeof FILE_PREFIX)
+#define NOTIFY_PREFIX " --notify "
+#define NOTIFY_PREFIX_SIZE (sizeof NOTIFY_PREFIX)
+#define STANDBY_ARG " --standby"
+#define SHARD_PREFIX " --shard "
+#define SHARD_PREFIX_SIZE (sizeof SHARD_PREFIX)
 #define INT_STRING_LEN 10
 #define FD_ARG_LEN (FD_PREFIX_SIZE + MAX_FD_NAME + INT_STRING_LEN)
 #define ENV_ARG_LEN (ENV_PREFIX_SIZE + MAX_ENV_NAME)
 #define FILE_ARG_LEN (FILE_PREFIX_SIZE + MAX_FILEKEY_NAME + INT_STRING_LEN)
+#define NOTIFY_ARG_LEN (NOTIFY_PREFIX_SIZE + INT_STRING_LEN)
+#define SHARD_ARG_LEN (SHARD_PREFIX_SIZE + MAX_FD_NAME + 2 * INT_STRING_LEN + 1)
 #define APP_OPTION_ARG_LEN (MAX_APP_OPTION_NAME + MAX_APP_OPTION_VALUE + 2)
 #define INT_STRING_LEN 10
 #define MAX_LINE_SIZE 4096
@@ -50,22 +89,138 @@
 #define MAX_APP_OPTIONS 10
 #define MAX_TIME_STRING 26
 #define NUM_SOCK_OPTIONS 6
+#define NUM_UNIX_SOCK_OPTIONS 5
+#define MAX_SOCKET_PATH (sizeof ((struct sockaddr_un *) 0)->sun_path)
+#define MAX_SOCK_FIELDS 16
 #define NUM_FILE_OPTIONS 2
-#define NO_PID 0
+#define BACKLOG_AUTO -1
+#define SOMAXCONN_FILE "/proc/sys/net/core/somaxconn"
+#define NODE_DIR "/sys/devices/system/node"
+#define MAX_NUMA_NODES 64
+#define MAX_CPULIST 1024
+
+/* Buckets in the pid -> child table. Chains stay short even with several
+   hundred copies and several generations draining. */
+#define CHILD_TABLE_SIZE 4096
+
+/* A second SIGINT within this many milliseconds terminates niagrad. */
+#define SIGINT_WINDOW 1000
+
+/* How long a migrated server may take to finish its connections before it
+   is sent SIGTERM, and how long after that before SIGKILL, in milliseconds. */
+#define DEFAULT_DRAIN_TIMEOUT 300000
+#define DEFAULT_DRAIN_KILL_TIMEOUT 10000
+
+/* How often the connections of draining servers are counted. */
+#define DRAIN_POLL_INTERVAL 1000
+
+/* How long a migration waits for the new server to report ready before
+   retiring the old one anyway, in milliseconds. */
+#define DEFAULT_READY_TIMEOUT 10000
+#define MAX_NOTIFY_MESSAGE 64
+
+#define MAX_CONTROL_ARGS 4
+
+/* An upgrade re-execs the niagrad binary, which takes over the listeners,
+   files and children of this one from the state written to an inherited
+   memfd. The version is bumped when the state format changes. */
+#define SELF_EXE "/proc/self/exe"
+#define UPGRADE_STATE_NAME "niagrad-state"
+#define UPGRADE_STATE_VERSION 1
+#define UPGRADE_ARG "-u"
+
+/* Socket activation: the service manager passes listeners from fd 3 on. */
+#define LISTEN_FDS_START 3
+
+/* Settings before the first 'app:' section belong to this app, so a config
+   without sections supervises a single app. */
+#define DEFAULT_APP "default"
+#define MAX_APP_NAME 64
+#define APP_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-"
+
+/* The changes found by a config reload, as reported to the control client. */
+#define MAX_RELOAD_CHANGES 64
+#define MAX_RELOAD_CHANGE 160
+
+/* A slot whose server keeps failing is respawned after a delay, doubling
+   from the initial to the maximum backoff, in milliseconds. Half of each
+   delay is random, so crashed copies do not respawn in step. A server
+   which ran for BACKOFF_RESET milliseconds has recovered. After this many
+   failures in a row the slot is crash looping. */
+#define DEFAULT_BACKOFF_INITIAL 1000
+#define DEFAULT_BACKOFF_MAX 60000
+#define BACKOFF_RESET 30000
+#define DEFAULT_CRASH_LOOP_FAILURES 5
+
+/* How often the resource usage of servers is sampled, and how many samples
+   are kept for each. */
+#define DEFAULT_SAMPLE_INTERVAL 5000
+#define USAGE_HISTORY 12
+
+/* How often the accept queues of the listeners are sampled. */
+#define DEFAULT_QUEUE_INTERVAL 1000
+
+/* Autoscaling with 'copies: min..max'. Load is checked every interval;
+   scaling up needs a busy check twice in a row, scaling down an idle check
+   for a minute. Connections queued to this percentage of a listener's
+   limit count as busy. */
+#define AUTOSCALE_INTERVAL 5000
+#define AUTOSCALE_UP_CHECKS 2
+#define AUTOSCALE_DOWN_CHECKS 12
+#define AUTOSCALE_QUEUE_PERCENT 10
+#define DEFAULT_AUTOSCALE_CPU_LOW 25
+#define DEFAULT_AUTOSCALE_CPU_HIGH 75
+#define DEFAULT_AUTOSCALE_COOLDOWN 60000
+
+/* The metrics endpoint listens on localhost unless told otherwise. */
+#define METRICS_ADDR "127.0.0.1"
+#define METRICS_BACKLOG 16
+#define HTTP_REQUEST_END "\r\n\r\n"
+#define MAX_LABELS (MAX_APP_NAME + MAX_FD_NAME + 48)
 
-/* Maximum number of node instances to spawn. One per core is probably good. */
-#define MAX_COPIES 10
+enum fd_type { SOCKET_FD, FILE_FD };
 
-/* Maximum number of times to migrate before old servers just get killed. */
-#define MAX_MIGRATE_BACKLOG 4
+/* The accept queue of a listener, as last sampled. */
+struct queue_stats {
+    int length;
+    int limit;
+    int high_water;
+};
 
-enum fd_type { SOCKET_FD, FILE_FD };
+enum queue_field { QUEUE_LENGTH, QUEUE_LIMIT, QUEUE_HIGH_WATER };
 
 struct fd_socket {
+    int family;
     int ip_ver;
     struct in_addr addr;
     uint16_t port;
     int backlog;
+    /* AF_UNIX only. A mode of zero leaves the permissions from the umask. */
+    char path[MAX_SOCKET_PATH];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    /* With reuseport each copy gets its own listening socket (shard) bound
+       with SO_REUSEPORT, and a steering program picks the shard for each
+       connection. The program returns an index into the reuseport group,
+       so shard j must stay at index j. Shards past the copies are spares
+       from removed slots: niagrad keeps them open, close-on-exec, so that
+       the group never shrinks, and reuses them when scaling up again. */
+    bool reuseport;
+    int *shards;
+    int num_shards;
+    bool steered;
+    /* Passed in by the service manager, which owns a unix socket's file. */
+    bool activated;
+    /* One per shard, or one for the socket. */
+    struct queue_stats *queues;
+    int queue_high_water; /* of all shards together */
+    /* Tuning applied at bind time. Zero leaves the kernel default. */
+    int defer_accept;
+    int fastopen;
+    int rcvbuf;
+    int sndbuf;
+    bool nodelay;
 };
 
 struct fd_file {
@@ -94,36 +249,429 @@ struct app_option {
     char value[MAX_APP_OPTION_VALUE];
 };
 
-static void parse_config_file(void);
-static void update_command_line(void);
+/* none: inherit niagrad's affinity. set: every copy runs on the configured
+   CPUs. core: each slot is pinned to one CPU. numa: each slot is pinned to
+   the CPUs of one NUMA node. */
+enum affinity_mode { AFFINITY_NONE, AFFINITY_SET, AFFINITY_CORE, AFFINITY_NUMA };
+
+/* Where a slot runs. node is -1 if memory placement is left alone. */
+struct placement {
+    cpu_set_t cpus;
+    int node;
+};
+
+enum child_role { CHILD_LIVE, CHILD_OUTGOING, CHILD_DRAINING, CHILD_DETACHED, CHILD_STANDBY };
+
+enum readiness { READY_PENDING, READY_OK, READY_TIMEOUT };
+
+/* What a crash looping slot does: keep respawning at the maximum backoff,
+   or stay empty until the next restart or migration. */
+enum crash_loop_policy { CRASH_LOOP_BACKOFF, CRASH_LOOP_STOP };
+
+/* Everything the config file sets, so that a reload can be parsed into the
+   globals and rolled back if it turns out to be invalid. Field names match
+   the globals. */
+struct config {
+    char server_command[MAX_COMMAND_LINE];
+    bool server_use_shell;
+    char **server_argv;
+    char *standby_command;
+    char **standby_argv;
+    char config_environment[MAX_ENV_NAME];
+    struct fd fds[MAX_FDS];
+    int num_fds;
+    struct file files[MAX_FILES];
+    int num_files;
+    struct app_option app_options[MAX_APP_OPTIONS];
+    int num_app_options;
+    int copies;
+    bool autoscale;
+    int copies_min;
+    int copies_max;
+    enum affinity_mode affinity_mode;
+    cpu_set_t affinity_cpus;
+    bool affinity_has_cpus;
+    struct placement *placements;
+    int num_standbys;
+    int drain_timeout;
+    int drain_kill_timeout;
+    int ready_timeout;
+    int migrate_batch;
+    bool migrate_batch_percent;
+    int migrate_pause;
+    int sample_interval;
+    int queue_interval;
+    int autoscale_cpu_low;
+    int autoscale_cpu_high;
+    int autoscale_cooldown;
+    int backoff_initial;
+    int backoff_max;
+    int crash_loop_failures;
+    enum crash_loop_policy crash_loop_policy;
+};
+
+/* What a reload has done to an app so far, to be committed or undone. */
+struct reload {
+    struct config old;
+    bool added; /* the app is new */
+    bool created_fd[MAX_FDS];
+    bool kept_fd[MAX_FDS];
+    bool opened_file[MAX_FILES];
+    bool kept_file[MAX_FILES];
+    bool affinity_changed;
+    int target; /* copies */
+    bool prepared;
+    bool migrate;
+};
+
+/* Failures in a row of the servers of a slot, or of the standbys.
+   respawn_at is when the next one is due, 0 if none is. */
+struct slot_health {
+    int failures;
+    uint64_t respawn_at;
+    bool stopped;
+};
+
+enum usage_field { USAGE_CPU, USAGE_RSS, USAGE_PSS, USAGE_FDS, USAGE_THREADS };
+
+struct usage_sample {
+    uint64_t time;
+    struct proc_usage usage;
+    double cpu_percent; /* since the previous sample */
+};
+
+/* A spawned process. Live children occupy servers[slot]. During a migration
+   the old server is outgoing and keeps serving until its replacement is
+   ready; then it drains its connections until it exits or its drain
+   deadline passes. Detached children
+   have been told to terminate and are only waited for. Standbys occupy
+   standbys[slot] until they are promoted to a live slot. Slots are those
+   of the child's app. */
+struct child {
+    struct app *app;
+    pid_t pid;
+    int slot;
+    enum child_role role;
+    /* Draining only. */
+    uint64_t drain_start;
+    int drain_signals; /* SIGTERM, then SIGKILL, sent so far */
+    int connections; /* -1 if unknown */
+    struct timer drain_timer;
+    struct child *drain_next;
+    struct event_source ev; /* pidfd watch, fd is -1 if not watched */
+    struct event_source notify_ev; /* readiness socket, fd is -1 once closed */
+    struct timer ready_timer;
+    enum readiness readiness;
+    uint64_t spawn_time;
+    uint64_t ready_time; /* milliseconds from spawn to ready */
+    int generation; /* the migration generation it was spawned for */
+    /* Resource usage, a ring of the most recent samples. */
+    struct usage_sample samples[USAGE_HISTORY];
+    int num_samples;
+    int next_sample;
+    struct child *hash_next;
+};
+
+/* An application supervised by niagrad, with its own command, servers and
+   listeners. The code works on the current app, 'app', which every event
+   handler sets from the child, timer or request it was called for. */
+struct app {
+    char name[MAX_APP_NAME];
+    struct app *next;
+    bool in_config; /* has a section in the config file being parsed */
+    bool removed; /* by a reload, freed once its last child is reaped */
+    bool adopted; /* with its servers, from the niagrad this one replaced */
+    int num_children;
+    struct reload *reload; /* while a reload is applied */
+    char server_command[MAX_COMMAND_LINE];
+    char **server_argv;
+    /* The command line for standbys, with all reuseport shards. */
+    char *standby_command;
+    char **standby_argv;
+    bool server_use_shell;
+    char config_environment[MAX_ENV_NAME];
+    struct fd fds[MAX_FDS];
+    int num_fds;
+    struct file files[MAX_FILES];
+    int num_files;
+    struct app_option app_options[MAX_APP_OPTIONS];
+    int num_app_options;
+    int copies;
+    enum affinity_mode affinity_mode;
+    cpu_set_t affinity_cpus;
+    bool affinity_has_cpus;
+    struct placement *placements;
+    int num_nodes;
+    int node_ids[MAX_NUMA_NODES];
+    cpu_set_t node_cpus[MAX_NUMA_NODES];
+    struct child **servers;
+    /* Per slot, the old server waiting for its replacement to become ready. */
+    struct child **outgoing_servers;
+    /* Started servers which are not accepting yet, ready to take over a slot. */
+    struct child **standbys;
+    int num_standbys;
+    /* Migrated servers which are finishing their connections. */
+    struct child *draining_servers;
+    int drain_timeout;
+    int drain_kill_timeout;
+    struct timer drain_poll_timer;
+    int sample_interval;
+    struct timer sample_timer;
+    int queue_interval;
+    struct timer queue_timer;
+    /* The fullest accept queue since the last autoscale check, in percent. */
+    double queue_window_percent;
+    bool autoscale;
+    int copies_min;
+    int copies_max;
+    int autoscale_cpu_low;
+    int autoscale_cpu_high;
+    int autoscale_cooldown;
+    int autoscale_busy_checks;
+    int autoscale_idle_checks;
+    uint64_t autoscale_last;
+    struct timer autoscale_timer;
+    int ready_timeout;
+    /* Per slot, and for the standby pool. */
+    struct slot_health *slot_health;
+    struct slot_health standby_health;
+    int backoff_initial;
+    int backoff_max;
+    int crash_loop_failures;
+    enum crash_loop_policy crash_loop_policy;
+    struct timer respawn_timer;
+    /* Rolling migration: slots are migrated migrate_batch at a time (a
+       percentage of copies if migrate_batch_percent, all at once if zero),
+       with migrate_pause milliseconds between waves. A slot is up to date
+       once its server was spawned for the current generation. */
+    int migrate_batch;
+    bool migrate_batch_percent;
+    int migrate_pause;
+    int generation;
+    bool migrating;
+    struct timer migrate_timer;
+    int stat_restart_request_count;
+    int stat_migrate_request_count;
+    int stat_restart_node_expected_count;
+    int stat_restart_node_unexpected_count;
+    int stat_migrate_node_count;
+    int stat_draining_node_count;
+    int stat_autoscale_up_count;
+    int stat_autoscale_down_count;
+    int stat_crash_loop_count;
+    char stat_restart_last_request_time[MAX_TIME_STRING];
+    char stat_migrate_last_request_time[MAX_TIME_STRING];
+    char stat_migrate_last_node_time[MAX_TIME_STRING];
+    char stat_restart_last_node_expected_time[MAX_TIME_STRING];
+    char stat_restart_last_node_unexpected_time[MAX_TIME_STRING];
+    struct histogram ready_histogram;
+    struct histogram drain_histogram;
+    struct histogram respawn_histogram;
+};
+
+static int parse_config_file(void);
+static int parse_app(const char *name);
+static struct app *find_app(const char *name);
+static struct app *new_app(const char *name);
+static void start_app(void);
+static void start_timers(void);
+static void retire_app(void);
+static void free_app(struct app *a);
+static void terminate_apps(void);
+static int update_command_line(void);
+static bool command_needs_shell(const char *command);
+static void build_server_argv(void);
+static char **make_argv(char *command);
+static void free_argv(char **argv);
+static char *make_template_command(const char *flag, int copies, int *const *shards);
 static char *get_parent_dir(const char *file);
 static void change_dir(void);
 
+static int parse_socket_option(struct fd *fd, char *option);
+static int parse_socket_owner(struct fd_socket *sock, char *owner);
+static int parse_backlog(const char *str, int *backlog);
 static void create_sockets(void);
-static int create_socket(struct in_addr addr, uint16_t port, int backlog);
-static void install_signal_handlers(void);
+static int open_socket(struct fd *fd);
+static void close_socket(struct fd *fd);
+static int create_socket(const struct fd_socket *sock);
+static bool listener_matches(int s, const struct fd_socket *sock);
+static int adopt_listener(struct fd *fd, int *fds, int n);
+static void collect_activated_sockets(void);
+static void adopt_activated_sockets(void);
+static bool adopt_activated_socket(struct fd *fd, bool by_name, int *fds, int *taken);
+static int tune_socket(int s, const struct fd_socket *sock);
+static int auto_backlog(void);
+static int set_socket_option(int s, int level, int name, int value, const char *what);
+static int bind_inet_socket(int s, const struct fd_socket *sock);
+static int bind_unix_socket(int s, const struct fd_socket *sock);
+static int set_socket_owner(const struct fd_socket *sock);
+static int remove_stale_unix_socket(const char *path);
+static void remove_unix_sockets(void);
+static void add_shard_actions(posix_spawn_file_actions_t *actions, int server);
+static void add_other_app_actions(posix_spawn_file_actions_t *actions);
+static void block_signals(void);
+static void init_events(void);
+static void handle_signals(struct event_source *source, uint32_t events);
+static void sigint_window_expired(struct timer *t);
+static void watch_child(struct child *child);
+static void child_event(struct event_source *source, uint32_t events);
+static void reap_children(void);
+static void child_exited(pid_t pid, int status);
+static void reserve_notify_fd(void);
+static int open_notify_socket(int notify[2]);
+static void watch_notify(struct child *child, int fd);
+static void notify_event(struct event_source *source, uint32_t events);
+static void close_notify(struct child *child);
+static void server_ready(struct child *child);
+static void ready_timer_expired(struct timer *t);
+static void handle_sigusr1(void);
+static void handle_sigusr2(void);
+static void handle_sigint(void);
+static void handle_sigterm(void);
+static int find_runtime_dir(void);
+static int check_runtime_dir(void);
+static int format_control_path(long pid);
+static void open_control_socket(void);
+static void handle_control(char *request, FILE *reply);
+static void run_control_request(char *request, FILE *reply);
+static void control_terminate(struct timer *t);
+static int export_listener(const char *name, const char **error);
+static const char *upgrade_refused(void);
+static void upgrade_niagrad(struct timer *t);
+static void inherit_fds(bool inherit);
+static void save_state(FILE *f);
+static void save_app(FILE *f);
+static void save_histogram(FILE *f, const char *name, const struct histogram *h);
+static void read_state(int fd);
+static void restore_listeners(void);
+static void restore_socket(char *args);
+static void restore_spares(char *args);
+static int *parse_state_fds(const char *name, char *str, int *n);
+static void restore_file(char *args);
+static void restore_children(void);
+static void restore_histogram(char *args);
+static void restore_child(char *args);
+static bool next_state_line(char *line, int size, char **keyword, char **args);
+static void forget_removed_app(void);
+static char *app_time(const char *name);
+static void resume_app(void);
+static void reply_error(FILE *reply, const char *command, const char *error);
+static int run_client(const char *pid, int argc, char **argv);
+static void register_instance(void);
+static void unregister_instance(void);
+static int list_instances(const char *match);
+static int compare_pids(const void *a, const void *b);
+static int parse_metrics(char *str);
+static int parse_log(char *str);
+static void open_metrics_socket(void);
+static void handle_metrics(char *request, FILE *reply);
+static void output_metrics(FILE *f);
+static const char *app_labels(char *labels, const char *extra);
+static void output_usage_metric(FILE *f, const char *name, const char *help, enum usage_field field);
+static void output_queue_metric(FILE *f, const char *name, const char *help, enum queue_field field);
+static int scale_servers(int n, const char **error);
+static int prepare_shards(int n, int **shards);
+static void discard_shards(int n, int **shards);
+static void commit_shards(int n, int **shards);
 static int lookup_fd_by_name(const char *name);
 
 static void open_files(void);
 static int lookup_file_by_key(const char *name);
 
+static int parse_affinity(char *str);
+static int parse_cpulist(const char *str, cpu_set_t *set);
+static void format_cpulist(const cpu_set_t *set, char *buf, size_t size);
+static void read_topology(const cpu_set_t *allowed);
+static int plan_affinity(int copies, struct placement **result);
+static void enter_placement(int server);
+static void leave_placement(int server);
+static void place_process(pid_t pid, int server);
+static void attach_steering_program(struct fd *fd);
+static void close_spares(struct fd *fd);
+
 static void drop_privs(void);
 
-static int find_server(pid_t pid);
-static void migrate_server(int server, pid_t pid);
+static int parse_copies(const char *str, int *result);
+static void copy_config(struct config *c, bool to_config);
+static void reset_config(void);
+static int reload_config(const char **error);
+static int prepare_reload(const char **error);
+static void commit_reload(void);
+static void abort_reload(void);
+static void undo_reload(void);
+static bool same_listener(const struct fd_socket *a, const struct fd_socket *b);
+static bool same_tuning(const struct fd_socket *a, const struct fd_socket *b);
+static void retune_socket(struct fd *fd, const struct fd_socket *old);
+static void note_change(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void note_int(const char *name, int old, int new);
+static void handle_sighup(void);
+static int online_cpus(void);
+static void alloc_servers(void);
+static void resize_servers(int from, int n);
+static struct child *find_child(pid_t pid);
+static struct child *add_child(pid_t pid, int server);
+static void remove_child(struct child *child);
+static void migrate_server(int server, struct child *child);
+static void migrate_slot(int server);
 static void migrate_servers(void);
+static int parse_migrate_batch(const char *str);
+static int migrate_batch_size(void);
+static void migrate_next_batch(void);
+static void migrate_pause_expired(struct timer *t);
+static void migration_progress(void);
+static void complete_migration(int server);
+static void cancel_migration(int server);
 static void restart_servers(void);
+static pid_t launch_server(int server, char **argv, int notify);
 static void spawn_server(int server);
 static void spawn_servers(void);
+static void spawn_standby(int index);
+static void fill_standbys(void);
+static struct child *take_standby(void);
+static bool promote_standby(struct child *child, int server);
+static void retire_standby(struct child *child);
+static void retire_stale_standbys(void);
 static void terminate_servers(void);
 static void terminate_server(int server);
 
-static void clear_backlog_server(pid_t pid);
-static void set_backlog_server(int server, pid_t pid);
-static void terminate_backlog_servers(int backlog_index);
-static void shift_backlog_servers(void);
-
-static void output_state(pid_t caller);
+static void start_draining(struct child *child);
+static void stop_draining(struct child *child);
+static void drain_deadline(struct timer *t);
+static void terminate_draining_servers(void);
+static void drain_poll(struct timer *t);
+static void count_connections(void);
+static void add_connection(unsigned long inode);
+static int compare_inodes(const void *a, const void *b);
+static int child_connections(pid_t pid);
+
+static void sample_usage(struct timer *t);
+static void sample_child(struct child *child);
+static const struct usage_sample *latest_sample(const struct child *child);
+static void output_sample(struct json *j, const struct usage_sample *sample);
+static void output_usage(struct json *j, const struct child *child);
+static void sample_queues(struct timer *t);
+static int num_queues(const struct fd_socket *sock);
+static void output_queues(struct json *j, const struct fd_socket *sock);
+static int parse_copies_range(char *str);
+static int parse_autoscale_cpu(char *str);
+static double average_cpu(void);
+static void autoscale_check(struct timer *t);
+static int parse_backoff(char *str);
+static int parse_crash_loop(char *str);
+static bool backoff(struct slot_health *health);
+static uint64_t backoff_delay(int failures);
+static void server_failed(int server, uint64_t uptime);
+static void standby_failed(void);
+static void arm_respawn_timer(void);
+static void respawn_due(struct timer *t);
+static void reset_health(void);
+static int slot_failures(int server);
+static const char *slot_state_name(int server);
+
+static const char *affinity_mode_name(void);
+static const char *log_sink_name(void);
+static const char *readiness_name(enum readiness readiness);
+static void output_state(FILE *f, const struct app *only);
 
 #if defined(DEBUG)
 static void fprint_fd_socket(FILE *f, struct fd *fd);
@@ -131,42 +679,88 @@ static void fprint_fd_socket(FILE *f, struct fd *fd);
 
 static pid_t niagra_pid;
 static const char *config_file_name;
+static const char *config_file_path; /* absolute, for the registry */
 static const char *config_file_dir;
 static const char *config_logfile;
-static char server_command[MAX_COMMAND_LINE];
-static char config_environment[MAX_ENV_NAME];
-static struct fd fds[MAX_FDS];
-static int num_fds;
-static struct file files[MAX_FILES];
-static int num_files;
-static struct app_option app_options[MAX_APP_OPTIONS];
-static int num_app_options;
-static int copies = 1;
-static pid_t servers[MAX_COPIES];
-static pid_t backlog_servers[MAX_MIGRATE_BACKLOG][MAX_COPIES];
+static char shell_path[] = SHELL;
+/* Every app, in config file order, and the one being worked on. */
+static struct app *apps;
+static struct app *app;
+static cpu_set_t niagrad_cpus;
+/* Host-wide, as last read, and when niagrad started. */
+static unsigned long long listen_overflows;
+static unsigned long long listen_drops_count;
+static unsigned long long listen_overflows_start;
+static unsigned long long listen_drops_start;
+static bool listen_baseline_taken;
+/* Inodes of the connections accepted on our listeners, sorted. */
+static unsigned long *connection_inodes;
+static size_t num_connection_inodes;
+static size_t max_connection_inodes;
+static struct child *child_table[CHILD_TABLE_SIZE];
+/* Children get their end of the readiness socket on this fd number. */
+static int notify_fd = -1;
 static bool debug_mode = false;
 static bool no_respawn = false;
-static bool fast_spawn_protect = false;
-static struct timeval last_sigint_time;
-static struct timeval last_spawn_time;
-static int stat_restart_request_count;
-static int stat_migrate_request_count;
+static struct event_source signal_event;
+static struct timer sigint_timer = { .handler = sigint_window_expired };
+static sigset_t handled_signals;
+static bool use_pidfd;
 static int stat_state_request_count;
-static int stat_restart_node_expected_count;
-static int stat_restart_node_unexpected_count;
-static int stat_migrate_node_count;
-static int stat_backlog_node_count;
+static int stat_reload_count;
+static int stat_reload_failed_count;
+static char stat_reload_last_time[MAX_TIME_STRING];
+static char reload_changes[MAX_RELOAD_CHANGES][MAX_RELOAD_CHANGE];
+static int num_reload_changes;
+static bool reload_migrates;
 static char stat_start_time[MAX_TIME_STRING];
-static char stat_restart_last_request_time[MAX_TIME_STRING];
-static char stat_migrate_last_request_time[MAX_TIME_STRING];
-static char stat_migrate_last_node_time[MAX_TIME_STRING];
-static char stat_restart_last_node_expected_time[MAX_TIME_STRING];
-static char stat_restart_last_node_unexpected_time[MAX_TIME_STRING];
+static char runtime_dir[MAX_FILE_NAME];
+/* Permission bits the runtime directory must not have. */
+static mode_t runtime_dir_mask;
+static char control_path[MAX_SOCKET_PATH];
+static char registry_path[MAX_FILE_NAME];
+static int registry_fd = -1;
+static struct timer control_terminate_timer = { .handler = control_terminate };
+static struct timer upgrade_timer = { .handler = upgrade_niagrad };
+/* The binary and arguments niagrad was started with, to re-exec on upgrade. */
+static char niagrad_path[MAX_FILE_NAME];
+static char **niagrad_args;
+/* While starting up from an upgrade: the state of the previous niagrad,
+   and the sockets it leaves to this one. */
+static FILE *upgrade_state;
+static int inherited_control_fd = -1;
+static int inherited_metrics_fd = -1;
+static int metrics_fd = -1;
+static int stat_upgrade_count;
+/* Listeners passed by the service manager with LISTEN_FDS, named by
+   LISTEN_FDNAMES, until they are matched to sockets. */
+static int *activated_fds;
+static char **activated_names;
+static char *activated_names_buf;
+static int num_activated;
+static char stat_upgrade_last_time[MAX_TIME_STRING];
+/* How roles, readiness and app times are written in the upgrade state. */
+static const char *const role_names[] = { "live", "outgoing", "draining", "detached", "standby" };
+static const char *const readiness_keys[] = { "pending", "ok", "timeout" };
+static const char *const app_time_names[] = { "restart_request", "migrate_request", "migrate_node",
+                                              "restart_node_expected", "restart_node_unexpected" };
+#define NUM_APP_TIMES ((int) (sizeof app_time_names / sizeof app_time_names[0]))
+static time_t start_time;
+static bool metrics_enabled;
+static struct fd_socket metrics_socket;
+static enum log_sink log_sink;
+static char log_path[MAX_FILE_NAME];
+/* Histogram bounds, in seconds. */
+static const double ready_bounds[] = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+static const double drain_bounds[] = { 0.1, 0.5, 1, 5, 10, 30, 60, 120, 300, 600 };
+static const double respawn_bounds[] = { 1, 10, 60, 300, 1800, 3600, 21600, 86400 };
 
 static void
 usage(void)
 {
     printf("niagrad: [-d] [-n] config [logfile]\n");
+    printf("niagrad: -c pid state [app]|metrics|migrate [app]|restart [app]|terminate|scale n [app]|reload|upgrade|listener name [app]\n");
+    printf("niagrad: -l [match]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -177,7 +771,7 @@ daemonize(void)
     int fd;
 
     if ((child = fork()) == -1) {
-        syslog(LOG_ERR, "error forking: %m");
+        log_msg(LOG_ERR, "error forking: %m");
         exit(EXIT_FAILURE);
     }
 
@@ -190,31 +784,32 @@ daemonize(void)
         /* I really don't like this code. It should likely be refactored or removed. */
         fd = open("/dev/null", O_RDONLY);
         if (fd != STDIN_FILENO) {
-            syslog(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDIN_FILENO, fd);
+            log_msg(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDIN_FILENO, fd);
             exit(EXIT_FAILURE);
         }
 
         fd = open(config_logfile, O_WRONLY | O_CREAT | O_APPEND, 0666);
         if (fd != STDOUT_FILENO) {
-            syslog(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDOUT_FILENO, fd);
+            log_msg(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDOUT_FILENO, fd);
             exit(EXIT_FAILURE);
         }
 
         fd = dup2(fd, STDERR_FILENO);
         if (fd != STDERR_FILENO) {
-            syslog(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDERR_FILENO, fd);
+            log_msg(LOG_ALERT, "Expected file to be opened with fd %d, not %d", STDERR_FILENO, fd);
             exit(EXIT_FAILURE);
         }
 
         (void) umask(027);
 
         if (setsid() == -1) {
-            syslog(LOG_ALERT, "unable to become session leader: %m");
+            log_msg(LOG_ALERT, "unable to become session leader: %m");
             exit(EXIT_FAILURE);
         }
 
     } else {
-        exit(EXIT_SUCCESS);
+        /* Without exit handlers, as the child writes the queued log. */
+        _exit(EXIT_SUCCESS);
     }
 }
 
@@ -240,7 +835,7 @@ static void
 change_dir(void)
 {
     if (chdir(config_file_dir) != 0) {
-        syslog(LOG_ALERT, "unable to change directory: %m");
+        log_msg(LOG_ALERT, "unable to change directory: %m");
         exit(EXIT_FAILURE);
     }
 }
@@ -263,18 +858,39 @@ store_time(char *buf)
 int
 main(int argc, char **argv)
 {
-    pid_t pid;
-    int status;
     int ch;
     int logopt = LOG_NDELAY;
+    const char *client_pid = NULL;
+    bool list_mode = false;
+    int state_fd = -1;
+    ssize_t n;
 
     store_time(stat_start_time);
+    start_time = time(NULL);
+
+    /* An upgrade execs the same arguments, after its own. */
+    niagrad_args = argv + 1;
+    if (argc > 2 && strcmp(argv[1], UPGRADE_ARG) == 0) {
+        niagrad_args = argv + 3;
+    }
 
-    while ((ch = getopt(argc, argv, "dn")) != -1) {
+    while ((ch = getopt(argc, argv, "+c:dlnu:")) != -1) {
         switch (ch) {
+        case 'c':
+            client_pid = optarg;
+            break;
+        case 'u':
+            /* Internal: the state left by the niagrad being upgraded. */
+            if (str_int(optarg, &state_fd) == -1 || state_fd < 0) {
+                usage();
+            }
+            break;
         case 'd':
             debug_mode = true;
             break;
+        case 'l':
+            list_mode = true;
+            break;
         case 'n':
             no_respawn = true;
             break;
@@ -286,12 +902,27 @@ main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
+    if (client_pid != NULL) {
+        return run_client(client_pid, argc, argv);
+    }
+
+    if (list_mode) {
+        if (argc > 1) {
+            usage();
+        }
+        return list_instances(argc == 1 ? argv[0] : NULL);
+    }
+
     if (argc != 1 && argc != 2) {
         usage();
     }
 
     config_file_name = argv[0];
     config_file_dir = get_parent_dir(config_file_name);
+    config_file_path = realpath(config_file_name, NULL);
+    if (config_file_path == NULL) {
+        config_file_path = config_file_name;
+    }
 
     if (argc == 2) {
         config_logfile = argv[1];
@@ -302,948 +933,6646 @@ main(int argc, char **argv)
     logopt |= LOG_PERROR;
 
     openlog(SYSLOG_IDENT, logopt, LOG_DAEMON);
+    /* Until the writer starts, records are queued. */
+    (void) atexit(log_flush);
+
+    /* Before daemonizing, since they are addressed to this pid. */
+    collect_activated_sockets();
 
-    if (!debug_mode) {
+    /* An upgraded niagrad already is the daemon, and keeps its pid. */
+    if (!debug_mode && state_fd == -1) {
         daemonize();
     }
 
     niagra_pid = getpid();
-    syslog(LOG_INFO, "niagrad started: %ld", (long) niagra_pid);
+    log_msg(LOG_INFO, "niagrad %s: %ld", state_fd == -1 ? "started" : "upgraded", (long) niagra_pid);
 
-    install_signal_handlers();
+    n = readlink(SELF_EXE, niagrad_path, sizeof niagrad_path - 1);
+    if (n == -1 || n == sizeof niagrad_path - 1) {
+        log_msg(LOG_INFO, "WARNING: unable to find the niagrad binary (%m), upgrades are disabled");
+        niagrad_path[0] = '\0';
+    } else {
+        niagrad_path[n] = '\0';
+    }
+
+    /* For the respawn backoff jitter. */
+    srandom(niagra_pid ^ start_time);
+
+    block_signals();
 
-    parse_config_file();
-    if (str_isempty(server_command)) {
-        syslog(LOG_ERR, "no command specified.");
+    if (parse_config_file() == -1) {
         exit(EXIT_FAILURE);
     }
+    if (state_fd != -1) {
+        read_state(state_fd);
+        restore_listeners();
+    }
+    adopt_activated_sockets();
+    for (app = apps; app != NULL; app = app->next) {
+        if (plan_affinity(app->copies, &app->placements) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
     change_dir();
 
-    create_sockets();
+    if (log_start(log_sink, log_path) == -1) {
+        log_msg(LOG_ERR, "error starting the logger: %m");
+        exit(EXIT_FAILURE);
+    }
+
+    for (app = apps; app != NULL; app = app->next) {
+        create_sockets();
+        open_files();
+    }
 
-    open_files();
+    reserve_notify_fd();
 
-    update_command_line();
+    for (app = apps; app != NULL; app = app->next) {
+        if (update_command_line() == -1) {
+            exit(EXIT_FAILURE);
+        }
+        alloc_servers();
+    }
 
     drop_privs();
 
-    spawn_servers();
+    /* After the listeners and files, so they get the lowest fd numbers. */
+    init_events();
 
-    for (;;) {
-        bool respawn = !no_respawn;
-        pid = waitpid(-1, &status, 0);
+    open_control_socket();
 
-        if (pid == -1) {
-            syslog(LOG_ERR, "error waiting for process: %m");
-            exit(EXIT_FAILURE);
-        }
+    register_instance();
 
-        if (WIFEXITED(status)) {
-            switch (WEXITSTATUS(status)) {
-            case 126:
-            case 127:
-                /* we treat 126 and 127 as errors from the shell itself */
-                syslog(LOG_ERR, "process exited with shell error: pid: %ld status: %d", (long) pid,
-                       WEXITSTATUS(status));
-                respawn = false;
-                break;
-            default:
-                syslog(LOG_INFO, "process exited. pid: %ld status: %d", (long) pid, WEXITSTATUS(status));
-                break;
-            }
-        } else if (WIFSIGNALED(status)) {
-            syslog(LOG_INFO, "process signalled. pid: %ld status: %d", (long) pid, WTERMSIG(status));
+    open_metrics_socket();
+
+    if (upgrade_state != NULL) {
+        restore_children();
+    }
+
+    for (app = apps; app != NULL; app = app->next) {
+        if (app->adopted) {
+            resume_app();
         } else {
-            syslog(LOG_ERR, "error: unexpected status for pid: %ld", (long) pid);
-            exit(EXIT_FAILURE);
+            start_app();
         }
+    }
 
-        /* If the PID is an active PID, then we should respawn it. */
-        int server;
-        if ((server = find_server(pid)) >= 0) {
-            stat_restart_node_unexpected_count += 1;
-            store_time(stat_restart_last_node_unexpected_time);
-            syslog(LOG_ERR, "server %d (pid %d) terminated unexpectedly by signal", server, pid);
-            if (respawn) {
-                syslog(LOG_ERR, "server %d (pid %d) respawning", server, pid);
-                spawn_server(server);
-            } else {
-                /* Child died, but we've been asked not to respawn. Remove the pid from servers. */
-                servers[server] = NO_PID;
-            }
-        } else {
-            /* Backlog process exited, find it and clear it. */
-            clear_backlog_server(pid);
+    for (;;) {
+        if (event_run() == -1) {
+            log_msg(LOG_ERR, "error waiting for events: %m");
+            exit(EXIT_FAILURE);
         }
     }
 
     return EXIT_FAILURE;
 }
 
-/* SIGUSR1 migrates all servers (zero-downtime restart). */
+/* Block the signals niagrad handles so they are only delivered through a
+   signalfd, and all state changes happen from the event loop. */
 static void
-sigusr1_handler(int signum, siginfo_t *siginfo, void *context)
+block_signals(void)
 {
-    pid_t from_pid = getpid();
-    if (from_pid != niagra_pid) {
-        syslog(LOG_ERR, "SIGUSR1: from pid %d, not niagra, doing nothing", from_pid);
-        return;
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigaddset(&handled_signals, SIGUSR2);
+    sigaddset(&handled_signals, SIGHUP);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGCHLD);
+    if (debug_mode) {
+        sigaddset(&handled_signals, SIGINT);
     }
 
-    syslog(LOG_INFO, "SIGUSR1: migrating all servers");
-    migrate_servers();
+    if (sigprocmask(SIG_BLOCK, &handled_signals, NULL) == -1) {
+        log_msg(LOG_ERR, "error blocking signals: %m");
+        exit(EXIT_FAILURE);
+    }
 }
 
-/* SIGINT restarts all servers (possible-downtime restart). */
 static void
-sigint_handler(int signum, siginfo_t *siginfo, void *context)
+init_events(void)
 {
-    pid_t from_pid = getpid();
-    if (from_pid != niagra_pid) {
-        syslog(LOG_ERR, "SIGINT: from pid %d, not niagra, doing nothing", from_pid);
-        return;
+    int fd;
+
+    if (event_init() == -1) {
+        log_msg(LOG_ERR, "error creating event loop: %m");
+        exit(EXIT_FAILURE);
     }
 
-    struct timeval new_time;
-    (void) gettimeofday(&new_time, NULL);
-    if (new_time.tv_sec == last_sigint_time.tv_sec) {
-        syslog(LOG_INFO, "SIGINT(fast): terminate all servers & exit");
-        terminate_servers();
-        exit(EXIT_SUCCESS);
+    /* pidfds need Linux 5.3. Without them children are reaped on SIGCHLD. */
+    fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (fd != -1) {
+        use_pidfd = true;
+        (void) close(fd);
+    } else {
+        log_msg(LOG_INFO, "WARNING: pidfd not available (%m), reaping children on SIGCHLD");
+    }
+
+    signal_event.fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_event.fd == -1) {
+        log_msg(LOG_ERR, "error creating signalfd: %m");
+        exit(EXIT_FAILURE);
     }
-    last_sigint_time = new_time;
+    signal_event.handler = handle_signals;
 
-    syslog(LOG_INFO, "SIGINT: restarting (not migrate) all servers");
-    restart_servers();
+    if (event_add(&signal_event, EPOLLIN) == -1) {
+        log_msg(LOG_ERR, "error watching signals: %m");
+        exit(EXIT_FAILURE);
+    }
 }
 
-/* SIGTERM terminates all servers and exits (downtime!). */
+/* The handlers work on every app; the current one is current again on
+   return. */
 static void
-sigterm_handler(int signum, siginfo_t *siginfo, void *context)
+handle_signals(struct event_source *source, uint32_t events)
 {
-    pid_t from_pid = getpid();
-    if (from_pid != niagra_pid) {
-        syslog(LOG_ERR, "SIGTERM: from pid %d, not niagra, doing nothing", from_pid);
-        return;
+    struct signalfd_siginfo info;
+    struct app *current = app;
+
+    while (read(source->fd, &info, sizeof info) == sizeof info) {
+        switch (info.ssi_signo) {
+        case SIGUSR1:
+            handle_sigusr1();
+            break;
+        case SIGUSR2:
+            handle_sigusr2();
+            break;
+        case SIGHUP:
+            handle_sighup();
+            break;
+        case SIGINT:
+            handle_sigint();
+            break;
+        case SIGTERM:
+            handle_sigterm();
+            break;
+        case SIGCHLD:
+            if (!use_pidfd) {
+                reap_children();
+            }
+            break;
+        }
     }
 
-    syslog(LOG_INFO, "SIGTERM: terminate all servers & exit");
-    terminate_servers();
-    exit(EXIT_FAILURE);
+    app = current;
 }
 
-/* SIGUSR2 outputs state. */
+/* Start watching a newly spawned child for exit. */
 static void
-sigusr2_handler(int signum, siginfo_t *siginfo, void *context)
+watch_child(struct child *child)
 {
-    pid_t from_pid = getpid();
-    if (from_pid != niagra_pid) {
-        syslog(LOG_ERR, "SIGUSR2: from pid %d, not niagra, doing nothing", from_pid);
+    int fd;
+
+    child->ev.fd = -1;
+
+    if (!use_pidfd) {
+        return;
+    }
+
+    fd = syscall(SYS_pidfd_open, child->pid, 0);
+    if (fd == -1) {
+        /* Out of fds or similar. Fall back to SIGCHLD for everything. */
+        log_msg(LOG_ERR, "error opening pidfd for pid %d: %m, reaping children on SIGCHLD", child->pid);
+        use_pidfd = false;
+        reap_children();
         return;
     }
 
-    syslog(LOG_INFO, "SIGUSR2: outputting state");
-    output_state(siginfo->si_pid);
+    child->ev.fd = fd;
+    child->ev.handler = child_event;
+    child->ev.data = child;
+
+    if (event_add(&child->ev, EPOLLIN) == -1) {
+        log_msg(LOG_ERR, "error watching pid %d: %m", child->pid);
+        exit(EXIT_FAILURE);
+    }
 }
 
+/* A pidfd only becomes readable once its process has exited. */
 static void
-install_signal_handlers(void)
+child_event(struct event_source *source, uint32_t events)
 {
-    int r;
-    struct sigaction sa;
+    struct child *child = source->data;
+    int status;
+    pid_t pid;
 
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART; /* Restart functions if interrupted by handler */
+    pid = waitpid(child->pid, &status, WNOHANG);
 
-    sa.sa_sigaction = sigusr1_handler;
-    r = sigaction(SIGUSR1, &sa, NULL);
-    if (r == -1) {
-        syslog(LOG_ERR, "error installing handler: %m");
-        exit(EXIT_FAILURE);
+    if (pid == child->pid) {
+        child_exited(pid, status);
     }
+}
 
-    sa.sa_sigaction = sigterm_handler;
-    r = sigaction(SIGTERM, &sa, NULL);
-    if (r == -1) {
-        syslog(LOG_ERR, "error installing handler: %m");
-        exit(EXIT_FAILURE);
+static void
+reap_children(void)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        child_exited(pid, status);
     }
+}
 
-    sa.sa_sigaction = sigusr2_handler;
-    r = sigaction(SIGUSR2, &sa, NULL);
-    if (r == -1) {
-        syslog(LOG_ERR, "error installing handler: %m");
+/* Called from wherever children are reaped, possibly while another app
+   is being worked on, which is current again on return. */
+static void
+child_exited(pid_t pid, int status)
+{
+    bool respawn = !no_respawn;
+    struct app *current = app;
+    struct child *child;
+    uint64_t uptime;
+    int server;
+
+    if (WIFEXITED(status)) {
+        switch (WEXITSTATUS(status)) {
+        case 126:
+        case 127:
+            /* we treat 126 and 127 as errors from the shell itself */
+            log_msg(LOG_ERR, "process exited with shell error: pid: %ld status: %d", (long) pid,
+                   WEXITSTATUS(status));
+            respawn = false;
+            break;
+        default:
+            log_msg(LOG_INFO, "process exited. pid: %ld status: %d", (long) pid, WEXITSTATUS(status));
+            break;
+        }
+    } else if (WIFSIGNALED(status)) {
+        log_msg(LOG_INFO, "process signalled. pid: %ld status: %d", (long) pid, WTERMSIG(status));
+    } else {
+        log_msg(LOG_ERR, "error: unexpected status for pid: %ld", (long) pid);
         exit(EXIT_FAILURE);
     }
 
-    if (debug_mode) {
-        sa.sa_sigaction = sigint_handler;
-        r = sigaction(SIGINT, &sa, NULL);
+    child = find_child(pid);
+    if (child == NULL) {
+        return;
+    }
 
-        if (r == -1) {
-            syslog(LOG_ERR, "error installing handler: %m");
-            exit(EXIT_FAILURE);
+    app = child->app;
+    server = child->slot;
+
+    switch (child->role) {
+    case CHILD_LIVE:
+        /* An active server died, so we should respawn it. */
+        app->servers[server] = NULL;
+        uptime = event_now() - child->spawn_time;
+        histogram_observe(&app->respawn_histogram, uptime / 1000.0);
+        app->stat_restart_node_unexpected_count += 1;
+        store_time(app->stat_restart_last_node_unexpected_time);
+        log_msg(LOG_ERR, "server %d (pid %d) terminated unexpectedly by signal", server, pid);
+        if (respawn) {
+            server_failed(server, uptime);
+        } else {
+            app->slot_health[server].stopped = true;
+        }
+        /* If it was replacing an outgoing server, that one carries on. */
+        cancel_migration(server);
+        break;
+    case CHILD_OUTGOING:
+        /* Died before its replacement was ready; nothing to hand over. */
+        app->outgoing_servers[server] = NULL;
+        log_msg(LOG_ERR, "outgoing server %d (pid %d) exited before its replacement was ready", server, pid);
+        break;
+    case CHILD_DRAINING:
+        log_msg(LOG_INFO, "old server %d (pid %d) drained in %llu ms", server, pid,
+               (unsigned long long) (event_now() - child->drain_start));
+        histogram_observe(&app->drain_histogram, (event_now() - child->drain_start) / 1000.0);
+        stop_draining(child);
+        break;
+    case CHILD_STANDBY:
+        app->standbys[server] = NULL;
+        log_msg(LOG_ERR, "standby %d (pid %d) exited", server, pid);
+        if (respawn) {
+            standby_failed();
+        }
+        break;
+    case CHILD_DETACHED:
+        break;
+    }
+
+    remove_child(child);
+
+    if (app->removed) {
+        if (app->num_children == 0) {
+            free_app(app);
+        }
+    } else {
+        if (respawn) {
+            fill_standbys();
         }
+        migration_progress();
     }
+
+    app = current;
 }
 
+/* Hold a low fd number for the readiness socket, so that it can be passed
+   on the command line once for all servers. In a child the reserved fd is
+   replaced with the child's end of its own socket. */
 static void
-parse_config_file(void)
+reserve_notify_fd(void)
 {
-    FILE *f;
-    int i, n, r;
+    notify_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    static char line[MAX_LINE_SIZE];
-    char *command_value[2];
-    char *socket_parts[NUM_SOCK_OPTIONS];
-    char *file_parts[NUM_FILE_OPTIONS];
+    if (notify_fd == -1) {
+        log_msg(LOG_ERR, "error reserving notify fd: %m");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    f = fopen(config_file_name, "r");
+/* Create a readiness socket: notify[0] is niagrad's end and does not block,
+   notify[1] is the child's and does. Return -1 on error. */
+static int
+open_notify_socket(int notify[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, notify) == -1) {
+        return -1;
+    }
 
-    if (f == NULL) {
-        syslog(LOG_ERR, "opening config file: %m");
-        exit(EXIT_FAILURE);
+    if (fcntl(notify[0], F_SETFL, O_NONBLOCK) == -1) {
+        (void) close(notify[0]);
+        (void) close(notify[1]);
+        return -1;
     }
 
-    i = 0;
-    while (i++, (n = str_readline(f, line, sizeof line)) > 0) {
+    return 0;
+}
 
-        if (line[0] == '#') {
-            /* Comment line */
-            continue;
-        }
+/* Wait for a newly spawned server to write "ready" on its notify socket,
+   or for the ready timeout. */
+static void
+watch_notify(struct child *child, int fd)
+{
+    child->spawn_time = event_now();
+    child->readiness = READY_PENDING;
 
-        r = str_split(line, ':', command_value, 2);
+    child->notify_ev.fd = fd;
+    child->notify_ev.handler = notify_event;
+    child->notify_ev.data = child;
 
-        if (r < 2) {
-            /* Must be a command portion */
-            n = -1;
-            break;
-        }
+    if (event_add(&child->notify_ev, EPOLLIN) == -1) {
+        log_msg(LOG_ERR, "error watching notify socket of pid %d: %m", child->pid);
+        exit(EXIT_FAILURE);
+    }
 
-        command_value[1] = str_strip(command_value[1], ' ');
+    child->ready_timer.handler = ready_timer_expired;
+    child->ready_timer.data = child;
 
-        if (strcmp(command_value[0], "command") == 0) {
-            if (!str_isempty(server_command)) {
-                syslog(LOG_INFO, "command already set.");
-                n = -1;
-                break;
-            }
+    if (app->ready_timeout > 0) {
+        timer_start(&child->ready_timer, app->ready_timeout);
+    }
+}
 
-            r = str_copy(server_command, command_value[1], sizeof server_command);
+static void
+notify_event(struct event_source *source, uint32_t events)
+{
+    struct child *child = source->data;
+    char message[MAX_NOTIFY_MESSAGE];
+    ssize_t n;
 
-            if (r == -1) {
-                syslog(LOG_INFO, "command too long.");
-                n = -1;
-                break;
-            }
+    app = child->app;
 
-        } else if (strcmp(command_value[0], "file") == 0) {
-            struct file *file;
+    n = read(source->fd, message, sizeof message - 1);
 
-            r = str_split(command_value[1], ' ', file_parts, NUM_FILE_OPTIONS);
-            if (r != NUM_FILE_OPTIONS) {
-                syslog(LOG_INFO, "Incorrect number of fields (%d) for file options. Should be %d fields.",
-                       r, NUM_FILE_OPTIONS);
-                n = -1;
-                break;
-            }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
 
-            if (num_files >= MAX_FILES) {
-                syslog(LOG_INFO, "Too many files defined. A maximum of %d is allowed", MAX_FILES);
-                n = -1;
-                break;
-            }
+    if (n <= 0) {
+        /* Closed without reporting ready, e.g. a server which does not speak
+           the protocol. The timeout or the exit handling takes over. A
+           standby can no longer be promoted. */
+        if (child->role == CHILD_STANDBY) {
+            retire_standby(child);
+        } else {
+            close_notify(child);
+        }
+        return;
+    }
 
-            file = &files[num_files];
+    message[n] = '\0';
 
-            if (lookup_file_by_key(file_parts[0]) != -1) {
-                syslog(LOG_INFO, "duplicate file key: %s", file_parts[0]);
-                n = -1;
-                break;
-            }
+    if (strstr(message, "ready") != NULL) {
+        server_ready(child);
+    }
+}
 
-            r = str_copy(file->key, file_parts[0], sizeof file->key);
-            if (r == -1) {
-                syslog(LOG_INFO, "file key too long");
-                n = -1;
-                break;
-            }
+static void
+close_notify(struct child *child)
+{
+    if (child->notify_ev.fd != -1) {
+        (void) event_del(&child->notify_ev);
+        (void) close(child->notify_ev.fd);
+        child->notify_ev.fd = -1;
+    }
+}
 
-            r = str_copy(file->name, file_parts[1], sizeof file->name);
-            if (r == -1) {
-                syslog(LOG_INFO, "file name too long");
-                n = -1;
-                break;
-            }
+static void
+server_ready(struct child *child)
+{
+    timer_stop(&child->ready_timer);
 
-            num_files++;
+    child->readiness = READY_OK;
+    child->ready_time = event_now() - child->spawn_time;
 
-        } else if (strcmp(command_value[0], "socket") == 0) {
-            struct fd *fd;
+    /* A standby is loaded, but keeps its socket to be promoted through. */
+    if (child->role == CHILD_STANDBY) {
+        log_msg(LOG_INFO, "standby %d (pid %d) ready after %llu ms", child->slot, child->pid,
+               (unsigned long long) child->ready_time);
+        app->standby_health.failures = 0;
+        return;
+    }
 
-            r = str_split(command_value[1], ' ', socket_parts, NUM_SOCK_OPTIONS);
-            if (r != NUM_SOCK_OPTIONS) {
-                syslog(LOG_INFO, "Incorrect number of fields (%d) for socket options. Should be %d fields.",
-                       r, NUM_SOCK_OPTIONS);
-                n = -1;
-                break;
-            }
+    close_notify(child);
 
-            if (num_fds >= MAX_FDS) {
-                syslog(LOG_INFO, "Too many fds defined. A maximum of %d is allowed", MAX_FDS);
-                n = -1;
-                break;
-            }
+    log_msg(LOG_INFO, "server %d (pid %d) ready after %llu ms", child->slot, child->pid,
+           (unsigned long long) child->ready_time);
 
-            fd = &fds[num_fds];
+    if (child->role == CHILD_LIVE) {
+        histogram_observe(&app->ready_histogram, child->ready_time / 1000.0);
+        complete_migration(child->slot);
+        migration_progress();
+    }
+}
 
-            if (lookup_fd_by_name(socket_parts[0]) != -1) {
-                syslog(LOG_INFO, "duplicate fd name: %s", socket_parts[0]);
-                n = -1;
-                break;
-            }
+static void
+ready_timer_expired(struct timer *t)
+{
+    struct child *child = t->data;
 
-            r = str_copy(fd->name, socket_parts[0], sizeof fd->name);
-            if (r == -1) {
-                syslog(LOG_INFO, "socket name too long");
-                n = -1;
-                break;
-            }
+    app = child->app;
+    child->readiness = READY_TIMEOUT;
 
-            r = str_copy(fd->type, socket_parts[1], sizeof fd->type);
-            if (r == -1) {
-                syslog(LOG_INFO, "socket type too long");
+    /* A standby which does not start up is never promoted. */
+    if (child->role == CHILD_STANDBY) {
+        log_msg(LOG_ERR, "standby %d (pid %d) not ready after %d ms", child->slot, child->pid, app->ready_timeout);
+        retire_standby(child);
+        return;
+    }
+
+    close_notify(child);
+
+    log_msg(LOG_ERR, "server %d (pid %d) not ready after %d ms", child->slot, child->pid, app->ready_timeout);
+
+    if (child->role == CHILD_LIVE) {
+        complete_migration(child->slot);
+        migration_progress();
+    }
+}
+
+/* SIGUSR1 migrates the servers of every app (zero-downtime restart). */
+static void
+handle_sigusr1(void)
+{
+    log_msg(LOG_INFO, "SIGUSR1: migrating all servers");
+    for (app = apps; app != NULL; app = app->next) {
+        migrate_servers();
+    }
+}
+
+/* SIGINT restarts all servers (possible-downtime restart). */
+static void
+handle_sigint(void)
+{
+    if (timer_armed(&sigint_timer)) {
+        log_msg(LOG_INFO, "SIGINT(fast): terminate all servers & exit");
+        terminate_apps();
+        remove_unix_sockets();
+        control_unlink();
+        unregister_instance();
+        exit(EXIT_SUCCESS);
+    }
+    timer_start(&sigint_timer, SIGINT_WINDOW);
+
+    log_msg(LOG_INFO, "SIGINT: restarting (not migrate) all servers");
+    for (app = apps; app != NULL; app = app->next) {
+        restart_servers();
+    }
+}
+
+static void
+sigint_window_expired(struct timer *t)
+{
+}
+
+/* SIGTERM terminates all servers and exits (downtime!). */
+static void
+handle_sigterm(void)
+{
+    log_msg(LOG_INFO, "SIGTERM: terminate all servers & exit");
+    terminate_apps();
+    remove_unix_sockets();
+    control_unlink();
+    unregister_instance();
+    exit(EXIT_FAILURE);
+}
+
+/* SIGUSR2 used to write the state to a file in /tmp. It is still caught so
+   that old clients do not kill niagrad. */
+static void
+handle_sigusr2(void)
+{
+    log_msg(LOG_INFO, "SIGUSR2: state is served on the control socket %s", control_path);
+}
+
+/* SIGHUP reloads the config file. */
+static void
+handle_sighup(void)
+{
+    const char *error;
+
+    log_msg(LOG_INFO, "SIGHUP: reloading config");
+    if (reload_config(&error) == -1) {
+        log_msg(LOG_ERR, "reload failed: %s", error);
+    }
+}
+
+/* The control socket goes in $NIAGRA_RUNTIME_DIR if set, /var/run/niagra
+   for root and a directory private to the user otherwise. Return -1 if the
+   name is too long. */
+static int
+find_runtime_dir(void)
+{
+    const char *dir = getenv(RUNTIME_DIR_ENV);
+    int r;
+
+    runtime_dir_mask = S_IWGRP | S_IWOTH;
+
+    if (dir != NULL && !str_isempty(dir)) {
+        r = snprintf(runtime_dir, sizeof runtime_dir, "%s", dir);
+    } else if (geteuid() == 0) {
+        r = snprintf(runtime_dir, sizeof runtime_dir, "%s", RUNTIME_DIR);
+    } else {
+        r = snprintf(runtime_dir, sizeof runtime_dir, USER_RUNTIME_DIR, (long) geteuid());
+        runtime_dir_mask = S_IRWXG | S_IRWXO;
+    }
+
+    return r >= (int)(sizeof runtime_dir) ? -1 : 0;
+}
+
+/* Whoever controls the runtime directory can replace the control socket
+   and the registry files in it, so it must be a directory of this user
+   which nobody else can write to. The one in /tmp, whose name anyone could
+   have taken first, must be private. Return -1 with errno set if not. */
+static int
+check_runtime_dir(void)
+{
+    struct stat st;
+
+    if (lstat(runtime_dir, &st) == -1) {
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    if (st.st_uid != geteuid() || (st.st_mode & runtime_dir_mask) != 0) {
+        errno = EPERM;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+format_control_path(long pid)
+{
+    int r = snprintf(control_path, sizeof control_path, "%s/%ld.sock", runtime_dir, pid);
+    return r >= (int)(sizeof control_path) ? -1 : 0;
+}
+
+static void
+open_control_socket(void)
+{
+    if (find_runtime_dir() == -1 || format_control_path((long) niagra_pid) == -1) {
+        log_msg(LOG_ERR, "control socket path too long");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdir(runtime_dir, geteuid() == 0 ? 0755 : 0700) == -1 && errno != EEXIST) {
+        log_msg(LOG_ERR, "error creating runtime directory %s: %m", runtime_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    if (check_runtime_dir() == -1) {
+        log_msg(LOG_ERR, "refusing runtime directory %s, it must be owned by this user and not writable by others: %m",
+                runtime_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    /* After an upgrade the socket never stops accepting requests. */
+    if (inherited_control_fd != -1) {
+        if (control_adopt(inherited_control_fd, control_path, handle_control) == 0) {
+            log_msg(LOG_INFO, "control socket: %s", control_path);
+            return;
+        }
+        log_msg(LOG_ERR, "error taking over control socket %s: %m", control_path);
+        (void) close(inherited_control_fd);
+    }
+
+    if (control_listen(control_path, handle_control) == -1) {
+        log_msg(LOG_ERR, "error creating control socket %s: %m", control_path);
+        exit(EXIT_FAILURE);
+    }
+
+    log_msg(LOG_INFO, "control socket: %s", control_path);
+}
+
+/* A request is a command and its arguments separated by spaces. state,
+   migrate, restart, scale and listener take the name of an app as an
+   optional last argument, and otherwise apply to every app (scale and
+   listener only if there is just one). The reply to 'state' is the state document and to 'metrics' the
+   metrics text; every other reply is an object with "ok" set. A request
+   may work on any app, and the current one is current again on return. */
+static void
+handle_control(char *request, FILE *reply)
+{
+    struct app *current = app;
+
+    run_control_request(request, reply);
+
+    app = current;
+}
+
+static void
+run_control_request(char *request, FILE *reply)
+{
+    char *args[MAX_CONTROL_ARGS];
+    struct app *only = NULL;
+    const char *error;
+    struct json j;
+    int argc, n, num_args;
+
+    if (str_isempty(request)) {
+        reply_error(reply, "", "empty request");
+        return;
+    }
+
+    argc = str_split(str_strip(request, ' '), ' ', args, MAX_CONTROL_ARGS);
+
+    log_msg(LOG_INFO, "control: %s", request);
+
+    num_args = (strcmp(args[0], "scale") == 0 || strcmp(args[0], "listener") == 0 ? 2 : 1);
+    if (argc == num_args + 1 && (strcmp(args[0], "state") == 0 || strcmp(args[0], "migrate") == 0 ||
+                                 strcmp(args[0], "restart") == 0 || strcmp(args[0], "scale") == 0 ||
+                                 strcmp(args[0], "listener") == 0)) {
+        only = find_app(args[num_args]);
+        if (only == NULL) {
+            reply_error(reply, args[0], "unknown app");
+            return;
+        }
+        argc--;
+    }
+
+    if (strcmp(args[0], "state") == 0 && argc == 1) {
+        output_state(reply, only);
+        return;
+    }
+
+    if (strcmp(args[0], "metrics") == 0 && argc == 1) {
+        output_metrics(reply);
+        return;
+    }
+
+    if (strcmp(args[0], "migrate") == 0 && argc == 1) {
+        for (app = apps; app != NULL; app = app->next) {
+            if (only == NULL || app == only) {
+                migrate_servers();
+            }
+        }
+    } else if (strcmp(args[0], "restart") == 0 && argc == 1) {
+        for (app = apps; app != NULL; app = app->next) {
+            if (only == NULL || app == only) {
+                restart_servers();
+            }
+        }
+    } else if (strcmp(args[0], "terminate") == 0 && argc == 1) {
+        /* Exit once the reply has gone out. */
+        timer_start(&control_terminate_timer, 0);
+    } else if (strcmp(args[0], "scale") == 0 && argc == 2) {
+        if (only == NULL && apps->next != NULL) {
+            reply_error(reply, args[0], "app name required");
+            return;
+        }
+        app = (only != NULL ? only : apps);
+        if (str_int(args[1], &n) == -1 || n <= 0) {
+            reply_error(reply, args[0], "invalid number of copies");
+            return;
+        }
+        if (app->autoscale && (n < app->copies_min || n > app->copies_max)) {
+            reply_error(reply, args[0], "outside the autoscaling range");
+            return;
+        }
+        if (scale_servers(n, &error) == -1) {
+            reply_error(reply, args[0], error);
+            return;
+        }
+        only = app;
+    } else if (strcmp(args[0], "reload") == 0 && argc == 1) {
+        if (reload_config(&error) == -1) {
+            reply_error(reply, args[0], error);
+            return;
+        }
+    } else if (strcmp(args[0], "upgrade") == 0 && argc == 1) {
+        error = upgrade_refused();
+        if (error != NULL) {
+            reply_error(reply, args[0], error);
+            return;
+        }
+        /* Exec once the reply has gone out. */
+        timer_start(&upgrade_timer, 0);
+    } else if (strcmp(args[0], "listener") == 0 && argc == 2) {
+        if (only == NULL && apps->next != NULL) {
+            reply_error(reply, args[0], "app name required");
+            return;
+        }
+        app = (only != NULL ? only : apps);
+        if ((n = export_listener(args[1], &error)) == -1) {
+            reply_error(reply, args[0], error);
+            return;
+        }
+        only = app;
+    } else if (strcmp(args[0], "state") == 0 || strcmp(args[0], "metrics") == 0 ||
+               strcmp(args[0], "migrate") == 0 || strcmp(args[0], "reload") == 0 ||
+               strcmp(args[0], "restart") == 0 || strcmp(args[0], "terminate") == 0 ||
+               strcmp(args[0], "scale") == 0 || strcmp(args[0], "upgrade") == 0 ||
+               strcmp(args[0], "listener") == 0) {
+        reply_error(reply, args[0], "wrong number of arguments");
+        return;
+    } else {
+        reply_error(reply, args[0], "unknown command");
+        return;
+    }
+
+    json_init(&j, reply);
+    json_object_begin(&j, NULL);
+    json_bool(&j, "ok", true);
+    json_string(&j, "command", args[0]);
+    if (only != NULL) {
+        json_string(&j, "app", only->name);
+    }
+    if (strcmp(args[0], "scale") == 0) {
+        json_int(&j, "copies", only->copies);
+    }
+    if (strcmp(args[0], "listener") == 0) {
+        json_string(&j, "name", args[1]);
+        json_int(&j, "fds", n);
+    }
+    if (strcmp(args[0], "reload") == 0) {
+        json_bool(&j, "migrate", reload_migrates);
+        json_object_begin(&j, "copies");
+        for (app = apps; app != NULL; app = app->next) {
+            json_int(&j, app->name, app->copies);
+        }
+        json_object_end(&j);
+        json_array_begin(&j, "changes");
+        for (n = 0; n < num_reload_changes; n++) {
+            json_string(&j, NULL, reload_changes[n]);
+        }
+        json_array_end(&j);
+    }
+    json_object_end(&j);
+}
+
+static void
+reply_error(FILE *reply, const char *command, const char *error)
+{
+    struct json j;
+
+    json_init(&j, reply);
+    json_object_begin(&j, NULL);
+    json_bool(&j, "ok", false);
+    json_string(&j, "command", command);
+    json_string(&j, "error", error);
+    json_object_end(&j);
+}
+
+static void
+control_terminate(struct timer *t)
+{
+    log_msg(LOG_INFO, "control: terminate all servers & exit");
+    terminate_apps();
+    remove_unix_sockets();
+    control_unlink();
+    unregister_instance();
+    exit(EXIT_SUCCESS);
+}
+
+/* Pass the listener of the current app's socket 'name' to the process
+   which asked for it, so that it can accept connections alongside the
+   servers: every shard, in slot order, for a reuseport socket. Only
+   processes of niagrad's own user, or root, get it. Return the number of
+   fds passed, or -1 with 'error' set. */
+static int
+export_listener(const char *name, const char **error)
+{
+    struct fd *fd;
+    pid_t pid;
+    uid_t uid;
+    int i, n;
+
+    if (control_peer(&pid, &uid) == -1) {
+        *error = "unknown peer";
+        return -1;
+    }
+
+    if (uid != 0 && uid != geteuid()) {
+        log_msg(LOG_ERR, "control: pid %ld (uid %ld) not allowed socket %s", (long) pid, (long) uid, name);
+        *error = "not authorized";
+        return -1;
+    }
+
+    i = lookup_fd_by_name(name);
+    if (i == -1 || app->fds[i].fd_type != SOCKET_FD) {
+        *error = "unknown socket";
+        return -1;
+    }
+    fd = &app->fds[i];
+
+    n = num_queues(&fd->x.sock);
+    if (control_attach_fds(fd->x.sock.reuseport ? fd->x.sock.shards : &fd->fd, n) == -1) {
+        log_msg(LOG_ERR, "control: error passing socket %s: %m", name);
+        *error = (errno == EINVAL ? "too many shards" : "error passing socket");
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "control: socket %s of app %s passed to pid %ld", name, app->name, (long) pid);
+
+    return n;
+}
+
+/* Return why niagrad cannot be upgraded now, or NULL if it can. Migrations
+   and the removal of apps are left to finish first, so that only settled
+   state has to be handed over. */
+static const char *
+upgrade_refused(void)
+{
+    struct child *child;
+    struct app *a;
+    int i;
+
+    if (str_isempty(niagrad_path)) {
+        return "niagrad binary unknown";
+    }
+
+    for (a = apps; a != NULL; a = a->next) {
+        if (a->migrating) {
+            return "migration in progress";
+        }
+    }
+
+    for (i = 0; i < CHILD_TABLE_SIZE; i++) {
+        for (child = child_table[i]; child != NULL; child = child->hash_next) {
+            if (child->app->removed) {
+                return "app removal in progress";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Re-exec the niagrad binary, which is found again by path so that a new
+   build installed over it is what runs. The state goes to a memfd the new
+   niagrad is told about with UPGRADE_ARG; the listeners, files and
+   children stay where they are. On failure this niagrad carries on. */
+static void
+upgrade_niagrad(struct timer *t)
+{
+    char fd_arg[INT_STRING_LEN + 1];
+    const char *error;
+    char **argv;
+    FILE *f;
+    int fd, n;
+
+    error = upgrade_refused();
+    if (error != NULL) {
+        log_msg(LOG_ERR, "upgrade refused: %s", error);
+        return;
+    }
+
+    log_msg(LOG_INFO, "control: upgrading niagrad from %s", niagrad_path);
+
+    fd = memfd_create(UPGRADE_STATE_NAME, 0);
+    if (fd == -1 || (f = fdopen(dup(fd), "w")) == NULL) {
+        log_msg(LOG_ERR, "error creating upgrade state: %m");
+        if (fd != -1) {
+            (void) close(fd);
+        }
+        return;
+    }
+
+    save_state(f);
+
+    if (fclose(f) != 0 || lseek(fd, 0, SEEK_SET) == -1) {
+        log_msg(LOG_ERR, "error writing upgrade state: %m");
+        (void) close(fd);
+        return;
+    }
+
+    for (n = 0; niagrad_args[n] != NULL; n++) {
+    }
+
+    argv = calloc(n + 4, sizeof *argv);
+    if (argv == NULL) {
+        log_msg(LOG_ERR, "out of memory upgrading niagrad");
+        (void) close(fd);
+        return;
+    }
+
+    (void) snprintf(fd_arg, sizeof fd_arg, "%d", fd);
+    argv[0] = niagrad_path;
+    argv[1] = UPGRADE_ARG;
+    argv[2] = fd_arg;
+    memcpy(argv + 3, niagrad_args, (n + 1) * sizeof *argv);
+
+    inherit_fds(true);
+    log_flush();
+
+    (void) execv(niagrad_path, argv);
+
+    log_msg(LOG_ERR, "error executing %s: %m", niagrad_path);
+
+    inherit_fds(false);
+    (void) close(fd);
+    free(argv);
+}
+
+/* Let the fds niagrad keeps from its servers survive exec, or close them on
+   exec again. Listeners and files are inherited anyway, but not spare
+   shards. */
+static void
+inherit_fds(bool inherit)
+{
+    int flags = (inherit ? 0 : FD_CLOEXEC);
+    struct child *child;
+    struct app *a;
+    int i, j;
+
+    if (control_fd() != -1) {
+        (void) fcntl(control_fd(), F_SETFD, flags);
+    }
+    if (metrics_fd != -1) {
+        (void) fcntl(metrics_fd, F_SETFD, flags);
+    }
+    if (registry_fd != -1) {
+        (void) fcntl(registry_fd, F_SETFD, flags);
+    }
+
+    for (a = apps; a != NULL; a = a->next) {
+        for (i = 0; i < a->num_fds; i++) {
+            struct fd *fd = &a->fds[i];
+            if (fd->fd_type != SOCKET_FD || !fd->x.sock.reuseport || fd->fd == -1) {
+                continue;
+            }
+            for (j = a->copies; j < fd->x.sock.num_shards; j++) {
+                (void) fcntl(fd->x.sock.shards[j], F_SETFD, flags);
+            }
+        }
+    }
+
+    for (i = 0; i < CHILD_TABLE_SIZE; i++) {
+        for (child = child_table[i]; child != NULL; child = child->hash_next) {
+            if (child->notify_ev.fd != -1) {
+                (void) fcntl(child->notify_ev.fd, F_SETFD, flags);
+            }
+        }
+    }
+}
+
+/* The state is a line per item: a keyword, then its values. A string which
+   may contain spaces comes last. Times in milliseconds are on the monotonic
+   clock, which carries on across exec. */
+static void
+save_state(FILE *f)
+{
+    struct app *current = app;
+
+    fprintf(f, "niagrad %d\n", UPGRADE_STATE_VERSION);
+    fprintf(f, "start_time %lld %s\n", (long long) start_time, stat_start_time);
+    fprintf(f, "counters %d %d %d %d\n", stat_state_request_count, stat_reload_count, stat_reload_failed_count,
+            stat_upgrade_count);
+    fprintf(f, "reload_time %s\n", stat_reload_last_time);
+    fprintf(f, "listen %llu %llu %d\n", listen_overflows_start, listen_drops_start, listen_baseline_taken);
+    fprintf(f, "control %d\n", control_fd());
+    fprintf(f, "metrics %d\n", metrics_fd);
+    fprintf(f, "registry %d\n", registry_fd);
+
+    for (app = apps; app != NULL; app = app->next) {
+        save_app(f);
+    }
+
+    app = current;
+}
+
+/* An app's copies come before its listeners, whose shards depend on them. */
+static void
+save_app(FILE *f)
+{
+    struct child *child;
+    int i, j;
+
+    fprintf(f, "app %s\n", app->name);
+    fprintf(f, "copies %d\n", app->copies);
+
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        if (fd->fd_type != SOCKET_FD || fd->fd == -1) {
+            continue;
+        }
+        fprintf(f, "socket %s", fd->name);
+        if (fd->x.sock.reuseport) {
+            for (j = 0; j < app->copies; j++) {
+                fprintf(f, " %d", fd->x.sock.shards[j]);
+            }
+        } else {
+            fprintf(f, " %d", fd->fd);
+        }
+        fprintf(f, "\n");
+        if (fd->x.sock.reuseport && fd->x.sock.num_shards > app->copies) {
+            fprintf(f, "spares %s", fd->name);
+            for (j = app->copies; j < fd->x.sock.num_shards; j++) {
+                fprintf(f, " %d", fd->x.sock.shards[j]);
+            }
+            fprintf(f, "\n");
+        }
+        if (fd->x.sock.activated) {
+            fprintf(f, "activated %s\n", fd->name);
+        }
+    }
+
+    for (i = 0; i < app->num_files; i++) {
+        fprintf(f, "file %s %d %s\n", app->files[i].key, app->files[i].fd, app->files[i].name);
+    }
+
+    fprintf(f, "generation %d\n", app->generation);
+    fprintf(f, "stats %d %d %d %d %d %d %d %d\n", app->stat_restart_request_count,
+            app->stat_migrate_request_count, app->stat_restart_node_expected_count,
+            app->stat_restart_node_unexpected_count, app->stat_migrate_node_count, app->stat_autoscale_up_count,
+            app->stat_autoscale_down_count, app->stat_crash_loop_count);
+    for (i = 0; i < NUM_APP_TIMES; i++) {
+        fprintf(f, "time %s %s\n", app_time_names[i], app_time(app_time_names[i]));
+    }
+    fprintf(f, "autoscale_last %llu\n", (unsigned long long) app->autoscale_last);
+
+    save_histogram(f, "ready", &app->ready_histogram);
+    save_histogram(f, "drain", &app->drain_histogram);
+    save_histogram(f, "respawn", &app->respawn_histogram);
+
+    for (i = 0; i < app->copies; i++) {
+        fprintf(f, "health %d %d %llu %d\n", i, app->slot_health[i].failures,
+                (unsigned long long) app->slot_health[i].respawn_at, app->slot_health[i].stopped);
+    }
+    fprintf(f, "health -1 %d %llu %d\n", app->standby_health.failures,
+            (unsigned long long) app->standby_health.respawn_at, app->standby_health.stopped);
+
+    for (i = 0; i < CHILD_TABLE_SIZE; i++) {
+        for (child = child_table[i]; child != NULL; child = child->hash_next) {
+            if (child->app != app) {
+                continue;
+            }
+            fprintf(f, "child %d %d %s %d %s %llu %llu %llu %d %d\n", child->pid, child->slot,
+                    role_names[child->role], child->generation, readiness_keys[child->readiness],
+                    (unsigned long long) child->spawn_time, (unsigned long long) child->ready_time,
+                    (unsigned long long) child->drain_start, child->drain_signals, child->notify_ev.fd);
+        }
+    }
+}
+
+static void
+save_histogram(FILE *f, const char *name, const struct histogram *h)
+{
+    int i;
+
+    fprintf(f, "histogram %s %llu %.17g %d", name, h->count, h->sum, h->num_bounds + 1);
+    for (i = 0; i <= h->num_bounds; i++) {
+        fprintf(f, " %llu", h->counts[i]);
+    }
+    fprintf(f, "\n");
+}
+
+/* Open the state left by the niagrad this one upgraded. It is read in two
+   passes, and closed after the second. */
+static void
+read_state(int fd)
+{
+    char line[MAX_LINE_SIZE];
+    int version;
+
+    upgrade_state = fdopen(fd, "r");
+    if (upgrade_state == NULL || str_readline(upgrade_state, line, sizeof line) <= 0 ||
+        sscanf(line, "niagrad %d", &version) != 1) {
+        log_msg(LOG_ERR, "error reading upgrade state");
+        exit(EXIT_FAILURE);
+    }
+
+    if (version != UPGRADE_STATE_VERSION) {
+        log_msg(LOG_ERR, "upgrade state version %d, expected %d", version, UPGRADE_STATE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Read the next line of the state into 'line', split into its keyword and
+   the rest. Return false at the end. */
+static bool
+next_state_line(char *line, int size, char **keyword, char **args)
+{
+    char *parts[2];
+
+    if (str_readline(upgrade_state, line, size) <= 0) {
+        return false;
+    }
+
+    if (str_split(line, ' ', parts, 2) < 2) {
+        parts[1] = "";
+    }
+    *keyword = parts[0];
+    *args = parts[1];
+
+    return true;
+}
+
+/* The first pass, right after the config file is parsed: the global
+   counters, the copies of each app, and the fds inherited from the
+   previous niagrad. Listeners and files which are still configured are
+   taken over instead of opened; the others are closed. */
+static void
+restore_listeners(void)
+{
+    char line[MAX_LINE_SIZE];
+    char *keyword, *args;
+    long long t;
+    int i, n, taken, copies;
+
+    rewind(upgrade_state);
+    app = NULL;
+
+    while (next_state_line(line, sizeof line, &keyword, &args)) {
+        if (strcmp(keyword, "start_time") == 0 && sscanf(args, "%lld %n", &t, &n) == 1) {
+            start_time = (time_t) t;
+            (void) str_copy(stat_start_time, args + n, sizeof stat_start_time);
+        } else if (strcmp(keyword, "counters") == 0) {
+            (void) sscanf(args, "%d %d %d %d", &stat_state_request_count, &stat_reload_count,
+                          &stat_reload_failed_count, &stat_upgrade_count);
+        } else if (strcmp(keyword, "reload_time") == 0) {
+            (void) str_copy(stat_reload_last_time, args, sizeof stat_reload_last_time);
+        } else if (strcmp(keyword, "listen") == 0 &&
+                   sscanf(args, "%llu %llu %d", &listen_overflows_start, &listen_drops_start, &taken) == 3) {
+            listen_baseline_taken = taken;
+        } else if (strcmp(keyword, "control") == 0) {
+            (void) sscanf(args, "%d", &inherited_control_fd);
+        } else if (strcmp(keyword, "metrics") == 0) {
+            (void) sscanf(args, "%d", &inherited_metrics_fd);
+        } else if (strcmp(keyword, "registry") == 0) {
+            (void) sscanf(args, "%d", &registry_fd);
+        } else if (strcmp(keyword, "app") == 0) {
+            /* NULL for an app no longer in the config file. */
+            app = find_app(args);
+            if (app != NULL) {
+                app->adopted = true;
+            }
+        } else if (strcmp(keyword, "copies") == 0 && app != NULL) {
+            /* The servers keep running, so the number of copies carries on. */
+            if (sscanf(args, "%d", &copies) == 1 && copies > 0 && copies != app->copies) {
+                log_msg(LOG_INFO, "app %s keeps running %d copies", app->name, copies);
+                app->copies = copies;
+            }
+        } else if (strcmp(keyword, "socket") == 0) {
+            restore_socket(args);
+        } else if (strcmp(keyword, "spares") == 0) {
+            restore_spares(args);
+        } else if (strcmp(keyword, "activated") == 0 && app != NULL) {
+            i = lookup_fd_by_name(args);
+            if (i != -1 && app->fds[i].fd != -1) {
+                app->fds[i].x.sock.activated = true;
+            }
+        } else if (strcmp(keyword, "file") == 0) {
+            restore_file(args);
+        }
+    }
+
+    stat_upgrade_count += 1;
+    store_time(stat_upgrade_last_time);
+}
+
+/* Take over the listener(s) of a socket, if the current app still has it
+   with the same address. Otherwise they are closed, and a unix socket's
+   file is removed so that its path can be bound again. */
+static void
+restore_socket(char *args)
+{
+    struct sockaddr_un sockaddr;
+    socklen_t len = sizeof sockaddr;
+    char *parts[2];
+    int *fds;
+    int i, n;
+
+    if (str_split(args, ' ', parts, 2) < 2) {
+        return;
+    }
+
+    fds = parse_state_fds(parts[0], parts[1], &n);
+
+    i = (app == NULL ? -1 : lookup_fd_by_name(parts[0]));
+    if (i != -1 && app->fds[i].fd_type == SOCKET_FD && app->fds[i].fd == -1 &&
+        adopt_listener(&app->fds[i], fds, n) == 0) {
+        log_msg(LOG_INFO, "app %s: took over socket %s", app->name, parts[0]);
+        free(fds);
+        return;
+    }
+
+    log_msg(LOG_INFO, "socket %s not taken over, closing it", parts[0]);
+    for (i = 0; i < n; i++) {
+        memset(&sockaddr, 0, sizeof sockaddr);
+        if (i == 0 && getsockname(fds[i], (struct sockaddr *) &sockaddr, &len) == 0 &&
+            sockaddr.sun_family == AF_UNIX && !str_isempty(sockaddr.sun_path)) {
+            (void) unlink(sockaddr.sun_path);
+        }
+        (void) close(fds[i]);
+    }
+    free(fds);
+}
+
+/* Take back the spare shards of a socket which has just been taken over.
+   Otherwise they are closed. */
+static void
+restore_spares(char *args)
+{
+    char *parts[2];
+    struct fd *fd;
+    int *fds;
+    int i, n;
+
+    if (str_split(args, ' ', parts, 2) < 2) {
+        return;
+    }
+
+    fds = parse_state_fds(parts[0], parts[1], &n);
+
+    i = (app == NULL ? -1 : lookup_fd_by_name(parts[0]));
+    fd = (i == -1 ? NULL : &app->fds[i]);
+    if (fd != NULL && fd->fd_type == SOCKET_FD && fd->x.sock.reuseport && fd->x.sock.shards != NULL &&
+        fd->x.sock.num_shards == app->copies) {
+        fd->x.sock.shards = realloc(fd->x.sock.shards, (app->copies + n) * sizeof *fd->x.sock.shards);
+        if (fd->x.sock.shards == NULL) {
+            log_msg(LOG_ERR, "out of memory restoring socket %s", parts[0]);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++) {
+            (void) fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+            fd->x.sock.shards[fd->x.sock.num_shards++] = fds[i];
+        }
+        free(fds);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        (void) close(fds[i]);
+    }
+    free(fds);
+}
+
+/* The fd numbers in 'str', separated by spaces. Their count is returned
+   in 'n'. */
+static int *
+parse_state_fds(const char *name, char *str, int *n)
+{
+    char *s, *end;
+    int *fds;
+
+    fds = calloc(strlen(str) + 1, sizeof *fds);
+    if (fds == NULL) {
+        log_msg(LOG_ERR, "out of memory restoring socket %s", name);
+        exit(EXIT_FAILURE);
+    }
+    for (*n = 0, s = str; (fds[*n] = strtol(s, &end, 10)) >= 0 && end != s; s = end) {
+        (*n)++;
+    }
+
+    return fds;
+}
+
+/* Take over a file, if the current app still opens the same one under the
+   same key. Otherwise it is closed. */
+static void
+restore_file(char *args)
+{
+    char *parts[3];
+    int i, fd;
+
+    if (str_split(args, ' ', parts, 3) < 3 || str_int(parts[1], &fd) == -1 || fd < 0) {
+        return;
+    }
+
+    i = (app == NULL ? -1 : lookup_file_by_key(parts[0]));
+    if (i != -1 && app->files[i].fd == -1 && strcmp(app->files[i].name, parts[2]) == 0) {
+        app->files[i].fd = fd;
+        return;
+    }
+
+    (void) close(fd);
+}
+
+/* The second pass, once the event loop is up and the servers allocated:
+   the counters, health and children of each app. The children of an app
+   no longer in the config file are terminated. */
+static void
+restore_children(void)
+{
+    char line[MAX_LINE_SIZE];
+    char *keyword, *args, *name;
+    struct slot_health health;
+    unsigned long long at;
+    int slot, stopped;
+    char *value;
+
+    rewind(upgrade_state);
+    app = NULL;
+
+    while (next_state_line(line, sizeof line, &keyword, &args)) {
+        if (strcmp(keyword, "app") == 0) {
+            forget_removed_app();
+            app = find_app(args);
+            if (app == NULL) {
+                /* Only there until its children have been reaped. */
+                app = calloc(1, sizeof *app);
+                if (app == NULL) {
+                    log_msg(LOG_ERR, "out of memory restoring app %s", args);
+                    exit(EXIT_FAILURE);
+                }
+                (void) str_copy(app->name, args, sizeof app->name);
+                app->removed = true;
+                log_msg(LOG_INFO, "removing app %s", app->name);
+            }
+        } else if (app == NULL || app->removed) {
+            if (app != NULL && strcmp(keyword, "child") == 0) {
+                restore_child(args);
+            }
+        } else if (strcmp(keyword, "generation") == 0) {
+            (void) sscanf(args, "%d", &app->generation);
+        } else if (strcmp(keyword, "stats") == 0) {
+            (void) sscanf(args, "%d %d %d %d %d %d %d %d", &app->stat_restart_request_count,
+                          &app->stat_migrate_request_count, &app->stat_restart_node_expected_count,
+                          &app->stat_restart_node_unexpected_count, &app->stat_migrate_node_count,
+                          &app->stat_autoscale_up_count, &app->stat_autoscale_down_count,
+                          &app->stat_crash_loop_count);
+        } else if (strcmp(keyword, "time") == 0) {
+            name = args;
+            value = strchr(args, ' ');
+            if (value != NULL) {
+                *value++ = '\0';
+                if (app_time(name) != NULL) {
+                    (void) str_copy(app_time(name), value, MAX_TIME_STRING);
+                }
+            }
+        } else if (strcmp(keyword, "autoscale_last") == 0 && sscanf(args, "%llu", &at) == 1) {
+            app->autoscale_last = at;
+        } else if (strcmp(keyword, "histogram") == 0) {
+            restore_histogram(args);
+        } else if (strcmp(keyword, "health") == 0 &&
+                   sscanf(args, "%d %d %llu %d", &slot, &health.failures, &at, &stopped) == 4) {
+            health.respawn_at = at;
+            health.stopped = stopped;
+            if (slot == -1) {
+                app->standby_health = health;
+            } else if (slot >= 0 && slot < app->copies) {
+                app->slot_health[slot] = health;
+            }
+        } else if (strcmp(keyword, "child") == 0) {
+            restore_child(args);
+        }
+    }
+
+    forget_removed_app();
+
+    (void) fclose(upgrade_state);
+    upgrade_state = NULL;
+}
+
+/* An app no longer in the config file is freed right away if it had no
+   children left. */
+static void
+forget_removed_app(void)
+{
+    if (app != NULL && app->removed && app->num_children == 0) {
+        free_app(app);
+    }
+    app = NULL;
+}
+
+static void
+restore_histogram(char *args)
+{
+    char name[MAX_FD_NAME];
+    unsigned long long count, counts[HISTOGRAM_MAX_BUCKETS + 1];
+    struct histogram *h;
+    double sum;
+    int i, n, len;
+
+    if (sscanf(args, "%63s %llu %lg %d%n", name, &count, &sum, &n, &len) != 4) {
+        return;
+    }
+
+    if (strcmp(name, "ready") == 0) {
+        h = &app->ready_histogram;
+    } else if (strcmp(name, "drain") == 0) {
+        h = &app->drain_histogram;
+    } else if (strcmp(name, "respawn") == 0) {
+        h = &app->respawn_histogram;
+    } else {
+        return;
+    }
+
+    /* Buckets which changed with the upgrade start over. */
+    if (n != h->num_bounds + 1) {
+        return;
+    }
+
+    for (i = 0, args += len; i < n; i++, args += len) {
+        if (sscanf(args, "%llu%n", &counts[i], &len) != 1) {
+            return;
+        }
+    }
+
+    memcpy(h->counts, counts, n * sizeof counts[0]);
+    h->count = count;
+    h->sum = sum;
+}
+
+/* Track a child of the previous niagrad again, as what it was there. One
+   whose place no longer exists is terminated. */
+static void
+restore_child(char *args)
+{
+    char role_name[MAX_FD_NAME], readiness_key[MAX_FD_NAME];
+    unsigned long long spawn_time, ready_time, drain_start;
+    int pid, slot, generation, signals, notify;
+    enum child_role role;
+    struct child *child;
+    uint64_t deadline;
+    bool placed;
+
+    if (sscanf(args, "%d %d %63s %d %63s %llu %llu %llu %d %d", &pid, &slot, role_name, &generation,
+               readiness_key, &spawn_time, &ready_time, &drain_start, &signals, &notify) != 10) {
+        return;
+    }
+
+    for (role = CHILD_LIVE; role <= CHILD_STANDBY && strcmp(role_names[role], role_name) != 0; role++) {
+    }
+
+    child = add_child(pid, slot);
+    child->role = CHILD_DETACHED;
+    child->generation = generation;
+    child->readiness = READY_PENDING;
+    while (child->readiness < READY_TIMEOUT && strcmp(readiness_keys[child->readiness], readiness_key) != 0) {
+        child->readiness++;
+    }
+    child->spawn_time = spawn_time;
+    child->ready_time = ready_time;
+    child->ready_timer.handler = ready_timer_expired;
+    child->ready_timer.data = child;
+    watch_child(child);
+
+    if (notify != -1) {
+        child->notify_ev.fd = notify;
+        child->notify_ev.handler = notify_event;
+        child->notify_ev.data = child;
+        if (fcntl(notify, F_SETFD, FD_CLOEXEC) == -1 || event_add(&child->notify_ev, EPOLLIN) == -1) {
+            log_msg(LOG_ERR, "error watching notify socket of pid %d: %m", child->pid);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (app->removed) {
+        placed = (role == CHILD_DETACHED);
+    } else if (role == CHILD_LIVE || role == CHILD_OUTGOING) {
+        struct child **slots = (role == CHILD_LIVE ? app->servers : app->outgoing_servers);
+        placed = (slot >= 0 && slot < app->copies && slots[slot] == NULL);
+        if (placed) {
+            slots[slot] = child;
+        }
+    } else if (role == CHILD_STANDBY) {
+        placed = (slot >= 0 && slot < app->num_standbys && app->standbys[slot] == NULL);
+        if (placed) {
+            app->standbys[slot] = child;
+        }
+    } else {
+        placed = (role == CHILD_DRAINING || role == CHILD_DETACHED);
+    }
+
+    if (!placed) {
+        log_msg(LOG_INFO, "pid %d of app %s no longer has a place, terminating it", pid, app->name);
+        close_notify(child);
+        if (kill(pid, SIGTERM) != 0) {
+            log_msg(LOG_ERR, "couldn't kill pid %d: %m", pid);
+        }
+        return;
+    }
+
+    child->role = role;
+
+    if (role == CHILD_DRAINING) {
+        start_draining(child);
+        child->drain_start = drain_start;
+        child->drain_signals = signals;
+        timer_stop(&child->drain_timer);
+        if (signals < 2 && app->drain_timeout > 0) {
+            deadline = drain_start + app->drain_timeout + (signals == 1 ? app->drain_kill_timeout : 0);
+            timer_start(&child->drain_timer, deadline > event_now() ? deadline - event_now() : 0);
+        }
+    }
+
+    if (child->readiness == READY_PENDING && app->ready_timeout > 0 && role != CHILD_DRAINING &&
+        role != CHILD_DETACHED) {
+        deadline = spawn_time + app->ready_timeout;
+        timer_start(&child->ready_timer, deadline > event_now() ? deadline - event_now() : 0);
+    }
+}
+
+/* The times kept for an app, by their name in the upgrade state. */
+static char *
+app_time(const char *name)
+{
+    if (strcmp(name, "restart_request") == 0) {
+        return app->stat_restart_last_request_time;
+    } else if (strcmp(name, "migrate_request") == 0) {
+        return app->stat_migrate_last_request_time;
+    } else if (strcmp(name, "migrate_node") == 0) {
+        return app->stat_migrate_last_node_time;
+    } else if (strcmp(name, "restart_node_expected") == 0) {
+        return app->stat_restart_last_node_expected_time;
+    } else if (strcmp(name, "restart_node_unexpected") == 0) {
+        return app->stat_restart_last_node_unexpected_time;
+    }
+    return NULL;
+}
+
+/* Parse where the log goes: 'syslog', 'stderr' or 'file path'. Return 0
+   on success and -1 on error. */
+static int
+parse_log(char *str)
+{
+    if (strcmp(str, "syslog") == 0) {
+        log_sink = LOG_SINK_SYSLOG;
+    } else if (strcmp(str, "stderr") == 0) {
+        log_sink = LOG_SINK_STDERR;
+    } else if (strncmp(str, "file ", 5) == 0) {
+        log_sink = LOG_SINK_FILE;
+        return str_copy(log_path, str_strip(str + 5, ' '), sizeof log_path);
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse the metrics endpoint: '[addr:]port', on 127.0.0.1 by default, or
+   'unix path'. Return 0 on success and -1 on error. */
+static int
+parse_metrics(char *str)
+{
+    char *colon;
+
+    metrics_socket.backlog = METRICS_BACKLOG;
+    metrics_socket.uid = (uid_t) -1;
+    metrics_socket.gid = (gid_t) -1;
+
+    if (strncmp(str, "unix ", 5) == 0) {
+        metrics_socket.family = AF_UNIX;
+        return str_copy(metrics_socket.path, str_strip(str + 5, ' '), sizeof metrics_socket.path);
+    }
+
+    metrics_socket.family = AF_INET;
+    metrics_socket.ip_ver = 4;
+    (void) inet_aton(METRICS_ADDR, &metrics_socket.addr);
+
+    colon = strrchr(str, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        if (inet_aton(str, &metrics_socket.addr) == 0) {
+            return -1;
+        }
+        str = colon + 1;
+    }
+
+    if (str_uint16(str, &metrics_socket.port) == -1 || metrics_socket.port == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+open_metrics_socket(void)
+{
+    int s;
+
+    if (inherited_metrics_fd != -1 && (!metrics_enabled || !listener_matches(inherited_metrics_fd, &metrics_socket))) {
+        (void) close(inherited_metrics_fd);
+        inherited_metrics_fd = -1;
+    }
+
+    if (!metrics_enabled) {
+        return;
+    }
+
+    s = inherited_metrics_fd;
+    if (s == -1 && (s = create_socket(&metrics_socket)) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    metrics_fd = s;
+
+    /* Servers must not inherit it. */
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1 || control_serve(s, HTTP_REQUEST_END, handle_metrics) == -1) {
+        log_msg(LOG_ERR, "error serving metrics: %m");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Answer an HTTP request for the metrics. The request is only read up to
+   its headers; anything else gets a 404. */
+static void
+handle_metrics(char *request, FILE *reply)
+{
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f;
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        fputs("HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", reply);
+        return;
+    }
+
+    f = open_memstream(&body, &body_len);
+    if (f == NULL) {
+        fputs("HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", reply);
+        return;
+    }
+    output_metrics(f);
+    (void) fclose(f);
+
+    fprintf(reply, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    if (body != NULL) {
+        (void) fwrite(body, 1, body_len, reply);
+    }
+    free(body);
+}
+
+/* The labels of a sample of the current app: its name, and 'extra' if
+   not NULL. */
+static const char *
+app_labels(char *labels, const char *extra)
+{
+    (void) snprintf(labels, MAX_LABELS, "app=\"%s\"%s%s", app->name, extra != NULL ? "," : "",
+                    extra != NULL ? extra : "");
+    return labels;
+}
+
+/* Every family but the niagrad-wide ones has a sample per app, labelled
+   with the name of the app. */
+static void
+output_metrics(FILE *f)
+{
+    struct app *current = app;
+    struct child *child;
+    char labels[MAX_LABELS], slot[32];
+    int i, live, ready, outgoing, standby, draining;
+
+    metrics_family(f, "niagra_start_time_seconds", "gauge", "Start time of niagrad since the epoch.");
+    metrics_value(f, "niagra_start_time_seconds", NULL, start_time);
+    metrics_family(f, "niagra_copies", "gauge", "Configured number of server slots.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_copies", app_labels(labels, NULL), app->copies);
+    }
+    metrics_family(f, "niagra_generation", "gauge", "Current migration generation.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_generation", app_labels(labels, NULL), app->generation);
+    }
+
+    metrics_family(f, "niagra_servers", "gauge", "Server processes by state.");
+    for (app = apps; app != NULL; app = app->next) {
+        live = ready = outgoing = standby = 0;
+        for (i = 0; i < app->copies; i++) {
+            if (app->servers[i] != NULL) {
+                live++;
+                if (app->servers[i]->readiness == READY_OK) {
+                    ready++;
+                }
+            }
+            if (app->outgoing_servers[i] != NULL) {
+                outgoing++;
+            }
+        }
+        for (i = 0; i < app->num_standbys; i++) {
+            if (app->standbys[i] != NULL) {
+                standby++;
+            }
+        }
+        metrics_value(f, "niagra_servers", app_labels(labels, "state=\"live\""), live);
+        metrics_value(f, "niagra_servers", app_labels(labels, "state=\"ready\""), ready);
+        metrics_value(f, "niagra_servers", app_labels(labels, "state=\"outgoing\""), outgoing);
+        metrics_value(f, "niagra_servers", app_labels(labels, "state=\"draining\""),
+                      app->stat_draining_node_count);
+        metrics_value(f, "niagra_servers", app_labels(labels, "state=\"standby\""), standby);
+    }
+
+    metrics_family(f, "niagra_slot_live", "gauge", "1 if the slot has a live server.");
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, "niagra_slot_live", app_labels(labels, slot), app->servers[i] != NULL);
+        }
+    }
+    metrics_family(f, "niagra_slot_ready", "gauge", "1 if the slot's live server has reported ready.");
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, "niagra_slot_ready", app_labels(labels, slot),
+                          app->servers[i] != NULL && app->servers[i]->readiness == READY_OK);
+        }
+    }
+    metrics_family(f, "niagra_slot_draining", "gauge", "Old servers of the slot still draining.");
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            draining = 0;
+            for (child = app->draining_servers; child != NULL; child = child->drain_next) {
+                if (child->slot == i) {
+                    draining++;
+                }
+            }
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, "niagra_slot_draining", app_labels(labels, slot), draining);
+        }
+    }
+
+    metrics_family(f, "niagra_slot_failures", "gauge", "Failures in a row of the slot's servers.");
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, "niagra_slot_failures", app_labels(labels, slot), slot_failures(i));
+        }
+    }
+    metrics_family(f, "niagra_slot_crash_looping", "gauge", "1 if the slot is crash looping.");
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, "niagra_slot_crash_looping", app_labels(labels, slot),
+                          slot_failures(i) >= app->crash_loop_failures);
+        }
+    }
+
+    output_usage_metric(f, "niagra_slot_cpu_percent", "CPU use of the slot's live server.", USAGE_CPU);
+    output_usage_metric(f, "niagra_slot_rss_bytes", "Resident memory of the slot's live server.", USAGE_RSS);
+    output_usage_metric(f, "niagra_slot_pss_bytes", "Proportional memory of the slot's live server.", USAGE_PSS);
+    output_usage_metric(f, "niagra_slot_fds", "Open file descriptors of the slot's live server.", USAGE_FDS);
+    output_usage_metric(f, "niagra_slot_threads", "Threads of the slot's live server.", USAGE_THREADS);
+
+    output_queue_metric(f, "niagra_listen_queue_length", "Connections waiting to be accepted.", QUEUE_LENGTH);
+    output_queue_metric(f, "niagra_listen_queue_limit", "Accept queue limit (backlog).", QUEUE_LIMIT);
+    output_queue_metric(f, "niagra_listen_queue_high_water", "Longest accept queue seen.", QUEUE_HIGH_WATER);
+    metrics_family(f, "niagra_host_listen_overflows_total", "counter", "Host ListenOverflows.");
+    metrics_value(f, "niagra_host_listen_overflows_total", NULL, listen_overflows);
+    metrics_family(f, "niagra_host_listen_drops_total", "counter", "Host ListenDrops.");
+    metrics_value(f, "niagra_host_listen_drops_total", NULL, listen_drops_count);
+
+    metrics_family(f, "niagra_autoscale_total", "counter", "Times the number of copies was changed by autoscaling.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_autoscale_total", app_labels(labels, "direction=\"up\""),
+                      app->stat_autoscale_up_count);
+        metrics_value(f, "niagra_autoscale_total", app_labels(labels, "direction=\"down\""),
+                      app->stat_autoscale_down_count);
+    }
+
+    metrics_family(f, "niagra_crash_loops_total", "counter", "Times a slot or the standbys started crash looping.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_crash_loops_total", app_labels(labels, NULL), app->stat_crash_loop_count);
+    }
+
+    metrics_family(f, "niagra_migrate_requests_total", "counter", "Migrations requested.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_migrate_requests_total", app_labels(labels, NULL), app->stat_migrate_request_count);
+    }
+    metrics_family(f, "niagra_migrated_servers_total", "counter", "Servers migrated.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_migrated_servers_total", app_labels(labels, NULL), app->stat_migrate_node_count);
+    }
+    metrics_family(f, "niagra_restart_requests_total", "counter", "Restarts requested.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_restart_requests_total", app_labels(labels, NULL), app->stat_restart_request_count);
+    }
+    metrics_family(f, "niagra_restarted_servers_total", "counter", "Servers restarted.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_value(f, "niagra_restarted_servers_total", app_labels(labels, "reason=\"requested\""),
+                      app->stat_restart_node_expected_count);
+        metrics_value(f, "niagra_restarted_servers_total", app_labels(labels, "reason=\"exited\""),
+                      app->stat_restart_node_unexpected_count);
+    }
+    metrics_family(f, "niagra_reloads_total", "counter", "Config reloads.");
+    metrics_value(f, "niagra_reloads_total", "result=\"ok\"", stat_reload_count - stat_reload_failed_count);
+    metrics_value(f, "niagra_reloads_total", "result=\"failed\"", stat_reload_failed_count);
+    metrics_family(f, "niagra_log_dropped_total", "counter", "Log records dropped because the log ring was full.");
+    metrics_value(f, "niagra_log_dropped_total", NULL, log_dropped());
+    metrics_family(f, "niagra_upgrades_total", "counter", "Times niagrad was upgraded in place.");
+    metrics_value(f, "niagra_upgrades_total", NULL, stat_upgrade_count);
+    metrics_family(f, "niagra_state_requests_total", "counter", "State requests served.");
+    metrics_value(f, "niagra_state_requests_total", NULL, stat_state_request_count);
+
+    metrics_family(f, "niagra_ready_seconds", "histogram", "Time from spawning a server to it reporting ready.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_histogram(f, "niagra_ready_seconds", app_labels(labels, NULL), &app->ready_histogram);
+    }
+    metrics_family(f, "niagra_drain_seconds", "histogram", "Time from migrating an old server to its exit.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_histogram(f, "niagra_drain_seconds", app_labels(labels, NULL), &app->drain_histogram);
+    }
+    metrics_family(f, "niagra_respawn_interval_seconds", "histogram",
+                   "How long a server ran before exiting unexpectedly.");
+    for (app = apps; app != NULL; app = app->next) {
+        metrics_histogram(f, "niagra_respawn_interval_seconds", app_labels(labels, NULL), &app->respawn_histogram);
+    }
+
+    app = current;
+}
+
+/* One gauge per slot of each app from the latest usage sample of its live
+   server. */
+static void
+output_usage_metric(FILE *f, const char *name, const char *help, enum usage_field field)
+{
+    const struct usage_sample *sample;
+    char labels[MAX_LABELS], slot[32];
+    double value;
+    int i;
+
+    metrics_family(f, name, "gauge", help);
+
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->copies; i++) {
+            sample = latest_sample(app->servers[i]);
+            if (sample == NULL) {
+                continue;
+            }
+            switch (field) {
+            case USAGE_CPU:
+                value = sample->cpu_percent;
+                break;
+            case USAGE_RSS:
+                value = sample->usage.rss_kb * 1024.0;
+                break;
+            case USAGE_PSS:
+                if (sample->usage.pss_kb < 0) {
+                    continue;
+                }
+                value = sample->usage.pss_kb * 1024.0;
+                break;
+            case USAGE_FDS:
+                value = sample->usage.fds;
+                break;
+            case USAGE_THREADS:
+            default:
+                value = sample->usage.threads;
+                break;
+            }
+            (void) snprintf(slot, sizeof slot, "slot=\"%d\"", i);
+            metrics_value(f, name, app_labels(labels, slot), value);
+        }
+    }
+}
+
+/* One gauge per listener, with a shard label for reuseport sockets. */
+static void
+output_queue_metric(FILE *f, const char *name, const char *help, enum queue_field field)
+{
+    char labels[MAX_LABELS], listener[MAX_FD_NAME + 32];
+    int i, k, r, value;
+
+    metrics_family(f, name, "gauge", help);
+
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->num_fds; i++) {
+            const struct fd_socket *sock = &app->fds[i].x.sock;
+            if (app->fds[i].fd_type != SOCKET_FD) {
+                continue;
+            }
+            for (k = 0; k < num_queues(sock); k++) {
+                const struct queue_stats *stats = &sock->queues[k];
+                value = (field == QUEUE_LENGTH ? stats->length : field == QUEUE_LIMIT ? stats->limit : stats->high_water);
+                if (sock->reuseport) {
+                    r = snprintf(listener, sizeof listener, "socket=\"%s\",shard=\"%d\"", app->fds[i].name, k);
+                } else {
+                    r = snprintf(listener, sizeof listener, "socket=\"%s\"", app->fds[i].name);
+                }
+                if (r < (int)(sizeof listener)) {
+                    metrics_value(f, name, app_labels(labels, listener), value);
+                }
+            }
+        }
+    }
+}
+
+/* niagrad -c: send a request to the niagrad with pid 'pid' and print the
+   reply. Exit with failure if it could not be sent or was refused. */
+static int
+run_client(const char *pid, int argc, char **argv)
+{
+    char request[MAX_LINE_SIZE] = "";
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *f;
+    int i, n, r;
+    bool ok;
+
+    if (argc == 0 || str_int(pid, &n) == -1 || n <= 0) {
+        usage();
+    }
+
+    for (i = 0; i < argc; i++) {
+        if ((i > 0 && str_concat(request, " ", sizeof request) == -1) ||
+            str_concat(request, argv[i], sizeof request) == -1) {
+            fprintf(stderr, "niagrad: request too long\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (find_runtime_dir() == -1 || format_control_path(n) == -1) {
+        fprintf(stderr, "niagrad: control socket path too long\n");
+        return EXIT_FAILURE;
+    }
+
+    if (check_runtime_dir() == -1) {
+        fprintf(stderr, "niagrad: untrusted runtime directory %s: %s\n", runtime_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    f = open_memstream(&reply, &reply_len);
+    if (f == NULL) {
+        fprintf(stderr, "niagrad: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    r = control_request(control_path, request, f);
+    if (r == -1) {
+        fprintf(stderr, "niagrad: %s: %s\n", control_path, strerror(errno));
+    }
+    (void) fclose(f);
+
+    if (reply != NULL) {
+        fputs(reply, stdout);
+        /* The state reply has no ok member. */
+        if (json_find_bool(reply, "ok", &ok) == 0 && !ok) {
+            r = -1;
+        }
+    }
+    free(reply);
+
+    return r == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Register this instance in the runtime directory, so that instances can
+   be found without scanning the process table. The file stays locked for
+   the life of niagrad; an unlocked one was left behind by an instance
+   which died without removing it. It is written under a temporary name
+   first so that it is never seen unlocked or incomplete. */
+static void
+register_instance(void)
+{
+    char tmp_path[MAX_FILE_NAME];
+    FILE *f;
+    int fd;
+
+    if (snprintf(registry_path, sizeof registry_path, "%s/%ld" REGISTRY_SUFFIX, runtime_dir,
+                 (long) niagra_pid) >= (int)(sizeof registry_path) ||
+        snprintf(tmp_path, sizeof tmp_path, "%s/.%ld" REGISTRY_SUFFIX, runtime_dir,
+                 (long) niagra_pid) >= (int)(sizeof tmp_path)) {
+        log_msg(LOG_ERR, "registry path too long");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Still registered, and locked, by the niagrad this one upgraded. */
+    if (registry_fd != -1) {
+        if (fcntl(registry_fd, F_SETFD, FD_CLOEXEC) == -1) {
+            log_msg(LOG_ERR, "error taking over registry file %s: %m", registry_path);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    /* A leftover from an instance with the same pid is removed, but a
+       link is never followed and nothing there is ever truncated. */
+    (void) unlink(tmp_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        log_msg(LOG_ERR, "error creating registry file %s: %m", tmp_path);
+        exit(EXIT_FAILURE);
+    }
+
+    f = fdopen(dup(fd), "w");
+    if (f == NULL) {
+        log_msg(LOG_ERR, "error writing registry file %s: %m", tmp_path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "pid: %ld\n", (long) niagra_pid);
+    fprintf(f, "config: %s\n", config_file_path);
+    fprintf(f, "control: %s\n", control_path);
+    fprintf(f, "start_time: %s\n", stat_start_time);
+    if (fclose(f) != 0 || rename(tmp_path, registry_path) == -1) {
+        log_msg(LOG_ERR, "error writing registry file %s: %m", registry_path);
+        (void) unlink(tmp_path);
+        exit(EXIT_FAILURE);
+    }
+
+    registry_fd = fd;
+}
+
+static void
+unregister_instance(void)
+{
+    if (registry_fd != -1) {
+        (void) unlink(registry_path);
+    }
+}
+
+/* niagrad -l: print the pids of the running instances whose config path
+   contains 'match', or all of them. Stale entries are removed on the way. */
+static int
+list_instances(const char *match)
+{
+    char path[MAX_FILE_NAME], line[MAX_LINE_SIZE];
+    char *key_value[2];
+    struct dirent *entry;
+    int *pids = NULL;
+    int num_pids = 0, max_pids = 0;
+    bool matched;
+    FILE *f;
+    DIR *dir;
+    int i, fd, pid;
+
+    if (find_runtime_dir() == -1) {
+        fprintf(stderr, "niagrad: runtime directory name too long\n");
+        return EXIT_FAILURE;
+    }
+
+    if (check_runtime_dir() == -1) {
+        /* No instance has ever run. */
+        if (errno == ENOENT) {
+            return EXIT_SUCCESS;
+        }
+        fprintf(stderr, "niagrad: untrusted runtime directory %s: %s\n", runtime_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    dir = opendir(runtime_dir);
+    if (dir == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+
+        if (entry->d_name[0] == '.' || len <= strlen(REGISTRY_SUFFIX) ||
+            strcmp(entry->d_name + len - strlen(REGISTRY_SUFFIX), REGISTRY_SUFFIX) != 0) {
+            continue;
+        }
+
+        if (snprintf(path, sizeof path, "%s/%s", runtime_dir, entry->d_name) >= (int)(sizeof path)) {
+            continue;
+        }
+
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        f = fdopen(fd, "r");
+        if (f == NULL) {
+            (void) close(fd);
+            continue;
+        }
+
+        if (flock(fileno(f), LOCK_SH | LOCK_NB) == 0) {
+            /* Its control socket was left behind too. */
+            (void) unlink(path);
+            if (snprintf(path, sizeof path, "%s/%.*s.sock", runtime_dir,
+                         (int) (len - strlen(REGISTRY_SUFFIX)), entry->d_name) < (int)(sizeof path)) {
+                (void) unlink(path);
+            }
+            (void) fclose(f);
+            continue;
+        }
+
+        pid = 0;
+        matched = (match == NULL);
+        while (str_readline(f, line, sizeof line) > 0) {
+            if (str_split(line, ':', key_value, 2) != 2) {
+                continue;
+            }
+            if (strcmp(key_value[0], "pid") == 0) {
+                (void) str_int(str_strip(key_value[1], ' '), &pid);
+            } else if (strcmp(key_value[0], "config") == 0 && match != NULL) {
+                matched = (strstr(key_value[1], match) != NULL);
+            }
+        }
+        (void) fclose(f);
+
+        if (pid <= 0 || !matched) {
+            continue;
+        }
+
+        if (num_pids == max_pids) {
+            max_pids = max_pids == 0 ? 16 : 2 * max_pids;
+            pids = realloc(pids, max_pids * sizeof *pids);
+            if (pids == NULL) {
+                fprintf(stderr, "niagrad: out of memory\n");
+                return EXIT_FAILURE;
+            }
+        }
+        pids[num_pids++] = pid;
+    }
+
+    (void) closedir(dir);
+
+    qsort(pids, num_pids, sizeof *pids, compare_pids);
+    for (i = 0; i < num_pids; i++) {
+        printf("%d\n", pids[i]);
+    }
+    free(pids);
+
+    return EXIT_SUCCESS;
+}
+
+static int
+compare_pids(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+/* Parse the config file into the apps it has sections for, adding any
+   new ones. The settings of an existing app must have been reset first.
+   Return 0 on success and -1 if the config file is invalid. */
+static int
+parse_config_file(void)
+{
+    FILE *f;
+    int i, j, n, r, num_sock_parts, num_positional;
+
+    static char line[MAX_LINE_SIZE];
+    char *command_value[2];
+    char *socket_parts[MAX_SOCK_FIELDS];
+    char *file_parts[NUM_FILE_OPTIONS];
+
+    /* The absolute path, since niagrad changes directory once started. */
+    f = fopen(config_file_path, "r");
+
+    if (f == NULL) {
+        log_msg(LOG_ERR, "opening config file: %m");
+        return -1;
+    }
+
+    for (app = apps; app != NULL; app = app->next) {
+        app->in_config = false;
+    }
+
+    i = 0;
+    while (i++, (n = str_readline(f, line, sizeof line)) > 0) {
+
+        if (line[0] == '#') {
+            /* Comment line */
+            continue;
+        }
+
+        r = str_split(line, ':', command_value, 2);
+
+        if (r < 2) {
+            /* Must be a command portion */
+            n = -1;
+            break;
+        }
+
+        command_value[1] = str_strip(command_value[1], ' ');
+
+        if (strcmp(command_value[0], "app") == 0) {
+            if (parse_app(command_value[1]) == -1) {
+                n = -1;
+                break;
+            }
+            continue;
+        }
+
+        /* Settings before the first section belong to the default app. */
+        if (app == NULL && strcmp(command_value[0], "metrics") != 0 && strcmp(command_value[0], "log") != 0 &&
+            parse_app(DEFAULT_APP) == -1) {
+            n = -1;
+            break;
+        }
+
+        if (strcmp(command_value[0], "command") == 0) {
+            if (!str_isempty(app->server_command)) {
+                log_msg(LOG_INFO, "command already set.");
+                n = -1;
+                break;
+            }
+
+            r = str_copy(app->server_command, command_value[1], sizeof app->server_command);
+
+            if (r == -1) {
+                log_msg(LOG_INFO, "command too long.");
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "file") == 0) {
+            struct file *file;
+
+            r = str_split(command_value[1], ' ', file_parts, NUM_FILE_OPTIONS);
+            if (r != NUM_FILE_OPTIONS) {
+                log_msg(LOG_INFO, "Incorrect number of fields (%d) for file options. Should be %d fields.",
+                       r, NUM_FILE_OPTIONS);
+                n = -1;
+                break;
+            }
+
+            if (app->num_files >= MAX_FILES) {
+                log_msg(LOG_INFO, "Too many files defined. A maximum of %d is allowed", MAX_FILES);
+                n = -1;
+                break;
+            }
+
+            file = &app->files[app->num_files];
+            file->fd = -1;
+
+            if (lookup_file_by_key(file_parts[0]) != -1) {
+                log_msg(LOG_INFO, "duplicate file key: %s", file_parts[0]);
+                n = -1;
+                break;
+            }
+
+            r = str_copy(file->key, file_parts[0], sizeof file->key);
+            if (r == -1) {
+                log_msg(LOG_INFO, "file key too long");
+                n = -1;
+                break;
+            }
+
+            r = str_copy(file->name, file_parts[1], sizeof file->name);
+            if (r == -1) {
+                log_msg(LOG_INFO, "file name too long");
+                n = -1;
+                break;
+            }
+
+            app->num_files++;
+
+        } else if (strcmp(command_value[0], "socket") == 0) {
+            struct fd *fd;
+
+            r = str_split(command_value[1], ' ', socket_parts, MAX_SOCK_FIELDS);
+            if (r < NUM_UNIX_SOCK_OPTIONS || r > MAX_SOCK_FIELDS) {
+                log_msg(LOG_INFO, "Incorrect number of fields (%d) for socket options. Should be %d fields"
+                       " (%d for unix sockets) followed by at most %d options.", r, NUM_SOCK_OPTIONS,
+                       NUM_UNIX_SOCK_OPTIONS, MAX_SOCK_FIELDS - NUM_SOCK_OPTIONS);
+                n = -1;
+                break;
+            }
+            num_sock_parts = r;
+
+            if (app->num_fds >= MAX_FDS) {
+                log_msg(LOG_INFO, "Too many fds defined. A maximum of %d is allowed", MAX_FDS);
+                n = -1;
+                break;
+            }
+
+            fd = &app->fds[app->num_fds];
+
+            if (lookup_fd_by_name(socket_parts[0]) != -1) {
+                log_msg(LOG_INFO, "duplicate fd name: %s", socket_parts[0]);
+                n = -1;
+                break;
+            }
+
+            r = str_copy(fd->name, socket_parts[0], sizeof fd->name);
+            if (r == -1) {
+                log_msg(LOG_INFO, "socket name too long");
+                n = -1;
+                break;
+            }
+
+            r = str_copy(fd->type, socket_parts[1], sizeof fd->type);
+            if (r == -1) {
+                log_msg(LOG_INFO, "socket type too long");
+                n = -1;
+                break;
+            }
+
+            fd->fd = -1;
+            fd->x.sock.uid = (uid_t) -1;
+            fd->x.sock.gid = (gid_t) -1;
+
+            if (strcmp(socket_parts[2], "unix") == 0) {
+                fd->x.sock.family = AF_UNIX;
+                num_positional = NUM_UNIX_SOCK_OPTIONS;
+
+                r = str_copy(fd->x.sock.path, socket_parts[3], sizeof fd->x.sock.path);
+                if (r == -1) {
+                    log_msg(LOG_INFO, "unix socket path too long");
+                    n = -1;
+                    break;
+                }
+
+                r = parse_backlog(socket_parts[4], &fd->x.sock.backlog);
+                if (r == -1) {
+                    log_msg(LOG_INFO, "invalid backlog");
+                    n = -1;
+                    break;
+                }
+            } else {
+                fd->x.sock.family = AF_INET;
+                num_positional = NUM_SOCK_OPTIONS;
+
+                if (num_sock_parts < NUM_SOCK_OPTIONS) {
+                    log_msg(LOG_INFO, "Incorrect number of fields (%d) for socket options. Should be %d fields.",
+                           num_sock_parts, NUM_SOCK_OPTIONS);
+                    n = -1;
+                    break;
+                }
+
+                if (strcmp(socket_parts[2], "4") == 0) {
+                    fd->x.sock.ip_ver = 4;
+                } else if (strcmp(socket_parts[2], "6") == 0) {
+                    fd->x.sock.ip_ver = 6;
+                } else {
+                    log_msg(LOG_INFO, "IP version must be '4', '6' or 'unix'");
+                    n = -1;
+                    break;
+                }
+
+                r = inet_aton(socket_parts[3], &fd->x.sock.addr);
+                if (r == 0) {
+                    log_msg(LOG_INFO, "invalid network address");
+                    n = -1;
+                    break;
+                }
+
+                r = str_uint16(socket_parts[4], &fd->x.sock.port);
+                if (r == -1) {
+                    log_msg(LOG_INFO, "invalid port number");
+                    n = -1;
+                    break;
+                }
+
+                r = parse_backlog(socket_parts[5], &fd->x.sock.backlog);
+                if (r == -1) {
+                    log_msg(LOG_INFO, "invalid backlog");
+                    n = -1;
+                    break;
+                }
+            }
+
+            for (j = num_positional; j < num_sock_parts; j++) {
+                if (parse_socket_option(fd, socket_parts[j]) == -1) {
+                    n = -1;
+                    break;
+                }
+            }
+            if (n == -1) {
+                break;
+            }
+
+            fd->fd_type = SOCKET_FD;
+
+            app->num_fds++;
+
+        } else if (strcmp(command_value[0], "user") == 0) {
+            log_msg(LOG_INFO, "WARNING: Got user command: %s - not implemented", command_value[1]);
+
+        } else if (strcmp(command_value[0], "environment") == 0) {
+
+            if (!str_isempty(app->config_environment)) {
+                log_msg(LOG_INFO, "environment already set.");
+                n = -1;
+                break;
+            }
+
+            r = str_copy(app->config_environment, command_value[1], sizeof app->config_environment);
+
+            if (r == -1) {
+                log_msg(LOG_INFO, "environment too long.");
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "affinity") == 0) {
+            if (parse_affinity(command_value[1]) == -1) {
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "migrate-batch") == 0) {
+            if (parse_migrate_batch(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid migrate-batch: '%s'", command_value[1]);
                 n = -1;
                 break;
             }
 
-            if (strcmp(socket_parts[2], "4") == 0) {
-                fd->x.sock.ip_ver = 4;
-            } else if (strcmp(socket_parts[2], "6") == 0) {
-                fd->x.sock.ip_ver = 6;
-            } else {
-                syslog(LOG_INFO, "IP version must be '4' or '6'");
-                n = -1;
-                break;
-            }
+        } else if (strcmp(command_value[0], "migrate-pause") == 0) {
+            if (str_int(command_value[1], &app->migrate_pause) == -1 || app->migrate_pause < 0) {
+                log_msg(LOG_INFO, "invalid migrate-pause: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "standby") == 0) {
+            if (str_int(command_value[1], &app->num_standbys) == -1 || app->num_standbys < 0) {
+                log_msg(LOG_INFO, "invalid standby: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "drain-timeout") == 0) {
+            if (str_int(command_value[1], &app->drain_timeout) == -1 || app->drain_timeout < 0) {
+                log_msg(LOG_INFO, "invalid drain-timeout: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "drain-kill-timeout") == 0) {
+            if (str_int(command_value[1], &app->drain_kill_timeout) == -1 || app->drain_kill_timeout < 0) {
+                log_msg(LOG_INFO, "invalid drain-kill-timeout: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "autoscale-cpu") == 0) {
+            if (parse_autoscale_cpu(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid autoscale-cpu: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "autoscale-cooldown") == 0) {
+            if (str_int(command_value[1], &app->autoscale_cooldown) == -1 || app->autoscale_cooldown < 0) {
+                log_msg(LOG_INFO, "invalid autoscale-cooldown: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "queue-interval") == 0) {
+            if (str_int(command_value[1], &app->queue_interval) == -1 || app->queue_interval < 0) {
+                log_msg(LOG_INFO, "invalid queue-interval: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "sample-interval") == 0) {
+            if (str_int(command_value[1], &app->sample_interval) == -1 || app->sample_interval < 0) {
+                log_msg(LOG_INFO, "invalid sample-interval: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "metrics") == 0) {
+            if (parse_metrics(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid metrics: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+            metrics_enabled = true;
+
+        } else if (strcmp(command_value[0], "log") == 0) {
+            if (parse_log(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid log: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "respawn-backoff") == 0) {
+            if (parse_backoff(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid respawn-backoff: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "crash-loop") == 0) {
+            if (parse_crash_loop(command_value[1]) == -1) {
+                log_msg(LOG_INFO, "invalid crash-loop: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "ready-timeout") == 0) {
+            if (str_int(command_value[1], &app->ready_timeout) == -1 || app->ready_timeout < 0) {
+                log_msg(LOG_INFO, "invalid ready-timeout: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strcmp(command_value[0], "copies") == 0) {
+            if (strstr(command_value[1], "..") != NULL ? parse_copies_range(command_value[1]) == -1 :
+                parse_copies(command_value[1], &app->copies) == -1) {
+                log_msg(LOG_INFO, "invalid copies: '%s'", command_value[1]);
+                n = -1;
+                break;
+            }
+
+        } else if (strncmp(command_value[0], "app-", 4) == 0) {
+            struct app_option *app_option;
+
+            if (app->num_app_options >= MAX_APP_OPTIONS) {
+                log_msg(LOG_INFO, "Too many app options defined. A maximum of %d is allowed", MAX_APP_OPTIONS);
+                n = -1;
+                break;
+            }
+
+            app_option = &app->app_options[app->num_app_options];
+
+            r = str_copy(app_option->name, command_value[0], sizeof app_option->name);
+            if (r == -1) {
+                log_msg(LOG_INFO, "app option name too long");
+                n = -1;
+                break;
+            }
+
+            r = str_copy(app_option->value, command_value[1], sizeof app_option->value);
+            if (r == -1) {
+                log_msg(LOG_INFO, "app option value too long");
+                n = -1;
+                break;
+            }
+
+            app->num_app_options++;
+
+        } else {
+            /* Invalid command */
+            log_msg(LOG_INFO, "Invalid command: '%s'", command_value[0]);
+            n = -1;
+            break;
+        }
+    }
+
+    /* if there is an error on close, we don't care */
+    (void) fclose(f);
+
+    if (n != 0) {
+        log_msg(LOG_INFO, "Error on line: %d", i);
+        return -1;
+    }
+
+    for (app = apps, n = 0; app != NULL; app = app->next) {
+        if (!app->in_config) {
+            continue;
+        }
+        if (str_isempty(app->server_command)) {
+            log_msg(LOG_ERR, "no command specified for app %s.", app->name);
+            return -1;
+        }
+        /* One copy per core unless told otherwise. */
+        if (app->copies == 0) {
+            app->copies = online_cpus();
+        }
+        n++;
+    }
+
+    if (n == 0) {
+        log_msg(LOG_ERR, "no command specified.");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Start the section of the app 'name', which is added unless it already
+   runs. Return 0 on success and -1 on error. */
+static int
+parse_app(const char *name)
+{
+    struct app *a = find_app(name);
+
+    if (str_isempty(name) || strlen(name) >= MAX_APP_NAME || strspn(name, APP_NAME_CHARS) != strlen(name)) {
+        log_msg(LOG_INFO, "invalid app name: '%s'", name);
+        return -1;
+    }
+
+    if (a != NULL && a->in_config) {
+        log_msg(LOG_INFO, "duplicate app: %s", name);
+        return -1;
+    }
+
+    app = (a != NULL ? a : new_app(name));
+    app->in_config = true;
+
+    return 0;
+}
+
+static struct app *
+find_app(const char *name)
+{
+    struct app *a;
+
+    for (a = apps; a != NULL && strcmp(a->name, name) != 0; a = a->next) {
+    }
+
+    return a;
+}
+
+/* Add an app with the default settings, after the others. */
+static struct app *
+new_app(const char *name)
+{
+    struct app **p;
+
+    app = calloc(1, sizeof *app);
+    if (app == NULL) {
+        log_msg(LOG_ERR, "out of memory adding app %s", name);
+        exit(EXIT_FAILURE);
+    }
+
+    (void) str_copy(app->name, name, sizeof app->name);
+    reset_config();
+
+    app->drain_poll_timer.handler = drain_poll;
+    app->sample_timer.handler = sample_usage;
+    app->queue_timer.handler = sample_queues;
+    app->autoscale_timer.handler = autoscale_check;
+    app->respawn_timer.handler = respawn_due;
+    app->migrate_timer.handler = migrate_pause_expired;
+    app->drain_poll_timer.data = app->sample_timer.data = app->queue_timer.data = app;
+    app->autoscale_timer.data = app->respawn_timer.data = app->migrate_timer.data = app;
+
+    app->ready_histogram.bounds = ready_bounds;
+    app->ready_histogram.num_bounds = sizeof ready_bounds / sizeof ready_bounds[0];
+    app->drain_histogram.bounds = drain_bounds;
+    app->drain_histogram.num_bounds = sizeof drain_bounds / sizeof drain_bounds[0];
+    app->respawn_histogram.bounds = respawn_bounds;
+    app->respawn_histogram.num_bounds = sizeof respawn_bounds / sizeof respawn_bounds[0];
+
+    for (p = &apps; *p != NULL; p = &(*p)->next) {
+    }
+    *p = app;
+
+    return app;
+}
+
+#define CONFIG_VAR(var) \
+    (void) (to_config ? memcpy(&c->var, &app->var, sizeof c->var) : memcpy(&app->var, &c->var, sizeof c->var))
+
+/* Copy the globals the config file sets to 'c', or back from it. */
+static void
+copy_config(struct config *c, bool to_config)
+{
+    CONFIG_VAR(server_command);
+    CONFIG_VAR(server_use_shell);
+    CONFIG_VAR(server_argv);
+    CONFIG_VAR(standby_command);
+    CONFIG_VAR(standby_argv);
+    CONFIG_VAR(config_environment);
+    CONFIG_VAR(fds);
+    CONFIG_VAR(num_fds);
+    CONFIG_VAR(files);
+    CONFIG_VAR(num_files);
+    CONFIG_VAR(app_options);
+    CONFIG_VAR(num_app_options);
+    CONFIG_VAR(copies);
+    CONFIG_VAR(autoscale);
+    CONFIG_VAR(copies_min);
+    CONFIG_VAR(copies_max);
+    CONFIG_VAR(affinity_mode);
+    CONFIG_VAR(affinity_cpus);
+    CONFIG_VAR(affinity_has_cpus);
+    CONFIG_VAR(placements);
+    CONFIG_VAR(num_standbys);
+    CONFIG_VAR(drain_timeout);
+    CONFIG_VAR(drain_kill_timeout);
+    CONFIG_VAR(ready_timeout);
+    CONFIG_VAR(migrate_batch);
+    CONFIG_VAR(migrate_batch_percent);
+    CONFIG_VAR(migrate_pause);
+    CONFIG_VAR(sample_interval);
+    CONFIG_VAR(queue_interval);
+    CONFIG_VAR(autoscale_cpu_low);
+    CONFIG_VAR(autoscale_cpu_high);
+    CONFIG_VAR(autoscale_cooldown);
+    CONFIG_VAR(backoff_initial);
+    CONFIG_VAR(backoff_max);
+    CONFIG_VAR(crash_loop_failures);
+    CONFIG_VAR(crash_loop_policy);
+}
+
+#undef CONFIG_VAR
+
+/* Set everything the config file sets back to its default, ready to parse
+   the file again. */
+static void
+reset_config(void)
+{
+    app->server_command[0] = '\0';
+    app->server_use_shell = false;
+    app->server_argv = NULL;
+    app->standby_command = NULL;
+    app->standby_argv = NULL;
+    app->config_environment[0] = '\0';
+    memset(app->fds, 0, sizeof app->fds);
+    app->num_fds = 0;
+    memset(app->files, 0, sizeof app->files);
+    app->num_files = 0;
+    memset(app->app_options, 0, sizeof app->app_options);
+    app->num_app_options = 0;
+    app->copies = 0;
+    app->autoscale = false;
+    app->copies_min = 0;
+    app->copies_max = 0;
+    app->affinity_mode = AFFINITY_NONE;
+    CPU_ZERO(&app->affinity_cpus);
+    app->affinity_has_cpus = false;
+    app->placements = NULL;
+    app->num_standbys = 0;
+    app->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    app->drain_kill_timeout = DEFAULT_DRAIN_KILL_TIMEOUT;
+    app->ready_timeout = DEFAULT_READY_TIMEOUT;
+    app->migrate_batch = 0;
+    app->migrate_batch_percent = false;
+    app->migrate_pause = 0;
+    app->sample_interval = DEFAULT_SAMPLE_INTERVAL;
+    app->queue_interval = DEFAULT_QUEUE_INTERVAL;
+    app->autoscale_cpu_low = DEFAULT_AUTOSCALE_CPU_LOW;
+    app->autoscale_cpu_high = DEFAULT_AUTOSCALE_CPU_HIGH;
+    app->autoscale_cooldown = DEFAULT_AUTOSCALE_COOLDOWN;
+    app->backoff_initial = DEFAULT_BACKOFF_INITIAL;
+    app->backoff_max = DEFAULT_BACKOFF_MAX;
+    app->crash_loop_failures = DEFAULT_CRASH_LOOP_FAILURES;
+    app->crash_loop_policy = CRASH_LOOP_BACKOFF;
+}
+
+/* Re-read the config file and apply what changed to each app. Listeners
+   whose address is unchanged keep their socket, with the backlog and buffer
+   sizes adjusted in place; new ones are bound, and removed ones closed.
+   Servers which were given a removed listener keep their own copy until
+   they have drained. If the command line given to servers changes
+   (command, sockets, files, app options or environment), or the affinity,
+   all servers of the app are migrated. Copies are scaled and timers
+   restarted as needed. Apps added to the file are started and apps removed
+   from it are terminated. A listener is only kept within its app, so it
+   cannot move to another app in one reload. The metrics and log settings
+   only change on restart.
+
+   Return 0 on success. On error nothing has changed, and -1 is returned
+   with 'error' set. */
+static int
+reload_config(const char **error)
+{
+    struct app *next;
+    bool old_metrics_enabled = metrics_enabled;
+    struct fd_socket old_metrics_socket = metrics_socket;
+    enum log_sink old_log_sink = log_sink;
+    char old_log_path[MAX_FILE_NAME];
+
+    for (app = apps; app != NULL; app = app->next) {
+        if (app->migrating) {
+            *error = "migration in progress";
+            return -1;
+        }
+    }
+
+    log_msg(LOG_INFO, "reloading %s", config_file_path);
+
+    num_reload_changes = 0;
+    stat_reload_count += 1;
+    store_time(stat_reload_last_time);
+
+    for (app = apps; app != NULL; app = app->next) {
+        app->reload = calloc(1, sizeof *app->reload);
+        if (app->reload == NULL) {
+            log_msg(LOG_ERR, "out of memory reloading %s", config_file_path);
+            exit(EXIT_FAILURE);
+        }
+        copy_config(&app->reload->old, true);
+        reset_config();
+    }
+    metrics_enabled = false;
+    memset(&metrics_socket, 0, sizeof metrics_socket);
+    (void) str_copy(old_log_path, log_path, sizeof old_log_path);
+    log_sink = LOG_SINK_SYSLOG;
+    log_path[0] = '\0';
+
+    if (parse_config_file() == -1) {
+        abort_reload();
+        metrics_enabled = old_metrics_enabled;
+        metrics_socket = old_metrics_socket;
+        log_sink = old_log_sink;
+        (void) str_copy(log_path, old_log_path, sizeof log_path);
+        *error = "invalid config";
+        return -1;
+    }
+
+    if (metrics_enabled != old_metrics_enabled ||
+        (metrics_enabled && !same_listener(&metrics_socket, &old_metrics_socket))) {
+        log_msg(LOG_INFO, "WARNING: metrics is only changed by a restart of niagrad");
+    }
+    metrics_enabled = old_metrics_enabled;
+    metrics_socket = old_metrics_socket;
+    if (log_sink != old_log_sink || strcmp(log_path, old_log_path) != 0) {
+        log_msg(LOG_INFO, "WARNING: log is only changed by a restart of niagrad");
+    }
+    log_sink = old_log_sink;
+    (void) str_copy(log_path, old_log_path, sizeof log_path);
+
+    /* An app which is no longer in the file keeps running as it is until
+       the reload is committed. */
+    for (app = apps; app != NULL; app = app->next) {
+        if (app->reload == NULL) {
+            app->reload = calloc(1, sizeof *app->reload);
+            if (app->reload == NULL) {
+                log_msg(LOG_ERR, "out of memory reloading %s", config_file_path);
+                exit(EXIT_FAILURE);
+            }
+            app->reload->added = true; /* with nothing to keep */
+        } else if (!app->in_config) {
+            copy_config(&app->reload->old, false);
+            continue;
+        }
+        if (prepare_reload(error) == -1) {
+            abort_reload();
+            return -1;
+        }
+    }
+
+    /* From here on the new config is in effect. */
+    reload_migrates = false;
+    for (app = apps; app != NULL; app = next) {
+        next = app->next;
+        if (app->reload->added) {
+            note_change("added");
+            alloc_servers();
+            start_app();
+        } else if (!app->in_config) {
+            note_change("removed");
+            free(app->reload);
+            app->reload = NULL;
+            retire_app();
+            continue;
+        } else {
+            commit_reload();
+            reload_migrates = reload_migrates || app->reload->migrate;
+        }
+        free(app->reload);
+        app->reload = NULL;
+    }
+
+    log_msg(LOG_INFO, "reloaded %s: %d changes", config_file_path, num_reload_changes);
+
+    return 0;
+}
+
+/* Work out what the reload changes for the current app, and open its new
+   sockets and files. On error the app is back as it was, and -1 is
+   returned with 'error' set. */
+static int
+prepare_reload(const char **error)
+{
+    struct reload *r = app->reload;
+    struct config *old = &r->old;
+    int i, k;
+
+    /* Slots, shards and placements keep their current number until the
+       change is applied by scale_servers(). A new range keeps the current
+       number of copies if it can. A new app starts with its own. */
+    r->target = app->copies;
+    if (!r->added) {
+        app->copies = old->copies;
+    }
+    if (app->autoscale) {
+        r->target = app->copies < app->copies_min ? app->copies_min :
+            app->copies > app->copies_max ? app->copies_max : app->copies;
+    }
+
+    r->affinity_changed = app->affinity_mode != old->affinity_mode || app->affinity_has_cpus != old->affinity_has_cpus ||
+        !CPU_EQUAL(&app->affinity_cpus, &old->affinity_cpus);
+    if (!r->affinity_changed) {
+        app->placements = old->placements;
+    } else if (plan_affinity(app->copies, &app->placements) == -1) {
+        undo_reload();
+        *error = "invalid affinity";
+        return -1;
+    }
+
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        for (k = 0; k < old->num_fds; k++) {
+            if (!r->kept_fd[k] && same_listener(&fd->x.sock, &old->fds[k].x.sock)) {
+                break;
+            }
+        }
+        if (k == old->num_fds) {
+            if (open_socket(fd) == -1) {
+                undo_reload();
+                *error = "error opening socket";
+                return -1;
+            }
+            r->created_fd[i] = true;
+            continue;
+        }
+        r->kept_fd[k] = true;
+        fd->fd = old->fds[k].fd;
+        fd->x.sock.shards = old->fds[k].x.sock.shards;
+        fd->x.sock.num_shards = old->fds[k].x.sock.num_shards;
+        fd->x.sock.steered = old->fds[k].x.sock.steered;
+        fd->x.sock.queues = old->fds[k].x.sock.queues;
+        fd->x.sock.queue_high_water = old->fds[k].x.sock.queue_high_water;
+        fd->x.sock.activated = old->fds[k].x.sock.activated;
+    }
+
+    for (i = 0; i < app->num_files; i++) {
+        for (k = 0; k < old->num_files; k++) {
+            if (!r->kept_file[k] && strcmp(app->files[i].name, old->files[k].name) == 0) {
+                break;
+            }
+        }
+        if (k < old->num_files) {
+            r->kept_file[k] = true;
+            app->files[i].fd = old->files[k].fd;
+            continue;
+        }
+        app->files[i].fd = open(app->files[i].name, O_RDONLY);
+        if (app->files[i].fd == -1) {
+            log_msg(LOG_ERR, "error opening file %s: %m", app->files[i].name);
+            undo_reload();
+            *error = "error opening file";
+            return -1;
+        }
+        r->opened_file[i] = true;
+    }
+
+    if (update_command_line() == -1) {
+        undo_reload();
+        *error = "command line too long";
+        return -1;
+    }
+
+    if (r->added) {
+        app->copies = r->target;
+    }
+    r->prepared = true;
+
+    return 0;
+}
+
+/* Apply the prepared reload of the current app, which keeps running. */
+static void
+commit_reload(void)
+{
+    struct reload *r = app->reload;
+    struct config *old = &r->old;
+    const char *error;
+    int i, k, old_copies;
+
+    r->migrate = r->affinity_changed || strcmp(app->server_command, old->server_command) != 0;
+
+    for (i = 0; i < app->num_fds; i++) {
+        if (r->created_fd[i]) {
+            note_change("socket %s added", app->fds[i].name);
+            continue;
+        }
+        for (k = 0; k < old->num_fds && old->fds[k].fd != app->fds[i].fd; k++) {
+        }
+        if (strcmp(app->fds[i].name, old->fds[k].name) != 0 || strcmp(app->fds[i].type, old->fds[k].type) != 0) {
+            note_change("socket %s renamed to %s", old->fds[k].name, app->fds[i].name);
+        }
+        if (!same_tuning(&app->fds[i].x.sock, &old->fds[k].x.sock)) {
+            note_change("socket %s retuned", app->fds[i].name);
+            retune_socket(&app->fds[i], &old->fds[k].x.sock);
+        }
+    }
+    for (k = 0; k < old->num_fds; k++) {
+        if (!r->kept_fd[k]) {
+            note_change("socket %s removed", old->fds[k].name);
+            close_socket(&old->fds[k]);
+            if (old->fds[k].x.sock.family == AF_UNIX && !old->fds[k].x.sock.activated) {
+                (void) unlink(old->fds[k].x.sock.path);
+            }
+        }
+    }
+    for (i = 0; i < app->num_files; i++) {
+        if (r->opened_file[i]) {
+            note_change("file %s added", app->files[i].key);
+        }
+    }
+    for (k = 0; k < old->num_files; k++) {
+        if (!r->kept_file[k]) {
+            note_change("file %s removed", old->files[k].key);
+            (void) close(old->files[k].fd);
+        }
+    }
+
+    if (strcmp(app->config_environment, old->config_environment) != 0) {
+        note_change("environment %s", app->config_environment);
+    }
+    if (app->num_app_options != old->num_app_options ||
+        memcmp(app->app_options, old->app_options, app->num_app_options * sizeof *app->app_options) != 0) {
+        note_change("app options changed");
+    }
+    if (strcmp(app->server_command, old->server_command) != 0) {
+        note_change("command line changed");
+    }
+    if (r->affinity_changed) {
+        note_change("affinity %s", affinity_mode_name());
+        free(old->placements);
+        for (i = 0; i < app->num_fds; i++) {
+            if (app->fds[i].fd_type == SOCKET_FD && app->fds[i].x.sock.reuseport) {
+                attach_steering_program(&app->fds[i]);
+            }
+        }
+    }
+
+    free_argv(old->server_argv);
+    free_argv(old->standby_argv);
+    free(old->standby_command);
+
+    if (app->num_standbys != old->num_standbys) {
+        note_int("standby", old->num_standbys, app->num_standbys);
+        for (i = 0; i < old->num_standbys; i++) {
+            if (app->standbys[i] != NULL) {
+                retire_standby(app->standbys[i]);
+            }
+        }
+        free(app->standbys);
+        app->standbys = calloc(app->num_standbys + 1, sizeof *app->standbys);
+        if (app->standbys == NULL) {
+            log_msg(LOG_ERR, "out of memory allocating %d standbys", app->num_standbys);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    note_int("drain-timeout", old->drain_timeout, app->drain_timeout);
+    note_int("drain-kill-timeout", old->drain_kill_timeout, app->drain_kill_timeout);
+    note_int("ready-timeout", old->ready_timeout, app->ready_timeout);
+    note_int("migrate-batch", old->migrate_batch, app->migrate_batch);
+    note_int("migrate-pause", old->migrate_pause, app->migrate_pause);
+    note_int("autoscale-cpu low", old->autoscale_cpu_low, app->autoscale_cpu_low);
+    note_int("autoscale-cpu high", old->autoscale_cpu_high, app->autoscale_cpu_high);
+    note_int("autoscale-cooldown", old->autoscale_cooldown, app->autoscale_cooldown);
+    note_int("respawn-backoff initial", old->backoff_initial, app->backoff_initial);
+    note_int("respawn-backoff max", old->backoff_max, app->backoff_max);
+    note_int("crash-loop", old->crash_loop_failures, app->crash_loop_failures);
+
+    if (app->sample_interval != old->sample_interval) {
+        note_int("sample-interval", old->sample_interval, app->sample_interval);
+        timer_stop(&app->sample_timer);
+        if (app->sample_interval > 0) {
+            timer_start(&app->sample_timer, app->sample_interval);
+        }
+    }
+
+    if (app->queue_interval != old->queue_interval) {
+        note_int("queue-interval", old->queue_interval, app->queue_interval);
+        timer_stop(&app->queue_timer);
+        if (app->queue_interval > 0) {
+            timer_start(&app->queue_timer, app->queue_interval);
+        }
+    }
+
+    if (app->autoscale != old->autoscale || app->copies_min != old->copies_min || app->copies_max != old->copies_max) {
+        if (app->autoscale) {
+            note_change("autoscale %d..%d", app->copies_min, app->copies_max);
+        } else {
+            note_change("autoscale off");
+        }
+    }
+    if (app->autoscale && !timer_armed(&app->autoscale_timer)) {
+        timer_start(&app->autoscale_timer, AUTOSCALE_INTERVAL);
+    } else if (!app->autoscale) {
+        timer_stop(&app->autoscale_timer);
+    }
+
+    if (r->target != app->copies) {
+        old_copies = app->copies;
+        if (scale_servers(r->target, &error) == -1) {
+            log_msg(LOG_ERR, "unable to scale to %d servers: %s", r->target, error);
+        } else {
+            note_int("copies", old_copies, r->target);
+        }
+    } else if (!r->migrate) {
+        fill_standbys();
+    }
+
+    if (r->migrate) {
+        migrate_servers();
+    }
+}
+
+/* Put back the running config of every app after a failed reload, and drop
+   the apps it added. */
+static void
+abort_reload(void)
+{
+    struct app **p = &apps;
+
+    while ((app = *p) != NULL) {
+        if (app->reload == NULL || app->reload->added) {
+            if (app->reload != NULL && app->reload->prepared) {
+                undo_reload();
+            }
+            *p = app->next;
+            free(app->reload);
+            free_app(app);
+            continue;
+        }
+        if (app->reload->prepared) {
+            undo_reload();
+        } else {
+            copy_config(&app->reload->old, false);
+        }
+        free(app->reload);
+        app->reload = NULL;
+        p = &app->next;
+    }
+
+    stat_reload_failed_count += 1;
+}
+
+/* Put back the running config of the current app after a failed reload,
+   closing whatever the reload had opened. */
+static void
+undo_reload(void)
+{
+    struct reload *r = app->reload;
+    struct config *old = &r->old;
+    int i;
+
+    for (i = 0; i < app->num_fds; i++) {
+        if (r->created_fd[i]) {
+            close_socket(&app->fds[i]);
+            if (app->fds[i].x.sock.family == AF_UNIX) {
+                (void) unlink(app->fds[i].x.sock.path);
+            }
+        }
+    }
+
+    for (i = 0; i < app->num_files; i++) {
+        if (r->opened_file[i]) {
+            (void) close(app->files[i].fd);
+        }
+    }
+
+    if (app->placements != old->placements) {
+        free(app->placements);
+    }
+    if (app->standby_command != old->standby_command) {
+        free(app->standby_command);
+    }
+
+    copy_config(old, false);
+    r->prepared = false;
+}
+
+/* Whether two sockets listen on the same address, so that one can take
+   over the other's listener. */
+static bool
+same_listener(const struct fd_socket *a, const struct fd_socket *b)
+{
+    if (a->family != b->family || a->reuseport != b->reuseport) {
+        return false;
+    }
+
+    if (a->family == AF_UNIX) {
+        return strcmp(a->path, b->path) == 0;
+    }
+
+    return a->ip_ver == b->ip_ver && a->addr.s_addr == b->addr.s_addr && a->port == b->port;
+}
+
+static bool
+same_tuning(const struct fd_socket *a, const struct fd_socket *b)
+{
+    return a->backlog == b->backlog && a->rcvbuf == b->rcvbuf && a->sndbuf == b->sndbuf &&
+        a->nodelay == b->nodelay && a->defer_accept == b->defer_accept && a->fastopen == b->fastopen &&
+        a->mode == b->mode && a->uid == b->uid && a->gid == b->gid;
+}
+
+/* Apply new tuning to a listener that is kept. Failure leaves the old
+   tuning and is not fatal. */
+static void
+retune_socket(struct fd *fd, const struct fd_socket *old)
+{
+    int j, r = 0;
+
+    if (fd->x.sock.reuseport) {
+        for (j = 0; j < fd->x.sock.num_shards && r == 0; j++) {
+            r = tune_socket(fd->x.sock.shards[j], &fd->x.sock);
+        }
+    } else {
+        r = tune_socket(fd->fd, &fd->x.sock);
+    }
+
+    if (r == 0 && fd->x.sock.family == AF_UNIX &&
+        (fd->x.sock.mode != old->mode || fd->x.sock.uid != old->uid || fd->x.sock.gid != old->gid)) {
+        r = set_socket_owner(&fd->x.sock);
+    }
+
+    if (r == -1) {
+        log_msg(LOG_ERR, "WARNING: unable to retune socket %s", fd->name);
+    }
+}
+
+/* Log a change found by a reload to the current app and keep it for the
+   reply. */
+static void
+note_change(const char *format, ...)
+{
+    char change[MAX_RELOAD_CHANGE];
+    va_list ap;
+    int n;
+
+    n = snprintf(change, sizeof change, "%s: ", app->name);
+    va_start(ap, format);
+    (void) vsnprintf(change + n, sizeof change - n, format, ap);
+    va_end(ap);
+
+    log_msg(LOG_INFO, "reload: %s", change);
+
+    if (num_reload_changes < MAX_RELOAD_CHANGES) {
+        (void) str_copy(reload_changes[num_reload_changes++], change, MAX_RELOAD_CHANGE);
+    }
+}
+
+static void
+note_int(const char *name, int old, int new)
+{
+    if (old != new) {
+        note_change("%s %d -> %d", name, old, new);
+    }
+}
+
+static int
+online_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (int) n;
+}
+
+/* Parse a copies value: a number, or 'auto' for the number of online CPUs,
+   optionally adjusted as 'auto-N', 'auto+N' or 'auto/N'. The result is
+   never less than one. Return 0 on success and -1 on error. */
+static int
+parse_copies(const char *str, int *result)
+{
+    int n, cpus;
+
+    if (strncmp(str, "auto", 4) != 0) {
+        if (str_int(str, &n) == -1 || n <= 0) {
+            return -1;
+        }
+        *result = n;
+        return 0;
+    }
+
+    cpus = online_cpus();
+    str += 4;
+
+    if (str_isempty(str)) {
+        n = cpus;
+    } else if (str_int(str + 1, &n) == -1 || n <= 0) {
+        return -1;
+    } else if (str[0] == '-') {
+        n = cpus - n;
+    } else if (str[0] == '+') {
+        n = cpus + n;
+    } else if (str[0] == '/') {
+        n = cpus / n;
+    } else {
+        return -1;
+    }
+
+    *result = n < 1 ? 1 : n;
+
+    return 0;
+}
+
+/* Parse a backlog value, either a number or 'auto'. Return 0 on success
+   and -1 on error. */
+static int
+parse_backlog(const char *str, int *backlog)
+{
+    if (strcmp(str, "auto") == 0) {
+        *backlog = BACKLOG_AUTO;
+        return 0;
+    }
+
+    if (str_int(str, backlog) == -1 || *backlog <= 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse one of the optional trailing fields of a socket line. Options are
+   either a bare flag or 'name=value'. Return 0 on success and -1 on error. */
+static int
+parse_socket_option(struct fd *fd, char *option)
+{
+    struct fd_socket *sock = &fd->x.sock;
+    char *parts[2];
+    int *int_option = NULL;
+    int r;
+
+    r = str_split(option, '=', parts, 2);
+    if (r > 2) {
+        log_msg(LOG_INFO, "invalid socket option: '%s'", option);
+        return -1;
+    }
+
+    if (sock->family == AF_UNIX && r == 1) {
+        log_msg(LOG_INFO, "socket option '%s' is not supported for unix sockets", parts[0]);
+        return -1;
+    } else if (sock->family == AF_UNIX && (strcmp(parts[0], "defer_accept") == 0 ||
+                                           strcmp(parts[0], "fastopen") == 0)) {
+        log_msg(LOG_INFO, "socket option '%s' is not supported for unix sockets", parts[0]);
+        return -1;
+    }
+
+    if (r == 1) {
+        if (strcmp(parts[0], "reuseport") == 0) {
+            sock->reuseport = true;
+        } else if (strcmp(parts[0], "nodelay") == 0) {
+            sock->nodelay = true;
+        } else {
+            log_msg(LOG_INFO, "invalid socket option: '%s'", parts[0]);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(parts[0], "backlog") == 0) {
+        if (parse_backlog(parts[1], &sock->backlog) == -1) {
+            log_msg(LOG_INFO, "invalid backlog");
+            return -1;
+        }
+        return 0;
+    } else if (strcmp(parts[0], "mode") == 0 && sock->family == AF_UNIX) {
+        char *end;
+        long mode = strtol(parts[1], &end, 8);
+        if (*end != '\0' || mode <= 0 || mode > 07777) {
+            log_msg(LOG_INFO, "invalid unix socket mode: '%s'", parts[1]);
+            return -1;
+        }
+        sock->mode = (mode_t) mode;
+        return 0;
+    } else if (strcmp(parts[0], "owner") == 0 && sock->family == AF_UNIX) {
+        return parse_socket_owner(sock, parts[1]);
+    } else if (strcmp(parts[0], "defer_accept") == 0) {
+        int_option = &sock->defer_accept;
+    } else if (strcmp(parts[0], "fastopen") == 0) {
+        int_option = &sock->fastopen;
+    } else if (strcmp(parts[0], "rcvbuf") == 0) {
+        int_option = &sock->rcvbuf;
+    } else if (strcmp(parts[0], "sndbuf") == 0) {
+        int_option = &sock->sndbuf;
+    } else {
+        log_msg(LOG_INFO, "invalid socket option: '%s'", parts[0]);
+        return -1;
+    }
+
+    if (str_int(parts[1], int_option) == -1 || *int_option < 0) {
+        log_msg(LOG_INFO, "invalid value for socket option %s: '%s'", parts[0], parts[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse 'user[:group]' for a unix socket. Return 0 on success and -1 on
+   error. */
+static int
+parse_socket_owner(struct fd_socket *sock, char *owner)
+{
+    char *parts[2];
+    struct passwd *pw;
+    struct group *gr;
+    int r;
+
+    r = str_split(owner, ':', parts, 2);
+    if (r > 2) {
+        log_msg(LOG_INFO, "invalid unix socket owner: '%s'", owner);
+        return -1;
+    }
+
+    pw = getpwnam(parts[0]);
+    if (pw == NULL) {
+        log_msg(LOG_INFO, "unknown unix socket owner: '%s'", parts[0]);
+        return -1;
+    }
+    sock->uid = pw->pw_uid;
+    sock->gid = pw->pw_gid;
+
+    if (r == 2) {
+        gr = getgrnam(parts[1]);
+        if (gr == NULL) {
+            log_msg(LOG_INFO, "unknown unix socket group: '%s'", parts[1]);
+            return -1;
+        }
+        sock->gid = gr->gr_gid;
+    }
+
+    return 0;
+}
+
+/* Bind the listeners which have not been taken over, and steer the ones
+   which have by the current placements. */
+static void
+create_sockets(void) {
+    int i;
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        if (fd->fd_type != SOCKET_FD) {
+            continue;
+        }
+        if (fd->fd == -1) {
+            if (open_socket(fd) == -1) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (fd->x.sock.reuseport) {
+            attach_steering_program(fd);
+        }
+    }
+}
+
+/* Create the listener(s) for 'fd'. Return 0 on success and -1 on error,
+   with nothing left open. */
+static int
+open_socket(struct fd *fd)
+{
+    int j;
+
+    if (fd->x.sock.reuseport) {
+        /* One shard per copy. The first shard's fd number is the one passed
+           to every server; add_shard_actions() moves the right shard there. */
+        fd->x.sock.shards = calloc(app->copies, sizeof *fd->x.sock.shards);
+        if (fd->x.sock.shards == NULL) {
+            log_msg(LOG_ERR, "out of memory allocating shards");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < app->copies; j++) {
+            fd->x.sock.shards[j] = create_socket(&fd->x.sock);
+            if (fd->x.sock.shards[j] == -1) {
+                while (j-- > 0) {
+                    (void) close(fd->x.sock.shards[j]);
+                }
+                free(fd->x.sock.shards);
+                fd->x.sock.shards = NULL;
+                return -1;
+            }
+        }
+        fd->x.sock.num_shards = app->copies;
+        fd->fd = fd->x.sock.shards[0];
+        attach_steering_program(fd);
+    } else {
+        fd->fd = create_socket(&fd->x.sock);
+        if (fd->fd == -1) {
+            return -1;
+        }
+    }
+
+    fd->x.sock.queues = calloc(num_queues(&fd->x.sock), sizeof *fd->x.sock.queues);
+    if (fd->x.sock.queues == NULL) {
+        log_msg(LOG_ERR, "out of memory allocating queues");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+/* Close the listener(s) of 'fd'. Servers still holding them keep them open. */
+static void
+close_socket(struct fd *fd)
+{
+    int j;
+
+    if (fd->x.sock.reuseport) {
+        for (j = 0; j < fd->x.sock.num_shards; j++) {
+            (void) close(fd->x.sock.shards[j]);
+        }
+    } else {
+        (void) close(fd->fd);
+    }
+    free(fd->x.sock.shards);
+    free(fd->x.sock.queues);
+    fd->x.sock.shards = NULL;
+    fd->x.sock.queues = NULL;
+    fd->fd = -1;
+}
+
+/* Size the listen backlog from net.core.somaxconn, which the kernel would
+   silently clamp any larger value to anyway. */
+static int
+auto_backlog(void)
+{
+    FILE *f;
+    int backlog = SOMAXCONN;
+
+    f = fopen(SOMAXCONN_FILE, "r");
+    if (f == NULL) {
+        log_msg(LOG_INFO, "WARNING: unable to read %s: %m, using backlog %d", SOMAXCONN_FILE, backlog);
+        return backlog;
+    }
+
+    if (fscanf(f, "%d", &backlog) != 1 || backlog <= 0) {
+        backlog = SOMAXCONN;
+    }
+
+    (void) fclose(f);
+
+    return backlog;
+}
+
+static int
+set_socket_option(int s, int level, int name, int value, const char *what)
+{
+    if (setsockopt(s, level, name, (const void *)&value, sizeof value) != 0) {
+        log_msg(LOG_ERR, "error setting %s option: %m", what);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Return the listening socket, or -1 on error. */
+static int
+create_socket(const struct fd_socket *sock)
+{
+    int s;
+    int r;
+
+    /* create, bind and listen on the socket */
+    if (sock->family == AF_UNIX) {
+        s = socket(PF_UNIX, SOCK_STREAM, 0);
+    } else {
+        s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
+
+    if (s == -1) {
+        /* FIXME: look at errno and provide better error handling */
+        log_msg(LOG_ERR, "error creating socket: %m");
+        return -1;
+    }
+
+    /* Ensure the socket is non-blocking like node expects */
+    r = fcntl(s, F_SETFL, O_NONBLOCK);
+    if (r == -1) {
+        log_msg(LOG_ERR, "error setting non-blocking: %m");
+        (void) close(s);
+        return -1;
+    }
+
+    if (sock->family == AF_UNIX) {
+        r = bind_unix_socket(s, sock);
+    } else {
+        r = bind_inet_socket(s, sock);
+    }
+
+    if (r == -1 || tune_socket(s, sock) == -1) {
+        (void) close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Note the listeners passed by the service manager, if they are meant for
+   this process, and keep them from the servers until they are matched. The
+   variables are cleared so that the servers do not see them. */
+static void
+collect_activated_sockets(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    const char *names = getenv("LISTEN_FDNAMES");
+    int listen_pid, n, i;
+
+    if (pid != NULL && fds != NULL && str_int(pid, &listen_pid) == 0 && listen_pid == getpid() &&
+        str_int(fds, &n) == 0 && n > 0) {
+        activated_fds = calloc(n, sizeof *activated_fds);
+        activated_names = calloc(n, sizeof *activated_names);
+        activated_names_buf = strdup(names != NULL ? names : "");
+        if (activated_fds == NULL || activated_names == NULL || activated_names_buf == NULL) {
+            log_msg(LOG_ERR, "out of memory collecting activated sockets");
+            exit(EXIT_FAILURE);
+        }
+        (void) str_split(activated_names_buf, ':', activated_names, n);
+        for (i = 0; i < n; i++) {
+            activated_fds[i] = LISTEN_FDS_START + i;
+            if (activated_names[i] == NULL) {
+                activated_names[i] = "";
+            }
+            (void) fcntl(activated_fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        num_activated = n;
+    }
+
+    (void) unsetenv("LISTEN_PID");
+    (void) unsetenv("LISTEN_FDS");
+    (void) unsetenv("LISTEN_FDNAMES");
+}
+
+/* Use the activated listeners for the configured sockets instead of
+   binding them. A listener is matched by its name, the socket's name or
+   'app.socket', and then a socket no listener is named for takes those
+   listening on its address. Listeners left over are closed. */
+static void
+adopt_activated_sockets(void)
+{
+    int *fds, *taken;
+    bool by_name;
+    int i;
+
+    if (num_activated == 0) {
+        return;
+    }
+
+    fds = calloc(num_activated, sizeof *fds);
+    taken = calloc(num_activated, sizeof *taken);
+    if (fds == NULL || taken == NULL) {
+        log_msg(LOG_ERR, "out of memory adopting activated sockets");
+        exit(EXIT_FAILURE);
+    }
+
+    for (by_name = true;; by_name = false) {
+        for (app = apps; app != NULL; app = app->next) {
+            for (i = 0; i < app->num_fds; i++) {
+                if (app->fds[i].fd_type == SOCKET_FD && app->fds[i].fd == -1) {
+                    (void) adopt_activated_socket(&app->fds[i], by_name, fds, taken);
+                }
+            }
+        }
+        if (!by_name) {
+            break;
+        }
+    }
+
+    for (i = 0; i < num_activated; i++) {
+        if (activated_fds[i] != -1) {
+            log_msg(LOG_INFO, "WARNING: activated socket %d (%s) not used, closing it", activated_fds[i],
+                   activated_names[i]);
+            (void) close(activated_fds[i]);
+        }
+    }
+
+    free(fds);
+    free(taken);
+    free(activated_fds);
+    free(activated_names);
+    free(activated_names_buf);
+    activated_fds = NULL;
+    activated_names = NULL;
+    activated_names_buf = NULL;
+    num_activated = 0;
+}
+
+/* Adopt the activated listeners for 'fd' of the current app, by name or by
+   address. 'fds' and 'taken' have room for all of them. Return true if
+   they were adopted; if they do not match the socket it is bound as usual. */
+static bool
+adopt_activated_socket(struct fd *fd, bool by_name, int *fds, int *taken)
+{
+    char qualified[MAX_APP_NAME + MAX_FD_NAME + 1];
+    const char *name;
+    int j, k, n = 0;
+
+    (void) snprintf(qualified, sizeof qualified, "%s.%s", app->name, fd->name);
+
+    for (k = 0; k < num_activated; k++) {
+        name = activated_names[k];
+        if (activated_fds[k] != -1 &&
+            (by_name ? strcmp(name, fd->name) == 0 || strcmp(name, qualified) == 0 :
+             listener_matches(activated_fds[k], &fd->x.sock))) {
+            taken[n] = k;
+            fds[n++] = activated_fds[k];
+        }
+    }
+
+    if (n == 0) {
+        return false;
+    }
+
+    if (adopt_listener(fd, fds, n) == -1) {
+        log_msg(LOG_INFO, "WARNING: %d activated socket(s) for socket %s of app %s do not match it, binding it",
+               n, fd->name, app->name);
+        return false;
+    }
+
+    for (j = 0; j < n; j++) {
+        activated_fds[taken[j]] = -1;
+    }
+    fd->x.sock.activated = true;
+    log_msg(LOG_INFO, "app %s: socket %s activated by the service manager", app->name, fd->name);
+
+    return true;
+}
+
+/* Return true if 's' is a stream socket listening on the address of
+   'sock', so that it can stand in for a socket created for it. */
+static bool
+listener_matches(int s, const struct fd_socket *sock)
+{
+    struct sockaddr_storage addr;
+    struct sockaddr_in *sin = (struct sockaddr_in *) &addr;
+    struct sockaddr_un *sun = (struct sockaddr_un *) &addr;
+    socklen_t len = sizeof addr;
+    int type, listening, reuseport = 0;
+    socklen_t size = sizeof type;
+
+    if (getsockopt(s, SOL_SOCKET, SO_TYPE, &type, &size) == -1 || type != SOCK_STREAM) {
+        return false;
+    }
+    size = sizeof listening;
+    if (getsockopt(s, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) == -1 || !listening) {
+        return false;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    if (getsockname(s, (struct sockaddr *) &addr, &len) == -1 || addr.ss_family != sock->family) {
+        return false;
+    }
+
+    if (sock->family == AF_UNIX) {
+        return strcmp(sun->sun_path, sock->path) == 0;
+    }
+
+    size = sizeof reuseport;
+    (void) getsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuseport, &size);
+
+    return sin->sin_port == htons(sock->port) && sin->sin_addr.s_addr == sock->addr.s_addr &&
+           (reuseport != 0) == sock->reuseport;
+}
+
+/* Use the 'n' listeners in 'fds', already bound and listening, for 'fd':
+   one per shard with reuseport, otherwise one. They are tuned as
+   configured. Return -1, leaving them alone, if they do not match. */
+static int
+adopt_listener(struct fd *fd, int *fds, int n)
+{
+    int j;
+
+    if (n != (fd->x.sock.reuseport ? app->copies : 1)) {
+        return -1;
+    }
+
+    for (j = 0; j < n; j++) {
+        if (!listener_matches(fds[j], &fd->x.sock)) {
+            return -1;
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        /* Servers inherit them, and expect them not to block. */
+        if (fcntl(fds[j], F_SETFD, 0) == -1 || fcntl(fds[j], F_SETFL, O_NONBLOCK) == -1 ||
+            tune_socket(fds[j], &fd->x.sock) == -1) {
+            log_msg(LOG_INFO, "WARNING: unable to tune socket %s", fd->name);
+        }
+    }
+
+    if (fd->x.sock.reuseport) {
+        fd->x.sock.shards = calloc(n, sizeof *fd->x.sock.shards);
+        if (fd->x.sock.shards == NULL) {
+            log_msg(LOG_ERR, "out of memory allocating shards");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(fd->x.sock.shards, fds, n * sizeof *fds);
+        fd->x.sock.num_shards = n;
+    }
+    fd->fd = fds[0];
+
+    fd->x.sock.queues = calloc(num_queues(&fd->x.sock), sizeof *fd->x.sock.queues);
+    if (fd->x.sock.queues == NULL) {
+        log_msg(LOG_ERR, "out of memory allocating queues");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The steering program stays attached to the reuseport group until
+       create_sockets() replaces it. */
+    if (fd->x.sock.family == AF_UNIX) {
+        (void) set_socket_owner(&fd->x.sock);
+    }
+
+    return 0;
+}
+
+/* Apply the backlog and buffer sizes, which can also be changed on a
+   listening socket. Return -1 on error. */
+static int
+tune_socket(int s, const struct fd_socket *sock)
+{
+    int backlog = sock->backlog;
+
+    /* Buffer sizes set on the listener are inherited by accepted connections. */
+    if (sock->rcvbuf > 0 && set_socket_option(s, SOL_SOCKET, SO_RCVBUF, sock->rcvbuf, "receive buffer") == -1) {
+        return -1;
+    }
+    if (sock->sndbuf > 0 && set_socket_option(s, SOL_SOCKET, SO_SNDBUF, sock->sndbuf, "send buffer") == -1) {
+        return -1;
+    }
+
+    if (sock->family != AF_UNIX) {
+        /* TCP_NODELAY set on the listener is inherited by accepted connections. */
+        if (set_socket_option(s, IPPROTO_TCP, TCP_NODELAY, sock->nodelay, "no-delay") == -1) {
+            return -1;
+        }
+        /* Don't wake a server for a connection until it has sent data. */
+        if (set_socket_option(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, sock->defer_accept, "defer-accept") == -1) {
+            return -1;
+        }
+        /* Allow repeat clients to send data in the SYN. */
+        if (sock->fastopen > 0 &&
+            set_socket_option(s, IPPROTO_TCP, TCP_FASTOPEN, sock->fastopen, "fast-open") == -1) {
+            return -1;
+        }
+    }
+
+    if (backlog == BACKLOG_AUTO) {
+        backlog = auto_backlog();
+    }
+
+    if (listen(s, backlog) != 0) {
+        log_msg(LOG_ERR, "error listening on socket: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bind_inet_socket(int s, const struct fd_socket *sock)
+{
+    int r;
+    struct sockaddr_in sockaddr;
+    const int flags = 1;
+
+    /* Set up socket os that it is a reusable address */
+    r  = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void *)&flags, sizeof flags);
+    if (r != 0) {
+        log_msg(LOG_ERR, "error setting re-use addr option: %m");
+        return -1;
+    }
+
+    if (sock->reuseport) {
+        r = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void *)&flags, sizeof flags);
+        if (r != 0) {
+            log_msg(LOG_ERR, "error setting re-use port option: %m");
+            return -1;
+        }
+    }
+
+    /* Set up the socket address structure */
+    memset(&sockaddr, 0, sizeof sockaddr);
+
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(sock->port);
+    sockaddr.sin_addr = sock->addr;
+
+    r = bind(s, (struct sockaddr *) &sockaddr, sizeof sockaddr);
+
+    if (r != 0) {
+        log_msg(LOG_ERR, "error binding socket: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bind_unix_socket(int s, const struct fd_socket *sock)
+{
+    struct sockaddr_un sockaddr;
+
+    if (remove_stale_unix_socket(sock->path) == -1) {
+        return -1;
+    }
+
+    memset(&sockaddr, 0, sizeof sockaddr);
+    sockaddr.sun_family = AF_UNIX;
+    (void) str_copy(sockaddr.sun_path, sock->path, sizeof sockaddr.sun_path);
+
+    if (bind(s, (struct sockaddr *) &sockaddr, sizeof sockaddr) != 0) {
+        log_msg(LOG_ERR, "error binding unix socket %s: %m", sock->path);
+        return -1;
+    }
+
+    return set_socket_owner(sock);
+}
+
+/* Apply the configured mode and owner to a unix socket's file. */
+static int
+set_socket_owner(const struct fd_socket *sock)
+{
+    if (sock->mode != 0 && chmod(sock->path, sock->mode) != 0) {
+        log_msg(LOG_ERR, "error setting mode of unix socket %s: %m", sock->path);
+        return -1;
+    }
+
+    if (sock->uid != (uid_t) -1 && chown(sock->path, sock->uid, sock->gid) != 0) {
+        log_msg(LOG_ERR, "error setting owner of unix socket %s: %m", sock->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A socket file left behind by a previous niagrad that nobody is listening
+   on any more is removed. A live socket, or anything that isn't a socket, is
+   left alone and is an error. */
+static int
+remove_stale_unix_socket(const char *path)
+{
+    struct stat st;
+    struct sockaddr_un sockaddr;
+    int s, r;
+
+    if (lstat(path, &st) != 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        log_msg(LOG_ERR, "error checking unix socket %s: %m", path);
+        return -1;
+    }
+
+    if (!S_ISSOCK(st.st_mode)) {
+        log_msg(LOG_ERR, "unix socket path %s exists and is not a socket", path);
+        return -1;
+    }
+
+    s = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        log_msg(LOG_ERR, "error creating socket: %m");
+        return -1;
+    }
+
+    memset(&sockaddr, 0, sizeof sockaddr);
+    sockaddr.sun_family = AF_UNIX;
+    (void) str_copy(sockaddr.sun_path, path, sizeof sockaddr.sun_path);
+
+    r = connect(s, (struct sockaddr *) &sockaddr, sizeof sockaddr);
+    (void) close(s);
+
+    if (r == 0) {
+        log_msg(LOG_ERR, "unix socket %s is in use", path);
+        return -1;
+    }
+
+    if (errno != ECONNREFUSED) {
+        log_msg(LOG_ERR, "error checking unix socket %s: %m", path);
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "removing stale unix socket %s", path);
+    if (unlink(path) != 0) {
+        log_msg(LOG_ERR, "error removing stale unix socket %s: %m", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Remove unix socket files when niagrad goes away for good. They are never
+   removed on migration or restart since the listeners stay open. */
+static void
+remove_unix_sockets(void)
+{
+    int i;
+    for (app = apps; app != NULL; app = app->next) {
+        for (i = 0; i < app->num_fds; i++) {
+            struct fd *fd = &app->fds[i];
+            if (fd->fd_type == SOCKET_FD && fd->x.sock.family == AF_UNIX && !fd->x.sock.activated) {
+                (void) unlink(fd->x.sock.path);
+            }
+        }
+    }
+    if (metrics_enabled && metrics_socket.family == AF_UNIX) {
+        (void) unlink(metrics_socket.path);
+    }
+}
+
+/* For each reuseport socket place the server's own shard on the advertised
+   fd number and close all other shards in the child, so the server only
+   ever accepts on its own listen queue. */
+static void
+add_shard_actions(posix_spawn_file_actions_t *actions, int server)
+{
+    int i, j;
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        if (fd->fd_type != SOCKET_FD || !fd->x.sock.reuseport) {
+            continue;
+        }
+        if (server != 0) {
+            (void) posix_spawn_file_actions_adddup2(actions, fd->x.sock.shards[server], fd->fd);
+        }
+        for (j = 1; j < app->copies; j++) {
+            (void) posix_spawn_file_actions_addclose(actions, fd->x.sock.shards[j]);
+        }
+    }
+}
+
+/* Close the listeners and files of the other apps in the child, so that
+   it only holds its own app's, and a listener an app no longer uses is not
+   kept open by the servers of another. */
+static void
+add_other_app_actions(posix_spawn_file_actions_t *actions)
+{
+    struct app *a;
+    int i, j;
+
+    for (a = apps; a != NULL; a = a->next) {
+        if (a == app) {
+            continue;
+        }
+        for (i = 0; i < a->num_fds; i++) {
+            if (a->fds[i].x.sock.reuseport) {
+                for (j = 0; j < a->copies; j++) {
+                    (void) posix_spawn_file_actions_addclose(actions, a->fds[i].x.sock.shards[j]);
+                }
+            } else {
+                (void) posix_spawn_file_actions_addclose(actions, a->fds[i].fd);
+            }
+        }
+        for (i = 0; i < a->num_files; i++) {
+            (void) posix_spawn_file_actions_addclose(actions, a->files[i].fd);
+        }
+    }
+}
+
+static int
+lookup_fd_by_name(const char *name)
+{
+    int i;
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        if (strcmp(name, fd->name) == 0) {
+            break;
+        }
+    }
+
+    if (i == app->num_fds) {
+        i = -1;
+    }
+
+    return i;
+}
+
+static void
+open_files(void)
+{
+    int i;
+    for (i = 0; i < app->num_files; i++) {
+        struct file *file = &app->files[i];
+        if (file->fd != -1) {
+            continue;
+        }
+        file->fd = open(file->name, O_RDONLY);
+        if (file->fd == -1) {
+            log_msg(LOG_ERR, "error opening file %s: %m", file->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static int
+lookup_file_by_key(const char *key)
+{
+    int i;
+    for (i = 0; i < app->num_files; i++) {
+        struct file *file = &app->files[i];
+        if (strcmp(key, file->key) == 0) {
+            break;
+        }
+    }
+
+    if (i == app->num_files) {
+        i = -1;
+    }
+
+    return i;
+}
+
+/* Parse 'none', 'core', 'numa' or a CPU list, optionally with a CPU list
+   restricting the CPUs core and numa placement may use, e.g. 'core 0-15'.
+   Return 0 on success and -1 on error. */
+static int
+parse_affinity(char *str)
+{
+    char *parts[2];
+    int r;
+
+    r = str_split(str, ' ', parts, 2);
+
+    if (strcmp(parts[0], "none") == 0) {
+        app->affinity_mode = AFFINITY_NONE;
+    } else if (strcmp(parts[0], "core") == 0) {
+        app->affinity_mode = AFFINITY_CORE;
+    } else if (strcmp(parts[0], "numa") == 0) {
+        app->affinity_mode = AFFINITY_NUMA;
+    } else if (r == 1 && parse_cpulist(parts[0], &app->affinity_cpus) == 0) {
+        app->affinity_mode = AFFINITY_SET;
+        app->affinity_has_cpus = true;
+        return 0;
+    } else {
+        log_msg(LOG_INFO, "invalid affinity: '%s'", parts[0]);
+        return -1;
+    }
+
+    if (r == 2) {
+        if (app->affinity_mode == AFFINITY_NONE || parse_cpulist(parts[1], &app->affinity_cpus) == -1) {
+            log_msg(LOG_INFO, "invalid affinity cpu list: '%s'", parts[1]);
+            return -1;
+        }
+        app->affinity_has_cpus = true;
+    } else if (r > 2) {
+        log_msg(LOG_INFO, "invalid affinity");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse a kernel style CPU list such as '0-3,8,10-11'. Return 0 on success
+   and -1 on error. */
+static int
+parse_cpulist(const char *str, cpu_set_t *set)
+{
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(set);
+
+    while (*str != '\0' && *str != '\n') {
+        first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        str = end;
+        if (*str == ',') {
+            str++;
+        } else if (*str != '\0' && *str != '\n') {
+            return -1;
+        }
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void
+format_cpulist(const cpu_set_t *set, char *buf, size_t size)
+{
+    int cpu, first;
+    size_t len = 0;
+
+    buf[0] = '\0';
+
+    for (cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        first = cpu;
+        while (cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, set)) {
+            cpu++;
+        }
+        if (first == cpu) {
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", first, cpu);
+        }
+    }
+}
+
+/* Read which of the 'allowed' CPUs belong to which NUMA node. Without
+   NUMA information everything is one node. */
+static void
+read_topology(const cpu_set_t *allowed)
+{
+    char path[MAX_FILE_NAME], line[MAX_LINE_SIZE];
+    cpu_set_t cpus;
+    FILE *f;
+    int node;
+
+    app->num_nodes = 0;
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof path, NODE_DIR "/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (str_readline(f, line, sizeof line) > 0 && parse_cpulist(line, &cpus) == 0) {
+            CPU_AND(&cpus, &cpus, allowed);
+            if (CPU_COUNT(&cpus) > 0) {
+                app->node_ids[app->num_nodes] = node;
+                app->node_cpus[app->num_nodes] = cpus;
+                app->num_nodes++;
+            }
+        }
+        (void) fclose(f);
+    }
+
+    if (app->num_nodes == 0) {
+        app->node_ids[0] = 0;
+        app->node_cpus[0] = *allowed;
+        app->num_nodes = 1;
+    }
+}
+
+/* Work out the CPUs (and NUMA node) for each slot. This is fixed for the
+   life of niagrad, so a slot lands on the same CPUs across respawns and
+   migrations. Slots are dealt out round-robin across NUMA nodes so copies
+   are spread evenly over them. The placements of 'copies' slots are
+   returned in 'result'. Return -1 if none of the configured CPUs are
+   available. */
+static int
+plan_affinity(int copies, struct placement **result)
+{
+    struct placement *placements;
+    cpu_set_t allowed;
+    int *order, *order_node;
+    int i, k, cpu, round, num_cpus = 0;
+    char cpulist[MAX_CPULIST];
+
+    *result = NULL;
+    if (app->affinity_mode == AFFINITY_NONE) {
+        return 0;
+    }
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+        log_msg(LOG_ERR, "error reading cpu affinity: %m");
+        exit(EXIT_FAILURE);
+    }
+    niagrad_cpus = allowed;
+
+    if (app->affinity_has_cpus) {
+        CPU_AND(&allowed, &allowed, &app->affinity_cpus);
+        if (CPU_COUNT(&allowed) == 0) {
+            log_msg(LOG_ERR, "none of the affinity cpus are available");
+            return -1;
+        }
+    }
+
+    placements = calloc(copies, sizeof *placements);
+    order = calloc(CPU_COUNT(&allowed), sizeof *order);
+    order_node = calloc(CPU_COUNT(&allowed), sizeof *order_node);
+    if (placements == NULL || order == NULL || order_node == NULL) {
+        log_msg(LOG_ERR, "out of memory planning affinity");
+        exit(EXIT_FAILURE);
+    }
+
+    read_topology(&allowed);
+
+    /* Interleave the CPUs of each node: n0c0, n1c0, n0c1, n1c1, ... */
+    for (round = 0; num_cpus < CPU_COUNT(&allowed); round++) {
+        for (k = 0; k < app->num_nodes; k++) {
+            for (cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &app->node_cpus[k]) && i++ == round) {
+                    order[num_cpus] = cpu;
+                    order_node[num_cpus] = k;
+                    num_cpus++;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < copies; i++) {
+        struct placement *placement = &placements[i];
+        switch (app->affinity_mode) {
+        case AFFINITY_SET:
+            placement->cpus = allowed;
+            placement->node = -1;
+            break;
+        case AFFINITY_CORE:
+            CPU_ZERO(&placement->cpus);
+            CPU_SET(order[i % num_cpus], &placement->cpus);
+            placement->node = order_node[i % num_cpus];
+            break;
+        case AFFINITY_NUMA:
+            placement->cpus = app->node_cpus[i % app->num_nodes];
+            placement->node = i % app->num_nodes;
+            break;
+        case AFFINITY_NONE:
+            break;
+        }
+        /* Memory placement only matters with more than one node. */
+        if (app->num_nodes == 1) {
+            placement->node = -1;
+        }
+
+        format_cpulist(&placement->cpus, cpulist, sizeof cpulist);
+        log_msg(LOG_INFO, "server %d placed on cpus %s", i, cpulist);
+    }
+
+    free(order);
+    free(order_node);
+
+    *result = placements;
+    return 0;
+}
+
+/* CPU affinity and memory policy are inherited by a spawned child and kept
+   across exec, so niagrad briefly takes on the slot's placement while
+   spawning its server. Failure is logged but not fatal. */
+static void
+enter_placement(int server)
+{
+    struct placement *placement;
+    unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof (unsigned long)) + 1];
+
+    if (app->placements == NULL) {
+        return;
+    }
+
+    placement = &app->placements[server];
+
+    if (sched_setaffinity(0, sizeof placement->cpus, &placement->cpus) != 0) {
+        log_msg(LOG_ERR, "error setting cpu affinity for server %d: %m", server);
+    }
+
+    if (placement->node >= 0) {
+        int node = app->node_ids[placement->node];
+        memset(nodemask, 0, sizeof nodemask);
+        nodemask[node / (8 * sizeof (unsigned long))] |= 1UL << (node % (8 * sizeof (unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES + 1) != 0) {
+            log_msg(LOG_ERR, "error setting memory policy for server %d: %m", server);
+        }
+    }
+}
+
+static void
+leave_placement(int server)
+{
+    if (app->placements == NULL) {
+        return;
+    }
+
+    (void) sched_setaffinity(0, sizeof niagrad_cpus, &niagrad_cpus);
+
+    if (app->placements[server].node >= 0) {
+        (void) syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+}
+
+/* Move an already running process, all of its threads, and its memory onto
+   'server's placement. Used for promoted standbys, which were started
+   before their slot was known. Failure is logged but not fatal. */
+static void
+place_process(pid_t pid, int server)
+{
+    struct placement *placement;
+    char path[MAX_FILE_NAME];
+    struct dirent *entry;
+    DIR *dir;
+
+    if (app->placements == NULL) {
+        return;
+    }
+
+    placement = &app->placements[server];
+
+    (void) snprintf(path, sizeof path, "/proc/%d/task", pid);
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        log_msg(LOG_ERR, "error listing threads of pid %d: %m", pid);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid > 0 && sched_setaffinity(tid, sizeof placement->cpus, &placement->cpus) != 0) {
+            log_msg(LOG_ERR, "error setting cpu affinity of pid %d thread %d: %m", pid, tid);
+        }
+    }
+
+    (void) closedir(dir);
+
+    if (placement->node >= 0) {
+        unsigned long from[MAX_NUMA_NODES / (8 * sizeof (unsigned long)) + 1];
+        unsigned long to[MAX_NUMA_NODES / (8 * sizeof (unsigned long)) + 1];
+        int i, node;
+
+        memset(from, 0, sizeof from);
+        memset(to, 0, sizeof to);
+        for (i = 0; i < app->num_nodes; i++) {
+            node = app->node_ids[i];
+            from[node / (8 * sizeof (unsigned long))] |= 1UL << (node % (8 * sizeof (unsigned long)));
+        }
+        node = app->node_ids[placement->node];
+        to[node / (8 * sizeof (unsigned long))] |= 1UL << (node % (8 * sizeof (unsigned long)));
+
+        if (syscall(SYS_migrate_pages, pid, MAX_NUMA_NODES + 1, from, to) == -1) {
+            log_msg(LOG_ERR, "error migrating memory of pid %d: %m", pid);
+        }
+    }
+}
+
+/* Have the kernel hand each new connection of a reuseport socket to the
+   shard of a slot. With per-slot placement that is a slot running on the
+   CPU that received it; otherwise, and for CPUs with no slot, it is any
+   slot at random. The kernel's own hash is never used, as it would also
+   pick spares. The shard index in the reuseport group is the slot number,
+   since shards are created in slot order and spares keep the rest in place.
+   If the program cannot be attached the spares are closed, and the kernel
+   hashes over the shards as usual.
+
+   Slots are placed round-robin, so the slots sharing a CPU (or a node)
+   are base, base + stride, base + 2 * stride, ... below copies, where base
+   is the lowest of them and stride the number of CPUs (or nodes) in use.
+   Each CPU loads its base into X and jumps to a common tail that picks
+   one of those slots at random, so connections are spread over all of
+   them rather than all going to the first. */
+static void
+attach_steering_program(struct fd *fd)
+{
+    struct sock_filter *code;
+    struct sock_fprog prog;
+    int cpu, i, k, tail, len = 0, num_cpus = 0, stride = 0;
+    int *base_for_cpu;
+
+    base_for_cpu = malloc(CPU_SETSIZE * sizeof *base_for_cpu);
+    code = calloc(3 * CPU_SETSIZE + 14, sizeof *code);
+    if (base_for_cpu == NULL || code == NULL) {
+        log_msg(LOG_ERR, "out of memory building steering program");
+        exit(EXIT_FAILURE);
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        base_for_cpu[cpu] = -1;
+    }
+
+    if (app->affinity_mode == AFFINITY_CORE) {
+        for (i = 0; i < app->copies; i++) {
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &app->placements[i].cpus) && base_for_cpu[cpu] == -1) {
+                    base_for_cpu[cpu] = i;
+                    num_cpus++;
+                    stride++;
+                }
+            }
+        }
+    } else if (app->affinity_mode == AFFINITY_NUMA) {
+        for (k = 0; k < app->num_nodes && k < app->copies; k++) {
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &app->node_cpus[k])) {
+                    base_for_cpu[cpu] = k;
+                    num_cpus++;
+                }
+            }
+            stride++;
+        }
+    }
+
+    tail = 1 + 3 * num_cpus + 3;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (base_for_cpu[cpu] == -1) {
+            continue;
+        }
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 2);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, base_for_cpu[cpu]);
+        code[len] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, tail - len - 1);
+        len++;
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, app->copies);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    /* A base below copies % stride has one slot more than the others. */
+    if (stride > 0) {
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TXA, 0);
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, app->copies % stride, 3, 0);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, app->copies / stride + 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, 2);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, app->copies / stride);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, stride);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+    }
+
+    prog.len = len;
+    prog.filter = code;
+
+    fd->x.sock.steered = (setsockopt(fd->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0);
+    if (!fd->x.sock.steered) {
+        log_msg(LOG_ERR, "WARNING: unable to steer connections for socket %s: %m", fd->name);
+        close_spares(fd);
+    }
+
+    free(code);
+    free(base_for_cpu);
+}
+
+/* Close the spare shards of 'fd', which leave the reuseport group. */
+static void
+close_spares(struct fd *fd)
+{
+    int j;
+
+    for (j = app->copies; j < fd->x.sock.num_shards; j++) {
+        (void) close(fd->x.sock.shards[j]);
+    }
+    fd->x.sock.num_shards = app->copies;
+}
+
+/* Add niagrad's arguments to the configured command and build the argvs.
+   Return -1 if a command line would be too long. */
+static int
+update_command_line(void)
+{
+    static char fd_arg[FD_ARG_LEN], env_arg[ENV_ARG_LEN], file_arg[FILE_ARG_LEN],
+        notify_arg[NOTIFY_ARG_LEN], app_option_arg[APP_OPTION_ARG_LEN];
+    int i, r;
+
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+
+        r = snprintf(fd_arg, sizeof fd_arg, FD_PREFIX "%s,%s,%d", fd->name, fd->type, fd->fd);
+        if (r >= (int)(sizeof fd_arg)) {
+            log_msg(LOG_INFO, "Unable to format fd argument (%d - %zd)", r, sizeof fd_arg);
+            return -1;
+        }
+
+        r = str_concat(app->server_command, fd_arg, sizeof app->server_command);
+
+        if (r == -1) {
+            log_msg(LOG_INFO, "server command buffer too small");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < app->num_files; i++) {
+        struct file *file = &app->files[i];
+
+        r = snprintf(file_arg, sizeof file_arg, FILE_PREFIX "%s,%d", file->key, file->fd);
+        if (r >= (int)(sizeof file_arg)) {
+            log_msg(LOG_INFO, "Unable to format file argument (%d - %zd)", r, sizeof file_arg);
+            return -1;
+        }
+
+        r = str_concat(app->server_command, file_arg, sizeof app->server_command);
+
+        if (r == -1) {
+            log_msg(LOG_INFO, "server command buffer too small");
+            return -1;
+        }
+    }
+
+    r = snprintf(notify_arg, sizeof notify_arg, NOTIFY_PREFIX "%d", notify_fd);
+    if (r >= (int)(sizeof notify_arg) || str_concat(app->server_command, notify_arg, sizeof app->server_command) == -1) {
+        log_msg(LOG_INFO, "server command buffer too small");
+        return -1;
+    }
+
+    for (i = 0; i < app->num_app_options; i++) {
+        struct app_option *app_option = &app->app_options[i];
+
+        r = snprintf(app_option_arg, sizeof app_option_arg, " --%s %s", app_option->name, app_option->value);
+        if (r >= (int)(sizeof app_option_arg)) {
+            log_msg(LOG_INFO, "Unable to format app_option argument (%d - %zd)", r, sizeof app_option_arg);
+            return -1;
+        }
+
+        r = str_concat(app->server_command, app_option_arg, sizeof app->server_command);
+
+        if (r == -1) {
+            log_msg(LOG_INFO, "server command buffer too small");
+            return -1;
+        }
+    }
+
+    if (!str_isempty(app->config_environment)) {
+        r = snprintf(env_arg, sizeof env_arg, ENV_PREFIX "%s", app->config_environment);
+        if (r >= (int)(sizeof env_arg)) {
+            log_msg(LOG_INFO, "Unable to format env argument (%d - %zd)", r, sizeof env_arg);
+            return -1;
+        }
+
+        r = str_concat(app->server_command, env_arg, sizeof app->server_command);
+
+        if (r == -1) {
+            log_msg(LOG_INFO, "server command buffer too small");
+            return -1;
+        }
+    }
+
+    if (app->num_standbys > 0) {
+        int *shards[MAX_FDS];
+        for (i = 0; i < app->num_fds; i++) {
+            struct fd *fd = &app->fds[i];
+            shards[i] = (fd->fd_type == SOCKET_FD && fd->x.sock.reuseport ? fd->x.sock.shards : NULL);
+        }
+        app->standby_command = make_template_command(STANDBY_ARG, app->copies, shards);
+        if (app->standby_command == NULL) {
+            return -1;
+        }
+    }
+
+    build_server_argv();
+
+    return 0;
+}
+
+/* Standbys are told which slot to serve later, so they get
+   'flag' and every shard of the reuseport sockets, given as 'copies'
+   shards per socket in 'shards'. Return NULL if the command line would be
+   too long. */
+static char *
+make_template_command(const char *flag, int copies, int *const *shards)
+{
+    static char shard_arg[SHARD_ARG_LEN];
+    size_t size = sizeof app->server_command + strlen(flag) + (size_t) app->num_fds * copies * SHARD_ARG_LEN;
+    char *command;
+    int i, j, r;
+
+    command = calloc(1, size);
+    if (command == NULL) {
+        log_msg(LOG_ERR, "out of memory building template command");
+        exit(EXIT_FAILURE);
+    }
+
+    (void) str_copy(command, app->server_command, size);
+    r = str_concat(command, flag, size);
+
+    for (i = 0; i < app->num_fds && r != -1; i++) {
+        struct fd *fd = &app->fds[i];
+
+        if (fd->fd_type != SOCKET_FD || !fd->x.sock.reuseport) {
+            continue;
+        }
+
+        for (j = 0; j < copies && r != -1; j++) {
+            r = snprintf(shard_arg, sizeof shard_arg, SHARD_PREFIX "%s,%d,%d", fd->name, j, shards[i][j]);
+            if (r >= (int)(sizeof shard_arg)) {
+                r = -1;
+            } else {
+                r = str_concat(command, shard_arg, size);
+            }
+        }
+    }
+
+    if (r == -1) {
+        log_msg(LOG_INFO, "template command buffer too small");
+        free(command);
+        return NULL;
+    }
+
+    return command;
+}
+
+/* The whole command line is checked, with the arguments niagrad adds, since
+   'app-' options and the environment are passed through the same shell.
+   An '=' in the first word is a variable assignment. */
+static bool
+command_needs_shell(const char *command)
+{
+    const char *c;
+    bool first_word = true;
+
+    for (c = command; *c != '\0'; c++) {
+        if (strchr(SHELL_CHARS, *c) != NULL) {
+            return true;
+        }
+        if (*c == ' ') {
+            first_word = false;
+        } else if (*c == '=' && first_word) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Build the argv used to launch servers, once. Commands that need shell
+   features are run with 'bash -c', everything else is exec'd directly by
+   splitting the command line on spaces, as the shell would have. */
+static void
+build_server_argv(void)
+{
+    app->server_use_shell = command_needs_shell(app->server_command);
+    app->server_argv = make_argv(app->server_command);
+
+    if (app->num_standbys > 0) {
+        app->standby_argv = make_argv(app->standby_command);
+    }
+}
+
+static char **
+make_argv(char *command)
+{
+    int max_args = strlen(command) / 2 + 2;
+    char **argv;
+    char *buf;
+
+    argv = calloc(max_args, sizeof *argv);
+    buf = strdup(command);
+    if (argv == NULL || buf == NULL) {
+        log_msg(LOG_ERR, "out of memory building server arguments");
+        exit(EXIT_FAILURE);
+    }
+
+    if (app->server_use_shell) {
+        free(buf);
+        argv[0] = shell_path;
+        argv[1] = "-c";
+        argv[2] = command;
+        return argv;
+    }
+
+    (void) str_split(buf, ' ', argv, max_args - 1);
+
+    return argv;
+}
+
+static void
+free_argv(char **argv)
+{
+    /* Only a split command line owns its strings. */
+    if (argv != NULL && argv[0] != shell_path) {
+        free(argv[0]);
+    }
+    free(argv);
+}
+
+static void
+restart_servers(void)
+{
+    /* A restart also finishes any migration in progress. */
+    app->migrating = false;
+    timer_stop(&app->migrate_timer);
+
+    app->stat_restart_request_count += 1;
+    app->stat_restart_node_expected_count += app->copies;
+    store_time(app->stat_restart_last_node_expected_time);
+    store_time(app->stat_restart_last_request_time);
+
+    terminate_servers();
+    reset_health();
+    spawn_servers();
+}
+
+/* Spawn the app's servers and start sampling them. */
+static void
+start_app(void)
+{
+    spawn_servers();
+    start_timers();
+}
+
+/* Carry on with an app taken over from the niagrad this one upgraded: its
+   servers are already running, so only what is missing or due is spawned. */
+static void
+resume_app(void)
+{
+    arm_respawn_timer();
+    spawn_servers();
+    start_timers();
+}
+
+static void
+start_timers(void)
+{
+    if (app->sample_interval > 0) {
+        timer_start(&app->sample_timer, app->sample_interval);
+    }
+
+    if (app->queue_interval > 0) {
+        sample_queues(&app->queue_timer);
+    }
+
+    if (app->autoscale) {
+        timer_start(&app->autoscale_timer, AUTOSCALE_INTERVAL);
+    }
+}
+
+/* Take down an app a reload has removed. Its servers are terminated and
+   its listeners and files closed. Its children may still be running, so it
+   is only freed once the last of them has been reaped. */
+static void
+retire_app(void)
+{
+    struct app **p;
+    int i;
+
+    log_msg(LOG_INFO, "removing app %s", app->name);
+
+    terminate_servers();
+
+    timer_stop(&app->drain_poll_timer);
+    timer_stop(&app->sample_timer);
+    timer_stop(&app->queue_timer);
+    timer_stop(&app->autoscale_timer);
+    timer_stop(&app->respawn_timer);
+    timer_stop(&app->migrate_timer);
+
+    for (i = 0; i < app->num_fds; i++) {
+        close_socket(&app->fds[i]);
+        if (app->fds[i].x.sock.family == AF_UNIX && !app->fds[i].x.sock.activated) {
+            (void) unlink(app->fds[i].x.sock.path);
+        }
+    }
+    for (i = 0; i < app->num_files; i++) {
+        (void) close(app->files[i].fd);
+    }
+
+    free_argv(app->server_argv);
+    free_argv(app->standby_argv);
+    free(app->standby_command);
+    free(app->placements);
+
+    for (p = &apps; *p != app; p = &(*p)->next) {
+    }
+    *p = app->next;
+
+    app->removed = true;
+    if (app->num_children == 0) {
+        free_app(app);
+    }
+}
+
+static void
+free_app(struct app *a)
+{
+    free(a->servers);
+    free(a->outgoing_servers);
+    free(a->standbys);
+    free(a->slot_health);
+    free(a);
+}
+
+/* Before niagrad exits. */
+static void
+terminate_apps(void)
+{
+    for (app = apps; app != NULL; app = app->next) {
+        terminate_servers();
+    }
+}
+
+static void
+alloc_servers(void)
+{
+    app->servers = calloc(app->copies, sizeof *app->servers);
+    app->outgoing_servers = calloc(app->copies, sizeof *app->outgoing_servers);
+    app->standbys = calloc(app->num_standbys + 1, sizeof *app->standbys);
+    app->slot_health = calloc(app->copies, sizeof *app->slot_health);
+    if (app->servers == NULL || app->outgoing_servers == NULL || app->standbys == NULL || app->slot_health == NULL) {
+        log_msg(LOG_ERR, "out of memory allocating %d servers", app->copies);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Change the number of copies. Added slots get new servers; the servers of
+   removed slots drain as if migrated. Standbys are given every shard when
+   they start, so they are replaced. Everything that can fail is prepared
+   before any server is touched, so on failure the app is left as it was
+   and -1 is returned with the reason in 'error'. */
+static int
+scale_servers(int n, const char **error)
+{
+    struct placement *placements;
+    struct child *child;
+    char *standby_command = NULL;
+    int *shards[MAX_FDS];
+    int i, old_copies;
+
+    if (app->migrating) {
+        *error = "migration in progress";
+        return -1;
+    }
+
+    if (n == app->copies) {
+        return 0;
+    }
+
+    if (plan_affinity(n, &placements) == -1) {
+        *error = "unable to place servers";
+        return -1;
+    }
+    if (prepare_shards(n, shards) == -1) {
+        free(placements);
+        *error = "unable to open sockets";
+        return -1;
+    }
+    if (app->num_standbys > 0 && (standby_command = make_template_command(STANDBY_ARG, n, shards)) == NULL) {
+        discard_shards(n, shards);
+        free(placements);
+        *error = "command line too long";
+        return -1;
+    }
+
+    log_msg(LOG_INFO, "scaling from %d to %d servers", app->copies, n);
+
+    /* Steer new connections away from removed slots before they drain. */
+    old_copies = app->copies;
+    commit_shards(n, shards);
+    app->copies = n;
+
+    free(app->placements);
+    app->placements = placements;
+
+    for (i = 0; i < app->num_fds; i++) {
+        if (app->fds[i].fd_type == SOCKET_FD && app->fds[i].x.sock.reuseport) {
+            attach_steering_program(&app->fds[i]);
+        }
+    }
+
+    for (i = n; i < old_copies; i++) {
+        complete_migration(i);
+        child = app->servers[i];
+        if (child != NULL) {
+            app->servers[i] = NULL;
+            migrate_server(i, child);
+        }
+    }
+
+    for (i = 0; i < app->num_standbys; i++) {
+        if (app->standbys[i] != NULL) {
+            retire_standby(app->standbys[i]);
+        }
+    }
+
+    resize_servers(old_copies, n);
+
+    if (app->num_standbys > 0) {
+        free_argv(app->standby_argv);
+        free(app->standby_command);
+        app->standby_command = standby_command;
+        app->standby_argv = make_argv(app->standby_command);
+    }
+
+    spawn_servers();
+
+    return 0;
+}
+
+static void
+resize_servers(int from, int n)
+{
+    int i;
+
+    app->servers = realloc(app->servers, n * sizeof *app->servers);
+    app->outgoing_servers = realloc(app->outgoing_servers, n * sizeof *app->outgoing_servers);
+    app->slot_health = realloc(app->slot_health, n * sizeof *app->slot_health);
+    if (app->servers == NULL || app->outgoing_servers == NULL || app->slot_health == NULL) {
+        log_msg(LOG_ERR, "out of memory allocating %d servers", n);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = from; i < n; i++) {
+        app->servers[i] = NULL;
+        app->outgoing_servers[i] = NULL;
+        memset(&app->slot_health[i], 0, sizeof app->slot_health[i]);
+    }
+}
+
+/* Build the shards of each reuseport socket for 'n' slots in 'shards',
+   indexed like app->fds: the current shards and spares, then new sockets
+   for added slots beyond the spares. Return -1, with the new sockets closed
+   again, if one cannot be created. */
+static int
+prepare_shards(int n, int **shards)
+{
+    int i, j, size;
+
+    for (i = 0; i < MAX_FDS; i++) {
+        shards[i] = NULL;
+    }
+
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+
+        if (fd->fd_type != SOCKET_FD || !fd->x.sock.reuseport) {
+            continue;
+        }
+        size = (n > fd->x.sock.num_shards ? n : fd->x.sock.num_shards);
+        shards[i] = malloc(size * sizeof *shards[i]);
+        if (shards[i] == NULL) {
+            log_msg(LOG_ERR, "out of memory allocating shards");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < size; j++) {
+            shards[i][j] = (j < fd->x.sock.num_shards ? fd->x.sock.shards[j] : -1);
+        }
+        for (j = fd->x.sock.num_shards; j < n; j++) {
+            shards[i][j] = create_socket(&fd->x.sock);
+            if (shards[i][j] == -1) {
+                discard_shards(n, shards);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Undo prepare_shards(), closing the new sockets. */
+static void
+discard_shards(int n, int **shards)
+{
+    int i, j;
+
+    for (i = 0; i < app->num_fds; i++) {
+        if (shards[i] == NULL) {
+            continue;
+        }
+        for (j = app->fds[i].x.sock.num_shards; j < n && shards[i][j] != -1; j++) {
+            (void) close(shards[i][j]);
+        }
+        free(shards[i]);
+        shards[i] = NULL;
+    }
+}
+
+/* Install the shards from prepare_shards(). The shards of removed slots
+   become spares of a steered socket, and are closed otherwise; their
+   draining servers keep their own copies until they exit. */
+static void
+commit_shards(int n, int **shards)
+{
+    int i, j;
+
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd *fd = &app->fds[i];
+        if (shards[i] == NULL) {
+            continue;
+        }
+        for (j = n; j < app->copies; j++) {
+            if (fd->x.sock.steered) {
+                (void) fcntl(shards[i][j], F_SETFD, FD_CLOEXEC);
+            } else {
+                (void) close(shards[i][j]);
+            }
+        }
+        for (j = app->copies; j < n && j < fd->x.sock.num_shards; j++) {
+            (void) fcntl(shards[i][j], F_SETFD, 0);
+        }
+        if (fd->x.sock.steered) {
+            fd->x.sock.num_shards = (n > fd->x.sock.num_shards ? n : fd->x.sock.num_shards);
+        } else {
+            fd->x.sock.num_shards = n;
+        }
+        free(fd->x.sock.shards);
+        fd->x.sock.shards = shards[i];
+        fd->x.sock.queues = realloc(fd->x.sock.queues, n * sizeof *fd->x.sock.queues);
+        if (fd->x.sock.queues == NULL) {
+            log_msg(LOG_ERR, "out of memory allocating shards");
+            exit(EXIT_FAILURE);
+        }
+        for (j = app->copies; j < n; j++) {
+            memset(&fd->x.sock.queues[j], 0, sizeof fd->x.sock.queues[j]);
+        }
+    }
+}
+
+/* Track a migrated server until it exits, escalating to SIGTERM and then
+   SIGKILL if it is still running at its drain deadline. */
+static void
+start_draining(struct child *child)
+{
+    app->stat_draining_node_count += 1;
+
+    child->role = CHILD_DRAINING;
+    child->drain_start = event_now();
+    child->drain_signals = 0;
+    child->connections = -1;
+    child->drain_timer.handler = drain_deadline;
+    child->drain_timer.data = child;
+    child->drain_next = app->draining_servers;
+    app->draining_servers = child;
+
+    if (app->drain_timeout > 0) {
+        timer_start(&child->drain_timer, app->drain_timeout);
+    }
+
+    if (!timer_armed(&app->drain_poll_timer)) {
+        timer_start(&app->drain_poll_timer, DRAIN_POLL_INTERVAL);
+    }
+}
+
+/* A draining server has exited, or is being terminated. */
+static void
+stop_draining(struct child *child)
+{
+    struct child **p;
+
+    for (p = &app->draining_servers; *p != NULL; p = &(*p)->drain_next) {
+        if (*p == child) {
+            *p = child->drain_next;
+            break;
+        }
+    }
+
+    app->stat_draining_node_count -= 1;
+    store_time(app->stat_migrate_last_node_time);
+    timer_stop(&child->drain_timer);
+    child->drain_next = NULL;
+}
+
+static void
+drain_deadline(struct timer *t)
+{
+    struct child *child = t->data;
+    int sig = (child->drain_signals == 0 ? SIGTERM : SIGKILL);
+
+    app = child->app;
+
+    log_msg(LOG_INFO, "old server %d (pid %d) still draining %d connections after %llu ms, sending %s",
+           child->slot, child->pid, child->connections, (unsigned long long) (event_now() - child->drain_start),
+           (sig == SIGTERM ? "SIGTERM" : "SIGKILL"));
+
+    if (kill(child->pid, sig) != 0) {
+        log_msg(LOG_ERR, "couldn't kill old server %d (pid %d): %m", child->slot, child->pid);
+    }
+
+    child->drain_signals += 1;
+
+    if (sig == SIGTERM) {
+        timer_start(&child->drain_timer, app->drain_kill_timeout);
+    }
+}
+
+static void
+terminate_draining_servers(void)
+{
+    struct child *child;
+
+    while ((child = app->draining_servers) != NULL) {
+        log_msg(LOG_INFO, "old server %d (pid %d) going down", child->slot, child->pid);
+        stop_draining(child);
+        child->role = CHILD_DETACHED;
+        if (kill(child->pid, SIGTERM) != 0) {
+            log_msg(LOG_ERR, "couldn't kill old server %d (pid %d): %m", child->slot, child->pid);
+        }
+    }
+}
+
+/* Periodically count the connections each draining server still has. */
+static void
+drain_poll(struct timer *t)
+{
+    struct child *child;
+
+    app = t->data;
+
+    if (app->draining_servers == NULL) {
+        return;
+    }
+
+    count_connections();
+
+    for (child = app->draining_servers; child != NULL; child = child->drain_next) {
+        child->connections = child_connections(child->pid);
+    }
+
+    timer_start(&app->drain_poll_timer, DRAIN_POLL_INTERVAL);
+}
+
+/* Sample the resource usage of every live, outgoing and draining server. */
+static void
+sample_usage(struct timer *t)
+{
+    struct child *child;
+    int i;
+
+    app = t->data;
+
+    for (i = 0; i < app->copies; i++) {
+        if (app->servers[i] != NULL) {
+            sample_child(app->servers[i]);
+        }
+        if (app->outgoing_servers[i] != NULL) {
+            sample_child(app->outgoing_servers[i]);
+        }
+    }
+
+    for (child = app->draining_servers; child != NULL; child = child->drain_next) {
+        sample_child(child);
+    }
+
+    timer_start(&app->sample_timer, app->sample_interval);
+}
+
+static void
+sample_child(struct child *child)
+{
+    struct usage_sample *sample = &child->samples[child->next_sample];
+    const struct usage_sample *last = latest_sample(child);
+
+    /* It may have exited, and not been reaped yet. */
+    if (proc_usage(child->pid, &sample->usage) == -1) {
+        return;
+    }
+
+    sample->time = event_now();
+    sample->cpu_percent = 0;
+    if (last != NULL && sample->time > last->time) {
+        sample->cpu_percent = 100.0 * (int64_t) (sample->usage.cpu_ms - last->usage.cpu_ms) /
+                              (sample->time - last->time);
+    }
+
+    child->next_sample = (child->next_sample + 1) % USAGE_HISTORY;
+    if (child->num_samples < USAGE_HISTORY) {
+        child->num_samples++;
+    }
+}
+
+static const struct usage_sample *
+latest_sample(const struct child *child)
+{
+    if (child == NULL || child->num_samples == 0) {
+        return NULL;
+    }
 
-            r = inet_aton(socket_parts[3], &fd->x.sock.addr);
-            if (r == 0) {
-                syslog(LOG_INFO, "invalid network address");
-                n = -1;
-                break;
-            }
+    return &child->samples[(child->next_sample + USAGE_HISTORY - 1) % USAGE_HISTORY];
+}
 
-            r = str_uint16(socket_parts[4], &fd->x.sock.port);
-            if (r == -1) {
-                syslog(LOG_INFO, "invalid port number");
-                n = -1;
-                break;
-            }
+static void
+output_sample(struct json *j, const struct usage_sample *sample)
+{
+    json_double(j, "cpu_percent", sample->cpu_percent);
+    json_int(j, "rss_kb", sample->usage.rss_kb);
+    json_int(j, "pss_kb", sample->usage.pss_kb);
+    json_int(j, "fds", sample->usage.fds);
+    json_int(j, "threads", sample->usage.threads);
+}
 
-            r = str_int(socket_parts[5], &fd->x.sock.backlog);
-            if (r == -1) {
-                syslog(LOG_INFO, "invalid backlog");
-                n = -1;
-                break;
-            }
+/* The latest sample, and the history oldest first. */
+static void
+output_usage(struct json *j, const struct child *child)
+{
+    const struct usage_sample *sample = latest_sample(child);
+    int i;
 
-            fd->fd_type = SOCKET_FD;
+    if (sample == NULL) {
+        return;
+    }
 
-            num_fds++;
+    json_object_begin(j, "usage");
+    output_sample(j, sample);
+    json_array_begin(j, "history");
+    for (i = 0; i < child->num_samples; i++) {
+        sample = &child->samples[(child->next_sample - child->num_samples + i + USAGE_HISTORY) % USAGE_HISTORY];
+        json_object_begin(j, NULL);
+        json_int(j, "age_ms", event_now() - sample->time);
+        output_sample(j, sample);
+        json_object_end(j);
+    }
+    json_array_end(j);
+    json_object_end(j);
+}
 
-        } else if (strcmp(command_value[0], "user") == 0) {
-            syslog(LOG_INFO, "WARNING: Got user command: %s - not implemented", command_value[1]);
+/* Sample the accept queue of every listener, and the host's counters of
+   connections dropped because an accept queue was full. */
+static void
+sample_queues(struct timer *t)
+{
+    struct listen_queue queue;
+    int i, k, total;
 
-        } else if (strcmp(command_value[0], "environment") == 0) {
+    app = t->data;
 
-            if (!str_isempty(config_environment)) {
-                syslog(LOG_INFO, "environment already set.");
-                n = -1;
-                break;
+    for (i = 0; i < app->num_fds; i++) {
+        struct fd_socket *sock = &app->fds[i].x.sock;
+        if (app->fds[i].fd_type != SOCKET_FD) {
+            continue;
+        }
+        total = 0;
+        for (k = 0; k < num_queues(sock); k++) {
+            struct queue_stats *stats = &sock->queues[k];
+            if (listen_queue(sock->reuseport ? sock->shards[k] : app->fds[i].fd, &queue) == -1) {
+                continue;
+            }
+            stats->length = queue.length;
+            stats->limit = queue.limit;
+            if (queue.limit > 0 && 100.0 * queue.length / queue.limit > app->queue_window_percent) {
+                app->queue_window_percent = 100.0 * queue.length / queue.limit;
             }
+            if (queue.length > stats->high_water) {
+                stats->high_water = queue.length;
+            }
+            total += queue.length;
+        }
+        if (total > sock->queue_high_water) {
+            sock->queue_high_water = total;
+        }
+    }
 
-            r = str_copy(config_environment, command_value[1], sizeof config_environment);
+    if (listen_drops(&listen_overflows, &listen_drops_count) == 0 && !listen_baseline_taken) {
+        listen_overflows_start = listen_overflows;
+        listen_drops_start = listen_drops_count;
+        listen_baseline_taken = true;
+    }
 
-            if (r == -1) {
-                syslog(LOG_INFO, "environment too long.");
-                n = -1;
-                break;
-            }
+    timer_start(&app->queue_timer, app->queue_interval);
+}
 
-        } else if (strcmp(command_value[0], "copies") == 0) {
-            int c = atoi(command_value[1]);
-            if (c <= 0) {
-                syslog(LOG_INFO, "WARNING: Got invalid copies command: '%s', defaulting to 1",
-                       command_value[1]);
-            } else if (c > MAX_COPIES) {
-                syslog(LOG_INFO, "WARNING: copies command %d exceeds maximum of %d: defaulting to %d", c,
-                       MAX_COPIES, MAX_COPIES);
-                copies = MAX_COPIES;
-            } else {
-                copies = c;
-            }
+/* A reuseport socket has a queue per shard. */
+static int
+num_queues(const struct fd_socket *sock)
+{
+    return sock->reuseport ? app->copies : 1;
+}
 
-        } else if (strncmp(command_value[0], "app-", 4) == 0) {
-            struct app_option *app_option;
+static void
+output_queues(struct json *j, const struct fd_socket *sock)
+{
+    int k, length = 0, limit = 0;
 
-            if (num_app_options >= MAX_APP_OPTIONS) {
-                syslog(LOG_INFO, "Too many app options defined. A maximum of %d is allowed", MAX_APP_OPTIONS);
-                n = -1;
-                break;
-            }
+    for (k = 0; k < num_queues(sock); k++) {
+        length += sock->queues[k].length;
+        limit += sock->queues[k].limit;
+    }
 
-            app_option = &app_options[num_app_options];
+    json_object_begin(j, "queue");
+    json_int(j, "length", length);
+    json_int(j, "limit", limit);
+    json_int(j, "high_water", sock->queue_high_water);
+    if (sock->reuseport) {
+        json_array_begin(j, "shards");
+        for (k = 0; k < num_queues(sock); k++) {
+            json_object_begin(j, NULL);
+            json_int(j, "length", sock->queues[k].length);
+            json_int(j, "limit", sock->queues[k].limit);
+            json_int(j, "high_water", sock->queues[k].high_water);
+            json_object_end(j);
+        }
+        json_array_end(j);
+    }
+    json_object_end(j);
+}
 
-            r = str_copy(app_option->name, command_value[0], sizeof app_option->name);
-            if (r == -1) {
-                syslog(LOG_INFO, "app option name too long");
-                n = -1;
-                break;
-            }
+/* Parse 'copies: min..max'. Either end takes any value 'copies' does. */
+static int
+parse_copies_range(char *str)
+{
+    char *dots = strstr(str, "..");
 
-            r = str_copy(app_option->value, command_value[1], sizeof app_option->value);
-            if (r == -1) {
-                syslog(LOG_INFO, "app option value too long");
-                n = -1;
-                break;
-            }
+    *dots = '\0';
+
+    if (parse_copies(str, &app->copies_min) == -1 || parse_copies(dots + 2, &app->copies_max) == -1 ||
+        app->copies_min > app->copies_max) {
+        return -1;
+    }
 
-            num_app_options++;
+    app->autoscale = true;
+    app->copies = app->copies_min;
 
-        } else {
-            /* Invalid command */
-            syslog(LOG_INFO, "Invalid command: '%s'", command_value[0]);
-            n = -1;
-            break;
-        }
+    return 0;
+}
+
+/* Parse 'autoscale-cpu: low high', in percent of one CPU per server. */
+static int
+parse_autoscale_cpu(char *str)
+{
+    char *parts[2];
+
+    if (str_split(str, ' ', parts, 2) != 2 || str_int(parts[0], &app->autoscale_cpu_low) == -1 ||
+        str_int(parts[1], &app->autoscale_cpu_high) == -1 || app->autoscale_cpu_low < 0 ||
+        app->autoscale_cpu_low >= app->autoscale_cpu_high) {
+        return -1;
     }
 
-    if (n != 0) {
-        syslog(LOG_INFO, "Error on line: %d", i);
-        exit(EXIT_FAILURE);
+    return 0;
+}
+
+/* Average CPU use of the live servers from their latest samples, or -1
+   if none has been sampled yet. */
+static double
+average_cpu(void)
+{
+    const struct usage_sample *sample;
+    double total = 0;
+    int i, n = 0;
+
+    for (i = 0; i < app->copies; i++) {
+        sample = latest_sample(app->servers[i]);
+        if (sample != NULL) {
+            total += sample->cpu_percent;
+            n++;
+        }
     }
 
-    /* if there is an error on close, we don't care */
-    (void) fclose(f);
+    return n == 0 ? -1 : total / n;
 }
 
+/* Scale up when the servers are busy or connections queue up, and down
+   when they are mostly idle and nothing queues. A condition must hold for
+   several checks in a row, and after scaling nothing changes again until
+   the cooldown has passed. Scaling down drains servers like a migration. */
 static void
-create_sockets(void) {
-    int i;
-    for (i = 0; i < num_fds; i++) {
-        struct fd *fd = &fds[i];
-        if (fd->fd_type != SOCKET_FD) {
-            continue;
+autoscale_check(struct timer *t)
+{
+    const char *error;
+    double cpu, queue;
+    int n;
+    bool up;
+
+    app = t->data;
+    cpu = average_cpu();
+    queue = app->queue_window_percent;
+    n = app->copies;
+
+    app->queue_window_percent = 0;
+    timer_start(&app->autoscale_timer, AUTOSCALE_INTERVAL);
+
+    if (cpu >= app->autoscale_cpu_high || queue >= AUTOSCALE_QUEUE_PERCENT) {
+        app->autoscale_busy_checks++;
+        app->autoscale_idle_checks = 0;
+    } else if (cpu >= 0 && cpu < app->autoscale_cpu_low && queue == 0 &&
+               cpu * app->copies / (app->copies > 1 ? app->copies - 1 : 1) < app->autoscale_cpu_high) {
+        app->autoscale_idle_checks++;
+        app->autoscale_busy_checks = 0;
+    } else {
+        app->autoscale_busy_checks = 0;
+        app->autoscale_idle_checks = 0;
+    }
+
+    if (app->migrating ||
+        (app->autoscale_last != 0 && event_now() - app->autoscale_last < (uint64_t) app->autoscale_cooldown)) {
+        return;
+    }
+
+    if (app->autoscale_busy_checks >= AUTOSCALE_UP_CHECKS && app->copies < app->copies_max) {
+        /* Grow by a quarter to absorb bursts quickly. */
+        n = app->copies + (app->copies / 4 > 1 ? app->copies / 4 : 1);
+        if (n > app->copies_max) {
+            n = app->copies_max;
         }
-        fd->fd = create_socket(fd->x.sock.addr, fd->x.sock.port, fd->x.sock.backlog);
+    } else if (app->autoscale_idle_checks >= AUTOSCALE_DOWN_CHECKS && app->copies > app->copies_min) {
+        n = app->copies - 1;
+    }
+
+    if (n == app->copies) {
+        return;
+    }
+
+    log_msg(LOG_INFO, "autoscale: cpu %.0f%%, queue %.0f%% of limit, scaling from %d to %d servers",
+           cpu, queue, app->copies, n);
+
+    up = (n > app->copies);
+
+    if (scale_servers(n, &error) == -1) {
+        log_msg(LOG_ERR, "autoscale: unable to scale to %d servers: %s", n, error);
+        return;
+    }
+
+    if (up) {
+        app->stat_autoscale_up_count += 1;
+    } else {
+        app->stat_autoscale_down_count += 1;
     }
+
+    app->autoscale_last = event_now();
+    app->autoscale_busy_checks = 0;
+    app->autoscale_idle_checks = 0;
 }
 
+/* Parse 'respawn-backoff: initial max', in milliseconds. */
 static int
-create_socket(struct in_addr addr, uint16_t port, int backlog)
+parse_backoff(char *str)
 {
-    int s;
-    int r;
-    struct sockaddr_in sockaddr;
-    const int flags = 1;
+    char *parts[2];
 
-    /* create, bind and listen on the socket */
-    s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (str_split(str, ' ', parts, 2) != 2 || str_int(parts[0], &app->backoff_initial) == -1 ||
+        str_int(parts[1], &app->backoff_max) == -1 || app->backoff_initial <= 0 || app->backoff_max < app->backoff_initial) {
+        return -1;
+    }
 
-    if (s == -1) {
-        /* FIXME: look at errno and provide better error handling */
-        syslog(LOG_ERR, "error creating socket: %m");
-        exit(EXIT_FAILURE);
+    return 0;
+}
+
+/* Parse 'crash-loop: failures [backoff|stop]'. */
+static int
+parse_crash_loop(char *str)
+{
+    char *parts[2];
+    int n;
+
+    n = str_split(str, ' ', parts, 2);
+    if (n < 1 || str_int(parts[0], &app->crash_loop_failures) == -1 || app->crash_loop_failures < 1) {
+        return -1;
     }
 
-    /* Set up socket os that it is a reusable address */
-    r  = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void *)&flags, sizeof flags);
-    if (r != 0) {
-        syslog(LOG_ERR, "error setting re-use addr option: %m");
-        exit(EXIT_FAILURE);
+    if (n == 1 || strcmp(parts[1], "backoff") == 0) {
+        app->crash_loop_policy = CRASH_LOOP_BACKOFF;
+    } else if (strcmp(parts[1], "stop") == 0) {
+        app->crash_loop_policy = CRASH_LOOP_STOP;
+    } else {
+        return -1;
     }
 
-    /* Ensure the socket is non-blocking like node expects */
-    r = fcntl(s, F_SETFL, O_NONBLOCK);
-    if (r == -1) {
-        syslog(LOG_ERR, "error setting non-blocking: %m");
-        exit(EXIT_FAILURE);
+    return 0;
+}
+
+/* Count a failure and schedule the next attempt. Return false if the
+   crash loop policy stops respawning instead. */
+static bool
+backoff(struct slot_health *health)
+{
+    health->failures += 1;
+
+    if (health->failures == app->crash_loop_failures) {
+        app->stat_crash_loop_count += 1;
     }
 
-    /* Set up the socket address structure */
-    memset(&sockaddr, 0, sizeof sockaddr);
+    if (health->failures >= app->crash_loop_failures && app->crash_loop_policy == CRASH_LOOP_STOP) {
+        health->stopped = true;
+        return false;
+    }
 
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_port = htons(port);
-    sockaddr.sin_addr = addr;
+    health->respawn_at = event_now() + backoff_delay(health->failures);
+    arm_respawn_timer();
 
-    r = bind(s, (struct sockaddr *) &sockaddr, sizeof sockaddr);
+    return true;
+}
 
-    if (r != 0) {
-        syslog(LOG_ERR, "error binding socket: %m");
-        exit(EXIT_FAILURE);
+/* The first failure is retried straight away, later ones after doubling
+   delays with jitter. */
+static uint64_t
+backoff_delay(int failures)
+{
+    uint64_t delay = app->backoff_initial;
+    int i;
+
+    if (failures <= 1) {
+        return 0;
     }
 
-    r = listen(s, backlog);
+    for (i = 2; i < failures && delay < (uint64_t) app->backoff_max; i++) {
+        delay *= 2;
+    }
+    if (delay > (uint64_t) app->backoff_max) {
+        delay = app->backoff_max;
+    }
 
-    if (r != 0) {
-        syslog(LOG_ERR, "error listening on socket: %m");
-        exit(EXIT_FAILURE);
+    return delay / 2 + random() % (delay / 2 + 1);
+}
+
+/* The server of 'server' exited after 'uptime' milliseconds, or could not
+   be spawned. The other slots and the listeners are not affected. */
+static void
+server_failed(int server, uint64_t uptime)
+{
+    struct slot_health *health = &app->slot_health[server];
+
+    if (uptime >= BACKOFF_RESET) {
+        health->failures = 0;
     }
 
-    return s;
+    if (!backoff(health)) {
+        log_msg(LOG_ERR, "server %d crash looping after %d failures, not respawning until restarted or migrated",
+               server, health->failures);
+        return;
+    }
+
+    if (health->failures == app->crash_loop_failures) {
+        log_msg(LOG_ERR, "server %d crash looping after %d failures", server, health->failures);
+    }
+    log_msg(LOG_ERR, "server %d respawning in %llu ms", server,
+           (unsigned long long) (health->respawn_at - event_now()));
+}
+
+/* A standby exited before it was promoted, or could not be spawned. It
+   has recovered once a standby reports ready. */
+static void
+standby_failed(void)
+{
+    if (!backoff(&app->standby_health)) {
+        log_msg(LOG_ERR, "standbys crash looping after %d failures, not respawning until restarted or migrated",
+               app->standby_health.failures);
+        return;
+    }
+
+    log_msg(LOG_ERR, "standbys respawning in %llu ms",
+           (unsigned long long) (app->standby_health.respawn_at - event_now()));
+}
+
+/* One timer serves the earliest respawn due. */
+static void
+arm_respawn_timer(void)
+{
+    uint64_t at = app->standby_health.respawn_at;
+    uint64_t now = event_now();
+    int i;
+
+    for (i = 0; i < app->copies; i++) {
+        if (app->slot_health[i].respawn_at != 0 && (at == 0 || app->slot_health[i].respawn_at < at)) {
+            at = app->slot_health[i].respawn_at;
+        }
+    }
+
+    if (at == 0) {
+        timer_stop(&app->respawn_timer);
+    } else {
+        timer_start(&app->respawn_timer, at > now ? at - now : 0);
+    }
 }
 
+static void
+respawn_due(struct timer *t)
+{
+    uint64_t now = event_now();
+    int i;
+
+    app = t->data;
+
+    for (i = 0; i < app->copies; i++) {
+        if (app->slot_health[i].respawn_at == 0 || app->slot_health[i].respawn_at > now) {
+            continue;
+        }
+        app->slot_health[i].respawn_at = 0;
+        /* A failed replacement leaves the old server in the slot. */
+        if (app->servers[i] == NULL) {
+            log_msg(LOG_INFO, "server %d respawning", i);
+            spawn_server(i);
+        }
+    }
+
+    if (app->standby_health.respawn_at != 0 && app->standby_health.respawn_at <= now) {
+        app->standby_health.respawn_at = 0;
+        fill_standbys();
+    }
+
+    arm_respawn_timer();
+}
+
+/* A restart or migration gives every slot a fresh start. */
+static void
+reset_health(void)
+{
+    memset(app->slot_health, 0, app->copies * sizeof *app->slot_health);
+    memset(&app->standby_health, 0, sizeof app->standby_health);
+    timer_stop(&app->respawn_timer);
+}
+
+/* Failures in a row, not counting those before a server which has since
+   run long enough to have recovered. */
 static int
-lookup_fd_by_name(const char *name)
+slot_failures(int server)
+{
+    if (app->servers[server] != NULL && event_now() - app->servers[server]->spawn_time >= BACKOFF_RESET) {
+        return 0;
+    }
+
+    return app->slot_health[server].failures;
+}
+
+static const char *
+slot_state_name(int server)
+{
+    bool looping = slot_failures(server) >= app->crash_loop_failures;
+
+    if (app->servers[server] != NULL) {
+        return looping ? "crash-loop" : "running";
+    }
+    if (app->slot_health[server].stopped) {
+        return "stopped";
+    }
+    if (app->slot_health[server].respawn_at != 0) {
+        return looping ? "crash-loop" : "backoff";
+    }
+
+    return "empty";
+}
+
+/* Collect the inodes of all connections accepted on our listeners: TCP
+   sockets on a listening port, and connected unix sockets bound to a
+   listening path. sock_diag is asked once per listener and poll, rather
+   than once per server, and only returns the app's own TCP connections. */
+static void
+count_connections(void)
 {
     int i;
-    for (i = 0; i < num_fds; i++) {
-        struct fd *fd = &fds[i];
-        if (strcmp(name, fd->name) == 0) {
-            break;
+
+    num_connection_inodes = 0;
+
+    for (i = 0; i < app->num_fds; i++) {
+        if (app->fds[i].fd_type == SOCKET_FD && app->fds[i].fd != -1 &&
+            listen_connections(app->fds[i].fd, add_connection) == -1) {
+            log_msg(LOG_ERR, "error counting connections of socket %s: %m", app->fds[i].name);
+        }
+    }
+
+    qsort(connection_inodes, num_connection_inodes, sizeof *connection_inodes, compare_inodes);
+}
+
+static void
+add_connection(unsigned long inode)
+{
+    if (num_connection_inodes == max_connection_inodes) {
+        size_t size = (max_connection_inodes == 0 ? 1024 : max_connection_inodes * 2);
+        unsigned long *inodes = realloc(connection_inodes, size * sizeof *inodes);
+        if (inodes == NULL) {
+            log_msg(LOG_ERR, "out of memory counting connections");
+            return;
+        }
+        connection_inodes = inodes;
+        max_connection_inodes = size;
+    }
+
+    connection_inodes[num_connection_inodes++] = inode;
+}
+
+static int
+compare_inodes(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Count how many of the connections found by count_connections() 'pid'
+   has open. Return -1 if its fds cannot be read. */
+static int
+child_connections(pid_t pid)
+{
+    char path[MAX_FILE_NAME], link[64];
+    struct dirent *entry;
+    unsigned long inode;
+    int count = 0;
+    ssize_t n;
+    DIR *dir;
+
+    (void) snprintf(path, sizeof path, "/proc/%d/fd", pid);
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        (void) snprintf(path, sizeof path, "/proc/%d/fd/%s", pid, entry->d_name);
+
+        n = readlink(path, link, sizeof link - 1);
+        if (n <= 0) {
+            continue;
+        }
+        link[n] = '\0';
+
+        if (sscanf(link, "socket:[%lu]", &inode) == 1 &&
+            bsearch(&inode, connection_inodes, num_connection_inodes, sizeof inode, compare_inodes) != NULL) {
+            count++;
         }
     }
 
-    if (i == num_fds) {
-        i = -1;
-    }
+    (void) closedir(dir);
 
-    return i;
+    return count;
 }
 
+/* Send sigusr2 to old server.
+   Server handles sigusr2, finishes handling all existing connections, and closes. */
 static void
-open_files(void)
+migrate_server(int server, struct child *child)
 {
-    int i;
-    for (i = 0; i < num_files; i++) {
-        struct file *file = &files[i];
-        file->fd = open(file->name, O_RDONLY);
-        if (file->fd == -1) {
-            syslog(LOG_ERR, "error opening file %s: %m", file->name);
-            exit(EXIT_FAILURE);
-        }
+    int r;
+    log_msg(LOG_INFO, "migrating old server %d (pid %d)", server, child->pid);
+
+    app->stat_migrate_node_count += 1;
+
+    start_draining(child);
+
+    r = kill(child->pid, SIGUSR2);
+    if (r != 0) {
+        log_msg(LOG_ERR, "couldn't migrate old server %d (pid %d): %m", server, child->pid);
     }
 }
 
-static int
-lookup_file_by_key(const char *key)
+/* Replace the server in 'server' with a new one. The old server is only
+   signalled once the new one is ready, so there is always one server
+   accepting on the slot. */
+static void
+migrate_slot(int server)
 {
-    int i;
-    for (i = 0; i < num_files; i++) {
-        struct file *file = &files[i];
-        if (strcmp(key, file->key) == 0) {
-            break;
-        }
-    }
+    struct child *child = app->servers[server];
 
-    if (i == num_files) {
-        i = -1;
+    if (child != NULL) {
+        child->role = CHILD_OUTGOING;
+        app->outgoing_servers[server] = child;
     }
 
-    return i;
+    spawn_server(server);
+
+    if (app->servers[server] == NULL) {
+        cancel_migration(server);
+    } else if (app->ready_timeout == 0) {
+        complete_migration(server);
+    }
 }
 
 static void
-update_command_line(void)
+migrate_servers(void)
 {
-    static char fd_arg[FD_ARG_LEN], env_arg[ENV_ARG_LEN], file_arg[FILE_ARG_LEN],
-        app_option_arg[APP_OPTION_ARG_LEN];
-    int i, r;
-
-    for (i = 0; i < num_fds; i++) {
-        struct fd *fd = &fds[i];
+    int i;
 
-        r = snprintf(fd_arg, sizeof fd_arg, FD_PREFIX "%s,%s,%d", fd->name, fd->type, fd->fd);
-        if (r >= (int)(sizeof fd_arg)) {
-            syslog(LOG_INFO, "Unable to format fd argument (%d - %zd)", r, sizeof fd_arg);
-            exit(EXIT_FAILURE);
-        }
+    log_msg(LOG_INFO, "migrating all servers");
 
-        r = str_concat(server_command, fd_arg, sizeof server_command);
+    app->stat_migrate_request_count += 1;
+    store_time(app->stat_migrate_last_request_time);
 
-        if (r == -1) {
-            syslog(LOG_INFO, "server command buffer too small");
-            exit(EXIT_FAILURE);
-        }
+    /* A previous migration still waiting on a slot is now two generations
+       behind; its old server goes straight away and the slot is migrated
+       again in this one. */
+    for (i = 0; i < app->copies; i++) {
+        complete_migration(i);
     }
 
-    for (i = 0; i < num_files; i++) {
-        struct file *file = &files[i];
+    /* The new code may not crash, so every slot starts afresh. */
+    reset_health();
 
-        r = snprintf(file_arg, sizeof file_arg, FILE_PREFIX "%s,%d", file->key, file->fd);
-        if (r >= (int)(sizeof file_arg)) {
-            syslog(LOG_INFO, "Unable to format file argument (%d - %zd)", r, sizeof file_arg);
-            exit(EXIT_FAILURE);
-        }
+    app->generation += 1;
+    app->migrating = true;
+    timer_stop(&app->migrate_timer);
 
-        r = str_concat(server_command, file_arg, sizeof server_command);
+    retire_stale_standbys();
+    fill_standbys();
 
-        if (r == -1) {
-            syslog(LOG_INFO, "server command buffer too small");
-            exit(EXIT_FAILURE);
-        }
+    migrate_next_batch();
+}
+
+/* Parse 'n' or 'n%'. */
+static int
+parse_migrate_batch(const char *str)
+{
+    char value[INT_STRING_LEN];
+    size_t len = strlen(str);
+
+    if (len == 0 || str_copy(value, str, sizeof value) == -1) {
+        return -1;
     }
 
-    for (i = 0; i < num_app_options; i++) {
-        struct app_option *app_option = &app_options[i];
+    app->migrate_batch_percent = (value[len - 1] == '%');
+    if (app->migrate_batch_percent) {
+        value[len - 1] = '\0';
+    }
 
-        r = snprintf(app_option_arg, sizeof app_option_arg, " --%s %s", app_option->name, app_option->value);
-        if (r >= (int)(sizeof app_option_arg)) {
-            syslog(LOG_INFO, "Unable to format app_option argument (%d - %zd)", r, sizeof app_option_arg);
-            exit(EXIT_FAILURE);
-        }
+    if (str_int(value, &app->migrate_batch) == -1 || app->migrate_batch < 0 ||
+        (app->migrate_batch_percent && (app->migrate_batch == 0 || app->migrate_batch > 100))) {
+        return -1;
+    }
 
-        r = str_concat(server_command, app_option_arg, sizeof server_command);
+    return 0;
+}
 
-        if (r == -1) {
-            syslog(LOG_INFO, "server command buffer too small");
-            exit(EXIT_FAILURE);
-        }
+static int
+migrate_batch_size(void)
+{
+    int n;
+
+    if (app->migrate_batch == 0) {
+        return app->copies;
     }
 
-    if (!str_isempty(config_environment)) {
-        r = snprintf(env_arg, sizeof env_arg, ENV_PREFIX "%s", config_environment);
-        if (r >= (int)(sizeof env_arg)) {
-            syslog(LOG_INFO, "Unable to format env argument (%d - %zd)", r, sizeof env_arg);
-            exit(EXIT_FAILURE);
-        }
+    n = app->migrate_batch_percent ? app->copies * app->migrate_batch / 100 : app->migrate_batch;
 
-        r = str_concat(server_command, env_arg, sizeof server_command);
+    return n < 1 ? 1 : n;
+}
 
-        if (r == -1) {
-            syslog(LOG_INFO, "server command buffer too small");
-            exit(EXIT_FAILURE);
+/* An empty slot waiting out its backoff, or stopped, is left to the respawn
+   timer rather than migrated. */
+static bool
+slot_held(int server)
+{
+    return app->servers[server] == NULL &&
+           (app->slot_health[server].respawn_at != 0 || app->slot_health[server].stopped);
+}
+
+/* Start migrating the next wave of slots not yet at the current generation. */
+static void
+migrate_next_batch(void)
+{
+    int i, n, started = 0;
+
+    n = migrate_batch_size();
+
+    for (i = 0; i < app->copies && started < n; i++) {
+        if (app->servers[i] != NULL && app->servers[i]->generation == app->generation) {
+            continue;
         }
+        if (slot_held(i)) {
+            continue;
+        }
+        migrate_slot(i);
+        started++;
     }
 
+    log_msg(LOG_INFO, "migrating a batch of %d servers", started);
+
+    migration_progress();
 }
 
 static void
-restart_servers(void)
+migrate_pause_expired(struct timer *t)
 {
-    stat_restart_request_count += 1;
-    stat_restart_node_expected_count += copies;
-    store_time(stat_restart_last_node_expected_time);
-    store_time(stat_restart_last_request_time);
-
-    terminate_servers();
-    spawn_servers();
+    app = t->data;
+    migrate_next_batch();
 }
 
-/* Find the backlog server identified by pid and clear it.
-   It is not an error if it can't be found: it's likely that it was a final backlogged
-   server that was force-killed. */
+/* Called whenever a server becomes ready or exits. Once the current wave is
+   up, the next one is started after the configured pause. */
 static void
-clear_backlog_server(pid_t pid)
+migration_progress(void)
 {
-    int i, j;
-    for (j = 0; j < MAX_MIGRATE_BACKLOG; j++) {
-        for (i = 0; i < copies; i++) {
-            if (backlog_servers[j][i] == pid) {
-                stat_backlog_node_count -= 1;
-                store_time(stat_migrate_last_node_time);
-                backlog_servers[j][i] = 0;
-                break;
+    int i, remaining = 0;
+
+    if (!app->migrating || timer_armed(&app->migrate_timer)) {
+        return;
+    }
+
+    for (i = 0; i < app->copies; i++) {
+        if (app->outgoing_servers[i] != NULL) {
+            return;
+        }
+        if (app->servers[i] != NULL && app->servers[i]->generation == app->generation) {
+            if (app->ready_timeout > 0 && app->servers[i]->readiness == READY_PENDING) {
+                return;
             }
+        } else if (!slot_held(i)) {
+            remaining++;
         }
     }
+
+    if (remaining == 0) {
+        app->migrating = false;
+        log_msg(LOG_INFO, "completed migrating all servers");
+    } else if (app->migrate_pause > 0) {
+        timer_start(&app->migrate_timer, app->migrate_pause);
+    } else {
+        migrate_next_batch();
+    }
 }
 
+/* The slot's new server is ready (or timed out): migrate the old one. */
 static void
-set_backlog_server(int server, pid_t pid)
+complete_migration(int server)
 {
-    stat_backlog_node_count += 1;
-    backlog_servers[0][server] = pid;
+    struct child *child = app->outgoing_servers[server];
+
+    if (child == NULL) {
+        return;
+    }
+
+    app->outgoing_servers[server] = NULL;
+    migrate_server(server, child);
 }
 
-/* Terminate all final backlogged servers. */
+/* The slot's new server could not be started: the old one stays live. */
 static void
-terminate_backlog_servers(int backlog_index)
+cancel_migration(int server)
 {
-    int i, r;
-    pid_t pid;
-    pid_t *dead_servers = backlog_servers[backlog_index];
+    struct child *child = app->outgoing_servers[server];
 
-    for (i = 0; i < copies; i++) {
+    if (child == NULL) {
+        return;
+    }
 
-        pid = dead_servers[i];
+    log_msg(LOG_ERR, "server %d (pid %d) kept, its replacement failed", server, child->pid);
 
-        if (pid != NO_PID) {
-            stat_backlog_node_count -= 1;
+    app->outgoing_servers[server] = NULL;
+    child->role = CHILD_LIVE;
+    /* Counts as migrated, so a rolling migration does not retry it. */
+    child->generation = app->generation;
+    app->servers[server] = child;
+}
 
-            syslog(LOG_INFO, "old server %d (pid %d) at backlog position %d going down", i, pid,
-                   backlog_index);
+static void
+terminate_server(int server)
+{
+    struct child *child = app->servers[server];
+    pid_t pid = child->pid;
 
-            r = kill(pid, SIGTERM);
+    log_msg(LOG_INFO, "server %d (pid %d) going down", server, pid);
 
-            if (r != 0) {
-                syslog(LOG_ERR, "couldn't kill old server %d (pid %d) at backlog position %d: %m", i,
-                       pid, backlog_index);
-            } else {
-                syslog(LOG_INFO, "old server %d (pid %d) at backlog position %d successfully terminated",
-                       i, pid, backlog_index);
-            }
-        }
+    app->servers[server] = NULL;
+    child->role = CHILD_DETACHED;
+
+    int r;
+    r = kill(pid, SIGTERM);
 
-        dead_servers[i] = NO_PID;
+    if (r != 0) {
+        log_msg(LOG_ERR, "couldn't kill server %d (pid %d): %m", server, pid);
+    } else {
+        log_msg(LOG_INFO, "server %d (pid %d) successfully terminated", server, pid);
     }
 }
 
-/* Shift all remaining backlog servers. */
 static void
-shift_backlog_servers(void)
+terminate_servers(void)
 {
-    int i, j;
-    for (j = MAX_MIGRATE_BACKLOG - 1; j > 0; j--) {
-        for (i = 0; i < copies; i++) {
-            backlog_servers[j][i] = backlog_servers[j-1][i];
+    log_msg(LOG_INFO, "all servers going down");
+
+    int i;
+    for (i = 0; i < app->copies; i++) {
+        if (app->servers[i] != NULL) {
+            terminate_server(i);
+        }
+        if (app->outgoing_servers[i] != NULL) {
+            log_msg(LOG_INFO, "outgoing server %d (pid %d) going down", i, app->outgoing_servers[i]->pid);
+            app->outgoing_servers[i]->role = CHILD_DETACHED;
+            if (kill(app->outgoing_servers[i]->pid, SIGTERM) != 0) {
+                log_msg(LOG_ERR, "couldn't kill outgoing server %d (pid %d): %m", i, app->outgoing_servers[i]->pid);
+            }
+            app->outgoing_servers[i] = NULL;
+        }
+    }
+
+    terminate_draining_servers();
+
+    for (i = 0; i < app->num_standbys; i++) {
+        if (app->standbys[i] != NULL) {
+            retire_standby(app->standbys[i]);
         }
     }
+
+    log_msg(LOG_INFO, "completed terminating all servers");
 }
 
-/* Send sigusr2 to old server identified by pid.
-   Server handles sigusr2, finishes handling all existing connections, and closes. */
-static void
-migrate_server(int server, pid_t pid)
+/* Launch a server with posix_spawn, which avoids copying niagrad's page
+   tables the way fork() would. A server of -1 launches a standby, which
+   has no slot yet. Return the pid, or -1 with errno set. */
+static pid_t
+launch_server(int server, char **argv, int notify)
 {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    pid_t pid;
     int r;
-    syslog(LOG_INFO, "migrating old server %d (pid %d)", server, pid);
 
-    stat_migrate_node_count += 1;
+    (void) posix_spawn_file_actions_init(&actions);
+    add_other_app_actions(&actions);
+    if (server != -1) {
+        add_shard_actions(&actions, server);
+    }
+    (void) posix_spawn_file_actions_adddup2(&actions, notify, notify_fd);
+
+    /* The child must not inherit niagrad's blocked signals. */
+    sigemptyset(&no_signals);
+    (void) posix_spawnattr_init(&attr);
+    (void) posix_spawnattr_setsigmask(&attr, &no_signals);
+    (void) posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    if (server != -1) {
+        enter_placement(server);
+    }
+    r = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    if (server != -1) {
+        leave_placement(server);
+    }
 
-    /* Add to front backlog. */
-    set_backlog_server(server, pid);
+    (void) posix_spawnattr_destroy(&attr);
+    (void) posix_spawn_file_actions_destroy(&actions);
 
-    r = kill(pid, SIGUSR2);
     if (r != 0) {
-        syslog(LOG_ERR, "couldn't migrate old server %d (pid %d): %m", server, pid);
+        errno = r;
+        return -1;
     }
+
+    return pid;
 }
 
 static void
-migrate_servers(void)
+spawn_server(int server)
 {
-    int i;
+    struct child *child;
+    int notify[2];
     pid_t pid;
 
-    syslog(LOG_INFO, "migrating all servers");
+    child = take_standby();
+    if (child != NULL && promote_standby(child, server)) {
+        fill_standbys();
+        return;
+    }
+
+    log_msg(LOG_INFO, "spawning server %d with command: '%s'", server, app->server_command);
 
-    stat_migrate_request_count += 1;
-    store_time(stat_migrate_last_request_time);
+    if (open_notify_socket(notify) == -1) {
+        log_msg(LOG_ERR, "error creating notify socket for server %d: %m", server);
+        app->servers[server] = NULL;
+        server_failed(server, 0);
+        return;
+    }
 
-    /* Kill last backlog servers and shift all remaining backlog servers. */
-    terminate_backlog_servers(MAX_MIGRATE_BACKLOG - 1);
-    shift_backlog_servers();
+    pid = launch_server(server, app->server_argv, notify[1]);
 
-    /* Spawn the new server and migrate the old server to front of backlog. */
-    for (i = 0; i < copies; i++) {
-        pid = servers[i];
-        spawn_server(i);
-        if (pid != NO_PID) {
-            migrate_server(i, pid);
+    (void) close(notify[1]);
+
+    if (pid == -1) {
+        /* Exec failures are reported here rather than as an exit status. */
+        log_msg(LOG_ERR, "error spawning server %d: %m", server);
+        (void) close(notify[0]);
+        app->servers[server] = NULL;
+        server_failed(server, 0);
+    } else {
+        log_msg(LOG_INFO, "server %d (pid %d) spawned", server, pid);
+        app->servers[server] = add_child(pid, server);
+        app->servers[server]->generation = app->generation;
+        watch_child(app->servers[server]);
+        watch_notify(app->servers[server], notify[0]);
+    }
+}
+
+/* Spawn a server for every empty slot which is not backing off. */
+static void
+spawn_servers(void)
+{
+    int i;
+    for (i = 0; i < app->copies; i++) {
+        if (app->servers[i] == NULL && app->slot_health[i].respawn_at == 0 && !app->slot_health[i].stopped) {
+            spawn_server(i);
         }
     }
 
-    syslog(LOG_INFO, "completed migrating all servers");
+    fill_standbys();
 }
 
 static void
-terminate_server(int server)
+spawn_standby(int index)
 {
-    pid_t pid = servers[server];
+    struct child *child;
+    int notify[2];
+    pid_t pid;
 
-    syslog(LOG_INFO, "server %d (pid %d) going down", server, pid);
+    if (open_notify_socket(notify) == -1) {
+        log_msg(LOG_ERR, "error creating notify socket for standby %d: %m", index);
+        standby_failed();
+        return;
+    }
 
-    servers[server] = NO_PID;
+    pid = launch_server(-1, app->standby_argv, notify[1]);
 
-    int r;
-    r = kill(pid, SIGTERM);
+    (void) close(notify[1]);
 
-    if (r != 0) {
-        syslog(LOG_ERR, "couldn't kill server %d (pid %d): %m", server, pid);
-    } else {
-        syslog(LOG_INFO, "server %d (pid %d) successfully terminated", server, pid);
+    if (pid == -1) {
+        log_msg(LOG_ERR, "error spawning standby %d: %m", index);
+        (void) close(notify[0]);
+        standby_failed();
+        return;
     }
+
+    log_msg(LOG_INFO, "standby %d (pid %d) spawned", index, pid);
+
+    child = add_child(pid, index);
+    child->role = CHILD_STANDBY;
+    child->generation = app->generation;
+    watch_child(child);
+    watch_notify(child, notify[0]);
+    app->standbys[index] = child;
 }
 
+/* Top the standby pool back up, unless standbys are failing. */
 static void
-terminate_servers(void)
+fill_standbys(void)
 {
-    syslog(LOG_INFO, "all servers going down");
-
     int i;
-    for (i = 0; i < copies; i++) {
-        if (servers[i] != NO_PID) {
-            terminate_server(i);
+
+    for (i = 0; i < app->num_standbys; i++) {
+        if (app->standby_health.respawn_at != 0 || app->standby_health.stopped) {
+            return;
+        }
+        if (app->standbys[i] == NULL) {
+            spawn_standby(i);
         }
     }
+}
+
+/* Return a standby which has finished starting up for the current
+   generation, or NULL. */
+static struct child *
+take_standby(void)
+{
+    int i;
 
-    for (i = 0; i < MAX_MIGRATE_BACKLOG; i++) {
-        terminate_backlog_servers(i);
+    for (i = 0; i < app->num_standbys; i++) {
+        struct child *child = app->standbys[i];
+        if (child != NULL && child->readiness == READY_OK && child->generation == app->generation &&
+            child->notify_ev.fd != -1) {
+            return child;
+        }
     }
 
-    syslog(LOG_INFO, "completed terminating all servers");
+    return NULL;
 }
 
-static void
-spawn_server(int server)
+/* Tell a standby to start accepting on 'server's sockets. From here on it
+   is a live server which reports ready again once it is listening. */
+static bool
+promote_standby(struct child *child, int server)
 {
-    pid_t pid;
+    char message[MAX_NOTIFY_MESSAGE];
+    int n;
 
-    /* if we spawn too quickly, just exit */
-    struct timeval new_time;
-    (void) gettimeofday(&new_time, NULL);
-    if (fast_spawn_protect && new_time.tv_sec == last_spawn_time.tv_sec) {
-        syslog(LOG_ERR, "Spawning too fast!");
-        exit(EXIT_FAILURE);
+    n = snprintf(message, sizeof message, "start %d\n", server);
+
+    if (send(child->notify_ev.fd, message, n, MSG_NOSIGNAL) != n) {
+        log_msg(LOG_ERR, "couldn't promote standby (pid %d): %m", child->pid);
+        retire_standby(child);
+        return false;
     }
-    last_spawn_time = new_time;
 
-    pid = fork();
+    log_msg(LOG_INFO, "standby %d (pid %d) promoted to server %d", child->slot, child->pid, server);
 
-    if (pid == 0) {
-        /* Child process */
-        syslog(LOG_INFO, "spawning server %d with command: '%s'", server, server_command);
-        (void) execl("/bin/bash", "/bin/bash", "-c", server_command, NULL);
+    app->standbys[child->slot] = NULL;
 
-        syslog(LOG_ERR, "execl: %m");
-        exit(EXIT_FAILURE);
-    } else {
-        /* Parent process, cache child pid */
-        syslog(LOG_INFO, "server %d (pid %d) spawned", server, pid);
-        servers[server] = pid;
+    child->role = CHILD_LIVE;
+    child->slot = server;
+    child->readiness = READY_PENDING;
+    child->spawn_time = event_now();
+    if (app->ready_timeout > 0) {
+        timer_start(&child->ready_timer, app->ready_timeout);
     }
+
+    place_process(child->pid, server);
+
+    app->servers[server] = child;
+
+    return true;
 }
 
 static void
-spawn_servers(void)
+retire_standby(struct child *child)
+{
+    log_msg(LOG_INFO, "standby %d (pid %d) going down", child->slot, child->pid);
+
+    app->standbys[child->slot] = NULL;
+    child->role = CHILD_DETACHED;
+    timer_stop(&child->ready_timer);
+    close_notify(child);
+
+    if (kill(child->pid, SIGTERM) != 0) {
+        log_msg(LOG_ERR, "couldn't kill standby (pid %d): %m", child->pid);
+    }
+}
+
+/* Standbys started before a migration run the old code. */
+static void
+retire_stale_standbys(void)
 {
     int i;
-    for (i = 0; i < copies; i++) {
-        spawn_server(i);
+
+    for (i = 0; i < app->num_standbys; i++) {
+        if (app->standbys[i] != NULL && app->standbys[i]->generation != app->generation) {
+            retire_standby(app->standbys[i]);
+        }
     }
 }
 
-static int
-find_server(pid_t pid) {
-    int i, found = -1;
-    for (i = 0; i < copies; i++) {
-        if (servers[i] == pid) {
-            found = i;
+static unsigned
+child_hash(pid_t pid)
+{
+    return (unsigned) pid % CHILD_TABLE_SIZE;
+}
+
+static struct child *
+find_child(pid_t pid)
+{
+    struct child *child;
+    for (child = child_table[child_hash(pid)]; child != NULL; child = child->hash_next) {
+        if (child->pid == pid) {
             break;
         }
     }
-    return found;
+    return child;
 }
 
-static void
-output_state(pid_t caller)
+/* Track a newly spawned live server of the current app. */
+static struct child *
+add_child(pid_t pid, int server)
 {
-    FILE *state_file;
-    char state_filename[MAX_FILE_NAME];
-    int r, i, j;
+    struct child *child = calloc(1, sizeof *child);
+    unsigned h = child_hash(pid);
 
-    stat_state_request_count += 1;
+    if (child == NULL) {
+        log_msg(LOG_ERR, "out of memory tracking pid %d", pid);
+        exit(EXIT_FAILURE);
+    }
 
-    sprintf(state_filename, "%s/niagra-%d-%d.state", STATE_DIR, niagra_pid, caller);
-
-    syslog(LOG_INFO, "state outputting to %s", state_filename);
-
-    state_file = fopen(state_filename, "w");
-
-    fprintf(state_file, "{\n");
-
-    fprintf(state_file, "\"%s\": \"%d\",\n", "pid", niagra_pid);
-    fprintf(state_file, "\"%s\": \"%s\",\n", "start_time", stat_start_time);
-    fprintf(state_file, "\"%s\": \"%s\",\n", "mode", (debug_mode ? "debug" : "production"));
-    fprintf(state_file, "\"%s\": \"%s\",\n", "respawn", (no_respawn ? "no" : "yes"));
-    fprintf(state_file, "\"%s\": \"%s\",\n", "config", config_file_name);
-    fprintf(state_file, "\"%s\": \"%s\",\n", "log", config_logfile);
-    fprintf(state_file, "\"%s\": \"%d\",\n", "copies", copies);
-    fprintf(state_file, "\"%s\": \"%s\",\n", "command", server_command);
-    fprintf(state_file, "\"%s\": \"%s\",\n", "environment", config_environment);
-
-    fprintf(state_file, "\"%s\": {\n", "sockets");
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "count", num_fds);
-    fprintf(state_file, "\t\"%s\": [\n", "details");
-    for (i = 0; i < num_fds; i++) {
-        fprintf(state_file, "\t\t{\n");
-        fprintf(state_file, "\t\t\"%s\": \"%s\",\n", "name", fds[i].name);
-        fprintf(state_file, "\t\t\"%s\": \"%d\",\n", "ipver", fds[i].x.sock.ip_ver);
-        fprintf(state_file, "\t\t\"%s\": \"%s\",\n", "addr", inet_ntoa(fds[i].x.sock.addr));
-        fprintf(state_file, "\t\t\"%s\": \"%i\",\n", "port", fds[i].x.sock.port);
-        fprintf(state_file, "\t\t\"%s\": \"%i\",\n", "backlog", fds[i].x.sock.backlog);
-        fprintf(state_file, "\t\t},\n");
-    }
-    fprintf(state_file, "\t]\n");
-    fprintf(state_file, "},\n");
-
-    fprintf(state_file, "\"%s\": {\n", "nodes");
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "count", copies);
-    fprintf(state_file, "\t\"%s\": [", "pids");
-    for (i = 0, r = 0; i < copies; i++) {
-        if (servers[i] != NO_PID) {
-            if (r == 1) {
-                fprintf(state_file, ", ");
-            }
-            r = 1;
-            fprintf(state_file, "%d", servers[i]);
-        }
-    }
-    fprintf(state_file, "],\n");
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "backlog_count", stat_backlog_node_count);
-    fprintf(state_file, "\t\"%s\": [", "backlog_pids");
-    for (i = 0, r = 0; i < MAX_MIGRATE_BACKLOG; i++) {
-        for (j = 0; j < copies; j++) {
-            if (backlog_servers[i][j] != NO_PID) {
-                if (r == 1) {
-                    fprintf(state_file, ", ");
-                }
-                r = 1;
-                fprintf(state_file, "%d", backlog_servers[i][j]);
-            }
+    child->app = app;
+    child->pid = pid;
+    child->slot = server;
+    child->role = CHILD_LIVE;
+    child->ev.fd = -1;
+    child->notify_ev.fd = -1;
+    child->hash_next = child_table[h];
+    child_table[h] = child;
+    app->num_children += 1;
+
+    return child;
+}
+
+/* Forget a child that has been reaped. */
+static void
+remove_child(struct child *child)
+{
+    struct child **p;
+
+    for (p = &child_table[child_hash(child->pid)]; *p != NULL; p = &(*p)->hash_next) {
+        if (*p == child) {
+            *p = child->hash_next;
+            break;
         }
     }
-    fprintf(state_file, "]\n");
-    fprintf(state_file, "},\n");
 
+    if (child->ev.fd != -1) {
+        (void) event_del(&child->ev);
+        (void) close(child->ev.fd);
+    }
 
-    fprintf(state_file, "\"%s\": {\n", "migrations");
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "requests", stat_migrate_request_count);
-    fprintf(state_file, "\t\"%s\": \"%s\",\n", "last_request_time", stat_migrate_last_request_time);
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "nodes_requested", stat_migrate_node_count);
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "nodes_completed", stat_migrate_node_count - stat_backlog_node_count);
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "nodes_uncompleted", stat_backlog_node_count);
-    fprintf(state_file, "\t\"%s\": \"%s\"\n", "last_node_time", stat_migrate_last_node_time);
-    fprintf(state_file, "},\n");
+    timer_stop(&child->ready_timer);
+    timer_stop(&child->drain_timer);
+    close_notify(child);
 
+    child->app->num_children -= 1;
+    free(child);
+}
 
-    fprintf(state_file, "\"%s\": {\n", "restarts");
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "requests", stat_restart_request_count);
-    fprintf(state_file, "\t\"%s\": \"%s\",\n", "last_request_time", stat_restart_last_request_time);
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "nodes_expected", stat_restart_node_expected_count);
-    fprintf(state_file, "\t\"%s\": \"%s\",\n", "last_node_expected_time", stat_restart_last_node_expected_time);
-    fprintf(state_file, "\t\"%s\": \"%d\",\n", "nodes_unexpected", stat_restart_node_unexpected_count);
-    fprintf(state_file, "\t\"%s\": \"%s\"\n", "last_node_unexpected_time", stat_restart_last_node_unexpected_time);
-    fprintf(state_file, "},\n");
+static const char *
+readiness_name(enum readiness readiness)
+{
+    switch (readiness) {
+    case READY_OK:
+        return "ready";
+    case READY_TIMEOUT:
+        return "ready timeout";
+    case READY_PENDING:
+    default:
+        return "starting";
+    }
+}
 
+static const char *
+affinity_mode_name(void)
+{
+    switch (app->affinity_mode) {
+    case AFFINITY_SET:
+        return "set";
+    case AFFINITY_CORE:
+        return "core";
+    case AFFINITY_NUMA:
+        return "numa";
+    case AFFINITY_NONE:
+    default:
+        return "none";
+    }
+}
 
-    fprintf(state_file, "}\n");
+static const char *
+log_sink_name(void)
+{
+    switch (log_sink) {
+    case LOG_SINK_STDERR:
+        return "stderr";
+    case LOG_SINK_FILE:
+        return "file";
+    case LOG_SINK_SYSLOG:
+    default:
+        return "syslog";
+    }
+}
 
-    fclose(state_file);
+static void
+output_state(FILE *f, const struct app *only)
+{
+    struct json j;
+    char cpulist[MAX_CPULIST];
+    struct child *child;
+    int r, i;
 
-    syslog(LOG_INFO, "state outputted to %s, signalling caller %d", state_filename, caller);
+    stat_state_request_count += 1;
 
-    r = kill(caller, SIGUSR2);
+    json_init(&j, f);
+    json_object_begin(&j, NULL);
+
+    json_int(&j, "pid", niagra_pid);
+    json_string(&j, "start_time", stat_start_time);
+    json_string(&j, "mode", (debug_mode ? "debug" : "production"));
+    json_bool(&j, "respawn", !no_respawn);
+    json_string(&j, "config", config_file_name);
+    json_string(&j, "log", config_logfile);
+    json_string(&j, "control", control_path);
+    json_object_begin(&j, "reload");
+    json_int(&j, "count", stat_reload_count);
+    json_int(&j, "failed", stat_reload_failed_count);
+    json_string(&j, "last_time", stat_reload_last_time);
+    json_object_end(&j);
+    json_object_begin(&j, "logger");
+    json_string(&j, "sink", log_sink_name());
+    json_int(&j, "written", log_written());
+    json_int(&j, "dropped", log_dropped());
+    json_object_end(&j);
+    json_object_begin(&j, "upgrade");
+    json_int(&j, "count", stat_upgrade_count);
+    json_string(&j, "last_time", stat_upgrade_last_time);
+    json_object_end(&j);
+    json_array_begin(&j, "apps");
+    for (app = apps; app != NULL; app = app->next) {
+        if (only != NULL && app != only) {
+            continue;
+        }
+        json_object_begin(&j, NULL);
+        json_string(&j, "name", app->name);
+        json_int(&j, "copies", app->copies);
+        if (app->autoscale) {
+            json_object_begin(&j, "autoscale");
+            json_int(&j, "min", app->copies_min);
+            json_int(&j, "max", app->copies_max);
+            json_int(&j, "cpu_low", app->autoscale_cpu_low);
+            json_int(&j, "cpu_high", app->autoscale_cpu_high);
+            json_int(&j, "cooldown", app->autoscale_cooldown);
+            json_int(&j, "busy_checks", app->autoscale_busy_checks);
+            json_int(&j, "idle_checks", app->autoscale_idle_checks);
+            json_int(&j, "scaled_up", app->stat_autoscale_up_count);
+            json_int(&j, "scaled_down", app->stat_autoscale_down_count);
+            if (app->autoscale_last != 0) {
+                json_int(&j, "last_scale_ms", event_now() - app->autoscale_last);
+            }
+            json_object_end(&j);
+        }
+        json_string(&j, "affinity", affinity_mode_name());
+        json_string(&j, "command", app->server_command);
+        json_string(&j, "exec", (app->server_use_shell ? "shell" : "direct"));
+        json_string(&j, "environment", app->config_environment);
+        json_int(&j, "sample_interval", app->sample_interval);
+        json_object_begin(&j, "crash_loop");
+        json_int(&j, "failures", app->crash_loop_failures);
+        json_string(&j, "policy", app->crash_loop_policy == CRASH_LOOP_STOP ? "stop" : "backoff");
+        json_int(&j, "backoff_initial", app->backoff_initial);
+        json_int(&j, "backoff_max", app->backoff_max);
+        json_int(&j, "count", app->stat_crash_loop_count);
+        json_object_end(&j);
+
+        json_object_begin(&j, "sockets");
+        json_int(&j, "count", app->num_fds);
+        json_array_begin(&j, "details");
+        for (i = 0; i < app->num_fds; i++) {
+            json_object_begin(&j, NULL);
+            json_string(&j, "name", app->fds[i].name);
+            if (app->fds[i].x.sock.family == AF_UNIX) {
+                json_string(&j, "ipver", "unix");
+                json_string(&j, "path", app->fds[i].x.sock.path);
+            } else {
+                json_int(&j, "ipver", app->fds[i].x.sock.ip_ver);
+                json_string(&j, "addr", inet_ntoa(app->fds[i].x.sock.addr));
+                json_int(&j, "port", app->fds[i].x.sock.port);
+            }
+            if (app->fds[i].x.sock.backlog == BACKLOG_AUTO) {
+                json_string(&j, "backlog", "auto");
+            } else {
+                json_int(&j, "backlog", app->fds[i].x.sock.backlog);
+            }
+            json_bool(&j, "reuseport", app->fds[i].x.sock.reuseport);
+            json_bool(&j, "activated", app->fds[i].x.sock.activated);
+            json_bool(&j, "nodelay", app->fds[i].x.sock.nodelay);
+            json_int(&j, "defer_accept", app->fds[i].x.sock.defer_accept);
+            json_int(&j, "fastopen", app->fds[i].x.sock.fastopen);
+            json_int(&j, "rcvbuf", app->fds[i].x.sock.rcvbuf);
+            json_int(&j, "sndbuf", app->fds[i].x.sock.sndbuf);
+            output_queues(&j, &app->fds[i].x.sock);
+            json_object_end(&j);
+        }
+        json_array_end(&j);
+        json_int(&j, "listen_overflows", listen_overflows - listen_overflows_start);
+        json_int(&j, "listen_drops", listen_drops_count - listen_drops_start);
+        json_object_end(&j);
+
+        json_object_begin(&j, "nodes");
+        json_int(&j, "count", app->copies);
+        json_array_begin(&j, "pids");
+        for (i = 0; i < app->copies; i++) {
+            if (app->servers[i] != NULL) {
+                json_int(&j, NULL, app->servers[i]->pid);
+            }
+        }
+        json_array_end(&j);
+        json_array_begin(&j, "slots");
+        for (i = 0; i < app->copies; i++) {
+            json_object_begin(&j, NULL);
+            json_int(&j, "slot", i);
+            json_int(&j, "pid", app->servers[i] != NULL ? app->servers[i]->pid : 0);
+            json_string(&j, "state", slot_state_name(i));
+            json_int(&j, "failures", slot_failures(i));
+            if (app->servers[i] == NULL && app->slot_health[i].respawn_at != 0) {
+                json_int(&j, "respawn_in_ms", app->slot_health[i].respawn_at > event_now() ?
+                         app->slot_health[i].respawn_at - event_now() : 0);
+            }
+            if (app->servers[i] != NULL) {
+                json_string(&j, "status", readiness_name(app->servers[i]->readiness));
+                if (app->servers[i]->readiness == READY_OK) {
+                    json_int(&j, "time_to_ready_ms", app->servers[i]->ready_time);
+                }
+                json_int(&j, "generation", app->servers[i]->generation);
+                output_usage(&j, app->servers[i]);
+            }
+            if (app->outgoing_servers[i] != NULL) {
+                json_int(&j, "outgoing_pid", app->outgoing_servers[i]->pid);
+            }
+            if (app->placements != NULL) {
+                format_cpulist(&app->placements[i].cpus, cpulist, sizeof cpulist);
+                json_string(&j, "cpus", cpulist);
+                json_int(&j, "numa_node", app->placements[i].node >= 0 ? app->node_ids[app->placements[i].node] : -1);
+            }
+            json_object_end(&j);
+        }
+        json_array_end(&j);
+        json_int(&j, "standby_count", app->num_standbys);
+        json_int(&j, "standby_failures", app->standby_health.failures);
+        json_array_begin(&j, "standbys");
+        for (i = 0; i < app->num_standbys; i++) {
+            if (app->standbys[i] != NULL) {
+                json_object_begin(&j, NULL);
+                json_int(&j, "pid", app->standbys[i]->pid);
+                json_string(&j, "status", readiness_name(app->standbys[i]->readiness));
+                json_int(&j, "generation", app->standbys[i]->generation);
+                json_object_end(&j);
+            }
+        }
+        json_array_end(&j);
+        json_int(&j, "draining_count", app->stat_draining_node_count);
+        json_array_begin(&j, "draining_pids");
+        for (child = app->draining_servers; child != NULL; child = child->drain_next) {
+            json_int(&j, NULL, child->pid);
+        }
+        json_array_end(&j);
+        json_array_begin(&j, "draining");
+        /* Counted by the last drain poll, -1 before the first. */
+        for (child = app->draining_servers; child != NULL; child = child->drain_next) {
+            json_object_begin(&j, NULL);
+            json_int(&j, "pid", child->pid);
+            json_int(&j, "slot", child->slot);
+            json_int(&j, "generation", child->generation);
+            json_int(&j, "connections", child->connections);
+            output_usage(&j, child);
+            json_int(&j, "draining_ms", event_now() - child->drain_start);
+            json_string(&j, "phase",
+                        (child->drain_signals == 0 ? "draining" : child->drain_signals == 1 ? "terminated" : "killed"));
+            json_object_end(&j);
+        }
+        json_array_end(&j);
+        json_object_end(&j);
 
-    if (r != 0) {
-        syslog(LOG_ERR, "couldn't signal output state caller %d: %m", caller);
+        json_object_begin(&j, "migrations");
+        for (i = 0, r = 0; i < app->copies; i++) {
+            if (app->outgoing_servers[i] != NULL) {
+                r++;
+            }
+        }
+        json_string(&j, "status",
+                    (r > 0 ? "waiting for ready" : timer_armed(&app->migrate_timer) ? "pausing" : app->migrating ? "rolling" : "idle"));
+        json_int(&j, "nodes_waiting", r);
+        json_int(&j, "generation", app->generation);
+        json_int(&j, "batch", app->migrate_batch);
+        json_bool(&j, "batch_percent", app->migrate_batch_percent);
+        json_int(&j, "pause", app->migrate_pause);
+        json_int(&j, "ready_timeout", app->ready_timeout);
+        json_int(&j, "requests", app->stat_migrate_request_count);
+        json_string(&j, "last_request_time", app->stat_migrate_last_request_time);
+        json_int(&j, "nodes_requested", app->stat_migrate_node_count);
+        json_int(&j, "nodes_completed", app->stat_migrate_node_count - app->stat_draining_node_count);
+        json_int(&j, "nodes_uncompleted", app->stat_draining_node_count);
+        json_int(&j, "drain_timeout", app->drain_timeout);
+        json_int(&j, "drain_kill_timeout", app->drain_kill_timeout);
+        json_string(&j, "last_node_time", app->stat_migrate_last_node_time);
+        json_object_end(&j);
+
+        json_object_begin(&j, "restarts");
+        json_int(&j, "requests", app->stat_restart_request_count);
+        json_string(&j, "last_request_time", app->stat_restart_last_request_time);
+        json_int(&j, "nodes_expected", app->stat_restart_node_expected_count);
+        json_string(&j, "last_node_expected_time", app->stat_restart_last_node_expected_time);
+        json_int(&j, "nodes_unexpected", app->stat_restart_node_unexpected_count);
+        json_string(&j, "last_node_unexpected_time", app->stat_restart_last_node_unexpected_time);
+        json_object_end(&j);
+
+        json_object_end(&j);
     }
+    json_array_end(&j);
+    json_int(&j, "state_requests", stat_state_request_count);
 
+    json_object_end(&j);
 }
 
 #if defined(DEBUG)
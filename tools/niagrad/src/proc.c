@@ -0,0 +1,128 @@
+/* Copyright: Apkudo LLC 2014: See LICENSE file. */
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "proc.h"
+#include "str.h"
+
+#define MAX_PROC_PATH 64
+#define MAX_STAT_LINE 1024
+
+static int read_stat(pid_t pid, struct proc_usage *usage);
+static long read_pss(pid_t pid);
+static int count_fds(pid_t pid);
+
+/**
+ * Fill in 'usage' for 'pid'. Return 0 on success and -1 if the process
+ * could not be read, e.g. because it has exited.
+ */
+int
+proc_usage(pid_t pid, struct proc_usage *usage)
+{
+    if (read_stat(pid, usage) == -1) {
+        return -1;
+    }
+
+    usage->pss_kb = read_pss(pid);
+    usage->fds = count_fds(pid);
+
+    return 0;
+}
+
+/* The command name in /proc/<pid>/stat may contain spaces and brackets,
+   so the fields are found after its last ')'. */
+static int
+read_stat(pid_t pid, struct proc_usage *usage)
+{
+    char path[MAX_PROC_PATH], line[MAX_STAT_LINE];
+    unsigned long utime, stime;
+    long threads, rss;
+    char *fields;
+    FILE *f;
+    int n;
+
+    (void) snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    n = str_readline(f, line, sizeof line);
+    (void) fclose(f);
+
+    fields = strrchr(line, ')');
+    if (n <= 0 || fields == NULL) {
+        return -1;
+    }
+
+    /* Fields 3 to 24: state ... utime stime ... num_threads ... rss */
+    n = sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+               &utime, &stime, &threads, &rss);
+    if (n != 4) {
+        return -1;
+    }
+
+    usage->cpu_ms = (uint64_t) (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+    usage->threads = (int) threads;
+    usage->rss_kb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+
+    return 0;
+}
+
+/* smaps_rollup needs Linux 4.14. */
+static long
+read_pss(pid_t pid)
+{
+    char path[MAX_PROC_PATH], line[MAX_STAT_LINE];
+    long pss = -1;
+    FILE *f;
+
+    (void) snprintf(path, sizeof path, "/proc/%d/smaps_rollup", (int) pid);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    while (str_readline(f, line, sizeof line) > 0) {
+        if (sscanf(line, "Pss: %ld kB", &pss) == 1) {
+            break;
+        }
+    }
+
+    (void) fclose(f);
+
+    return pss;
+}
+
+static int
+count_fds(pid_t pid)
+{
+    char path[MAX_PROC_PATH];
+    struct dirent *entry;
+    DIR *dir;
+    int n = 0;
+
+    (void) snprintf(path, sizeof path, "/proc/%d/fd", (int) pid);
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            n++;
+        }
+    }
+
+    (void) closedir(dir);
+
+    return n;
+}
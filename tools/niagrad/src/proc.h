@@ -0,0 +1,18 @@
+#ifndef PROC_H_
+#define PROC_H_
+
+/*
+ * Resource usage of a process, read from /proc.
+ */
+
+struct proc_usage {
+    uint64_t cpu_ms; /* user and system time since the process started */
+    long rss_kb;
+    long pss_kb; /* -1 if the kernel does not provide it */
+    int fds;
+    int threads;
+};
+
+int proc_usage(pid_t pid, struct proc_usage *usage);
+
+#endif /* PROC_H_ */